@@ -0,0 +1,135 @@
+/*
+**
+** Journaled storage of a small record in an I2C EEPROM for MezmerizeB1Buffer
+**
+** Copyright (c) 2023 Carsten Grønning, Jan Abkjer Tofft
+**
+*/
+
+#include "EEPROMJournal.h"
+#include <string.h>
+
+#define JOURNAL_EMPTY 0xFFFFFFFF // Sequence number read from a slot that has never been written
+
+uint16_t crc16(const uint8_t *Data, uint16_t Length, uint16_t Crc)
+{
+  while (Length--)
+  {
+    Crc ^= (uint16_t)*Data++ << 8;
+    for (uint8_t i = 0; i < 8; i++)
+      Crc = (Crc & 0x8000) ? (Crc << 1) ^ 0x1021 : Crc << 1;
+  }
+  return Crc;
+}
+
+EEPROMJournal::EEPROMJournal(extEEPROM &Eeprom, uint16_t Address, uint16_t Slots, uint8_t SlotSize)
+    : eeprom(Eeprom), address(Address), slots(Slots), slotSize(SlotSize > EEPROM_JOURNAL_MAX_SLOT_SIZE ? EEPROM_JOURNAL_MAX_SLOT_SIZE : SlotSize), lastSequence(0), lastSlot(Slots - 1), preparedSize(0)
+{
+}
+
+bool EEPROMJournal::readSequence(uint16_t Slot, uint32_t &Sequence)
+{
+  uint8_t Header[4];
+  if (eeprom.read(address + (uint32_t)Slot * slotSize, Header, sizeof(Header)) != 0)
+    return false;
+  Sequence = (uint32_t)Header[0] | ((uint32_t)Header[1] << 8) | ((uint32_t)Header[2] << 16) | ((uint32_t)Header[3] << 24);
+  return true;
+}
+
+bool EEPROMJournal::readRecord(uint16_t Slot, uint8_t *Data, uint8_t Length, uint32_t &Sequence)
+{
+  uint8_t Buffer[EEPROM_JOURNAL_MAX_SLOT_SIZE];
+  if (eeprom.read(address + (uint32_t)Slot * slotSize, Buffer, HeaderSize + Length + TrailerSize) != 0)
+    return false;
+  uint16_t Crc = Buffer[HeaderSize + Length] | (Buffer[HeaderSize + Length + 1] << 8);
+  if (Buffer[4] != Length || crc16(Buffer, HeaderSize + Length) != Crc)
+    return false;
+  Sequence = (uint32_t)Buffer[0] | ((uint32_t)Buffer[1] << 8) | ((uint32_t)Buffer[2] << 16) | ((uint32_t)Buffer[3] << 24);
+  if (Sequence == JOURNAL_EMPTY)
+    return false;
+  memcpy(Data, &Buffer[HeaderSize], Length);
+  return true;
+}
+
+bool EEPROMJournal::read(uint8_t *Data, uint8_t Length)
+{
+  lastSequence = 0;
+  lastSlot = slots - 1; // The first write goes to slot 0
+  if (HeaderSize + Length + TrailerSize > slotSize)
+    return false;
+
+  uint32_t First;
+  if (!readSequence(0, First))
+    return false;
+
+  // Slots 0 to the newest hold consecutive sequence numbers - find the last one of them
+  uint16_t Low = 0, High = slots - 1;
+  if (First != JOURNAL_EMPTY)
+  {
+    while (Low < High)
+    {
+      uint16_t Middle = (Low + High + 1) / 2;
+      uint32_t Sequence;
+      if (readSequence(Middle, Sequence) && Sequence == First + Middle)
+        Low = Middle;
+      else
+        High = Middle - 1;
+    }
+  }
+
+  // Use the newest record with a valid CRC - going backwards around the ring if the newest is damaged
+  for (uint16_t i = 0; i < slots; i++)
+  {
+    uint16_t Slot = (Low + slots - i) % slots;
+    uint32_t Sequence;
+    if (readRecord(Slot, Data, Length, Sequence))
+    {
+      lastSequence = Sequence;
+      lastSlot = Slot;
+      return true;
+    }
+    if (First == JOURNAL_EMPTY)
+      break; // Nothing has been written yet - no need to look further
+  }
+  return false;
+}
+
+bool EEPROMJournal::write(const uint8_t *Data, uint8_t Length)
+{
+  return prepare(Data, Length) && writePrepared();
+}
+
+bool EEPROMJournal::prepare(const uint8_t *Data, uint8_t Length)
+{
+  preparedSize = 0;
+  if (HeaderSize + Length + TrailerSize > slotSize)
+    return false;
+
+  uint32_t Sequence = lastSequence + 1;
+  prepared[0] = Sequence;
+  prepared[1] = Sequence >> 8;
+  prepared[2] = Sequence >> 16;
+  prepared[3] = Sequence >> 24;
+  prepared[4] = Length;
+  memcpy(&prepared[HeaderSize], Data, Length);
+  uint16_t Crc = crc16(prepared, HeaderSize + Length);
+  prepared[HeaderSize + Length] = Crc;
+  prepared[HeaderSize + Length + 1] = Crc >> 8;
+  preparedSize = HeaderSize + Length + TrailerSize;
+  return true;
+}
+
+bool EEPROMJournal::writePrepared()
+{
+  if (preparedSize == 0)
+    return false;
+
+  uint16_t Slot = (lastSlot + 1) % slots;
+  uint8_t Size = preparedSize;
+  preparedSize = 0;
+  if (eeprom.write(address + (uint32_t)Slot * slotSize, prepared, Size) != 0)
+    return false;
+  lastSequence++;
+  lastSlot = Slot;
+  return true;
+}
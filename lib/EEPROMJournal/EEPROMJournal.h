@@ -0,0 +1,71 @@
+/*
+**
+** Journaled storage of a small record in an I2C EEPROM for MezmerizeB1Buffer
+**
+** Copyright (c) 2023 Carsten Grønning, Jan Abkjer Tofft
+**
+** The journal is a ring of slots, each exactly one EEPROM page, so every save is a single page write to the next slot and the
+** wear is spread evenly over all slots. A slot holds:
+**
+**   uint32_t Sequence | uint8_t Length | Length bytes of data | uint16_t CRC (CRC-16/CCITT of the preceding bytes)
+**
+** The sequence number is one higher for each save, so the newest record is found by a binary search for the last slot whose
+** sequence number is the one of slot 0 plus its index. A record with a wrong CRC (ie. a write interrupted by loss of power) is
+** skipped and the record before it is used instead.
+**
+*/
+
+#ifndef EEPROMJournal_h
+#define EEPROMJournal_h
+
+#include <extEEPROM.h>
+
+#define EEPROM_JOURNAL_MAX_SLOT_SIZE 64 // Largest slot (page) size supported
+
+// CRC-16/CCITT (polynomial 0x1021) - call with the result of the previous call as Crc to continue a calculation
+uint16_t crc16(const uint8_t *Data, uint16_t Length, uint16_t Crc = 0xFFFF);
+
+class EEPROMJournal
+{
+public:
+  static const uint8_t HeaderSize = 5;  // Sequence and Length
+  static const uint8_t TrailerSize = 2; // CRC
+
+  // The journal uses Slots slots of SlotSize bytes starting at Address. SlotSize should be the page size of the EEPROM (at most EEPROM_JOURNAL_MAX_SLOT_SIZE)
+  // and Address must be at the start of a page
+  EEPROMJournal(extEEPROM &Eeprom, uint16_t Address, uint16_t Slots, uint8_t SlotSize);
+
+  // Find the newest valid record and copy it to Data. Returns false if the journal holds no valid record of Length bytes
+  bool read(uint8_t *Data, uint8_t Length);
+
+  // Save Data as the newest record. Returns false if the EEPROM write fails or the record does not fit in a slot
+  bool write(const uint8_t *Data, uint8_t Length);
+
+  // Build the record for Data in advance, so writePrepared() can save it with nothing but a single page write (ie. when the power fails).
+  // The prepared record is discarded by the next write() - prepare it again after that
+  bool prepare(const uint8_t *Data, uint8_t Length);
+
+  // Save the record built by prepare() as the newest record. Returns false if no record is prepared or the EEPROM write fails
+  bool writePrepared();
+
+  // Sequence number of the newest record (0 if none)
+  uint32_t sequence() const { return lastSequence; }
+
+  // Slot the newest record is stored in
+  uint16_t slot() const { return lastSlot; }
+
+private:
+  bool readSequence(uint16_t Slot, uint32_t &Sequence);
+  bool readRecord(uint16_t Slot, uint8_t *Data, uint8_t Length, uint32_t &Sequence);
+
+  extEEPROM &eeprom;
+  uint16_t address;
+  uint16_t slots;
+  uint8_t slotSize;
+  uint32_t lastSequence;
+  uint16_t lastSlot;
+  uint8_t prepared[EEPROM_JOURNAL_MAX_SLOT_SIZE]; // Record built by prepare()
+  uint8_t preparedSize;                           // Bytes in prepared (0 if nothing is prepared)
+};
+
+#endif
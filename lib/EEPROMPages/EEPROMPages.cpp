@@ -0,0 +1,32 @@
+/*
+**
+** Page by page writes of data kept in an I2C EEPROM for MezmerizeB1Buffer
+**
+** Copyright (c) 2023 Carsten Grønning, Jan Abkjer Tofft
+**
+*/
+
+#include <string.h>
+#include "EEPROMPages.h"
+
+bool writeChangedPages(uint16_t Address, const uint8_t *Data, uint8_t *Saved, uint16_t Length, uint16_t PageSize, EEPROMPageWriter Write, uint32_t &PagesWritten)
+{
+  uint16_t Offset = 0;
+  while (Offset < Length)
+  {
+    // Write up to the end of the page Address + Offset is in
+    uint16_t Count = PageSize - (Address + Offset) % PageSize;
+    if (Count > Length - Offset)
+      Count = Length - Offset;
+    if (Saved == NULL || memcmp(&Data[Offset], &Saved[Offset], Count) != 0)
+    {
+      if (!Write(Address + Offset, &Data[Offset], Count))
+        return false;
+      if (Saved != NULL)
+        memcpy(&Saved[Offset], &Data[Offset], Count);
+      PagesWritten++;
+    }
+    Offset += Count;
+  }
+  return true;
+}
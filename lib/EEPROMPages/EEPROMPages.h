@@ -0,0 +1,27 @@
+/*
+**
+** Page by page writes of data kept in an I2C EEPROM for MezmerizeB1Buffer
+**
+** Copyright (c) 2023 Carsten Grønning, Jan Abkjer Tofft
+**
+** Data is written one EEPROM page at a time, and only the pages that differ from a copy of what the EEPROM holds are written - so a
+** change of a single setting is a single page write (one write cycle of ~5 ms) instead of a rewrite of all of the data. As every write
+** is a page of its own, a write can be stopped between two pages (ie. when the power fails).
+**
+*/
+
+#ifndef EEPROMPages_h
+#define EEPROMPages_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Write Length bytes (within one page) to the EEPROM at Address - returns false if the write fails (or should not be done)
+typedef bool (*EEPROMPageWriter)(uint16_t Address, const uint8_t *Data, uint16_t Length);
+
+// Write the parts of Data that differ from Saved (a copy of what the EEPROM holds at Address) with one call of Write per page - all of Data if
+// Saved is NULL. Saved is updated with what has been written. Stops at the first write that fails and returns false
+// PagesWritten is increased by the number of pages written
+bool writeChangedPages(uint16_t Address, const uint8_t *Data, uint8_t *Saved, uint16_t Length, uint16_t PageSize, EEPROMPageWriter Write, uint32_t &PagesWritten);
+
+#endif
@@ -0,0 +1,62 @@
+/*
+**
+** Hash table mapping received IR codes to keys for MezmerizeB1Buffer
+**
+** Copyright (c) 2023 Carsten Grønning, Jan Abkjer Tofft
+**
+*/
+
+#include "IRKeyMap.h"
+
+IRKeyMap::IRKeyMap()
+{
+  clear();
+}
+
+void IRKeyMap::clear()
+{
+  for (uint8_t i = 0; i < IRKEYMAP_SIZE; i++)
+    table[i].key = NO_KEY;
+  entries = 0;
+}
+
+// Return the slot holding the code or the empty slot where it should be inserted
+uint8_t IRKeyMap::slot(uint8_t protocol, uint16_t address, uint16_t command) const
+{
+  uint16_t h = (address * 0x9E37u) ^ (command * 0x85EBu) ^ (protocol * 0xC2B3u);
+  uint8_t i = (h ^ (h >> 8)) & (IRKEYMAP_SIZE - 1);
+
+  // The table is never filled completely (see add) so the loop will always end at an empty slot
+  while (table[i].key != NO_KEY && (table[i].protocol != protocol || table[i].address != address || table[i].command != command))
+    i = (i + 1) & (IRKEYMAP_SIZE - 1);
+  return i;
+}
+
+bool IRKeyMap::add(uint8_t protocol, uint16_t address, uint16_t command, uint8_t key)
+{
+  if (key == NO_KEY)
+    return false;
+
+  uint8_t i = slot(protocol, address, command);
+  if (table[i].key == NO_KEY)
+  {
+    if (entries >= IRKEYMAP_SIZE - 1)
+      return false;
+    table[i].protocol = protocol;
+    table[i].address = address;
+    table[i].command = command;
+    entries++;
+  }
+  table[i].key = key;
+  return true;
+}
+
+uint8_t IRKeyMap::find(uint8_t protocol, uint16_t address, uint16_t command) const
+{
+  uint8_t key = table[slot(protocol, address, command)].key;
+
+  // Codes learned without protocol information matches any protocol
+  if (key == NO_KEY && protocol != 0)
+    key = table[slot(0, address, command)].key;
+  return key;
+}
@@ -0,0 +1,54 @@
+/*
+**
+** Hash table mapping received IR codes to keys for MezmerizeB1Buffer
+**
+** Copyright (c) 2023 Carsten Grønning, Jan Abkjer Tofft
+**
+** The table is indexed by (protocol, address, command) using open addressing with linear probing,
+** so a lookup normally only touches one or two slots no matter how many codes are bound.
+** A code bound with protocol 0 (unknown) matches that address and command received with any protocol.
+**
+*/
+
+#ifndef IRKeyMap_h
+#define IRKeyMap_h
+
+#include <stdint.h>
+
+#define IRKEYMAP_SIZE 64 // Number of slots - must be a power of 2 and should be at least 25% larger than the number of codes bound
+
+class IRKeyMap
+{
+public:
+  static const uint8_t NO_KEY = 0; // Returned by find() if the code is not bound. Marks an empty slot, so a code can not be bound to key 0
+
+  IRKeyMap();
+
+  // Remove all codes from the map
+  void clear();
+
+  // Bind a code to a key. If the code is already bound the key is replaced. Returns false if the map is full or key is NO_KEY
+  bool add(uint8_t protocol, uint16_t address, uint16_t command, uint8_t key);
+
+  // Return the key bound to the code or NO_KEY
+  uint8_t find(uint8_t protocol, uint16_t address, uint16_t command) const;
+
+  // Number of codes in the map
+  uint8_t count() const { return entries; }
+
+private:
+  struct Entry
+  {
+    uint16_t address;
+    uint16_t command;
+    uint8_t protocol;
+    uint8_t key;
+  };
+
+  uint8_t slot(uint8_t protocol, uint16_t address, uint16_t command) const;
+
+  Entry table[IRKEYMAP_SIZE];
+  uint8_t entries;
+};
+
+#endif
@@ -0,0 +1,43 @@
+/*
+**
+** Conversion of NTC readings to temperatures for MezmerizeB1Buffer
+**
+** Copyright (c) 2023 Carsten Grønning, Jan Abkjer Tofft
+**
+*/
+
+#include <math.h>
+#include "NTCTable.h"
+
+void NTCTable::build(float R25, float Beta, float RRef)
+{
+  for (uint16_t i = 0; i < NTC_TABLE_SIZE; i++)
+  {
+    float Ratio = (float)(i << NTC_TABLE_SHIFT) / 4095; // Vout / Vin
+    float Temp;
+    if (Ratio >= 1)
+      Temp = 0; // No NTC connected
+    else if (Ratio <= 0)
+      Temp = 99;
+    else
+    {
+      float Rntc = RRef * Ratio / (1 - Ratio); // The resistance of the NTC
+      Temp = 1 / (1 / 298.15 + log(Rntc / R25) / Beta) - 273.15;
+    }
+    if (Temp < 0)
+      Temp = 0;
+    else if (Temp > 99)
+      Temp = 99;
+    table[i] = round(Temp * 100);
+  }
+}
+
+int16_t NTCTable::temperature(uint32_t Code) const
+{
+  const uint8_t Shift = NTC_TABLE_SHIFT + NTC_OVERSAMPLE_BITS;
+  uint32_t Index = Code >> Shift;
+  if (Index >= NTC_TABLE_SIZE - 1)
+    return table[NTC_TABLE_SIZE - 1];
+  int32_t Fraction = Code & ((1 << Shift) - 1);
+  return table[Index] + (((table[Index + 1] - table[Index]) * Fraction) >> Shift);
+}
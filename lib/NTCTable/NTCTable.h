@@ -0,0 +1,36 @@
+/*
+**
+** Conversion of NTC readings to temperatures for MezmerizeB1Buffer
+**
+** Copyright (c) 2023 Carsten Grønning, Jan Abkjer Tofft
+**
+** The temperature is looked up in a table with one entry for every 2^NTC_TABLE_SHIFT ADC codes and linear interpolation between the
+** entries, so no floating point math is needed per measurement. The table is calculated once from the values of the NTC using the Beta
+** equation. The NTC is connected from the ADC input to ground, with the reference resistor from the input to Vin.
+** The codes looked up have NTC_OVERSAMPLE_BITS extra bits of resolution from adding up several readings.
+**
+*/
+
+#ifndef NTCTable_h
+#define NTCTable_h
+
+#include <stdint.h>
+
+#define NTC_TABLE_SHIFT 4                              // 2^4 = 16 ADC codes between the entries of the table
+#define NTC_TABLE_SIZE ((4096 >> NTC_TABLE_SHIFT) + 1) // Entries for ADC codes 0, 16, 32 ... 4096
+#define NTC_OVERSAMPLE_BITS 3                          // 2^3 = 8 readings are added up per measurement
+
+class NTCTable
+{
+public:
+  // Calculate the table - R25 is the resistance of the NTC at 25 degrees Celcius and RRef the reference resistor, both in ohms
+  void build(float R25, float Beta, float RRef);
+
+  // Return the temperature in 1/100 degrees Celcius of a 12 bit ADC code with NTC_OVERSAMPLE_BITS extra bits
+  int16_t temperature(uint32_t Code) const;
+
+private:
+  int16_t table[NTC_TABLE_SIZE]; // Temperature in 1/100 degrees Celcius for each entry
+};
+
+#endif
@@ -0,0 +1,138 @@
+/*
+**
+** Temperature history for MezmerizeB1Buffer
+**
+** Copyright (c) 2023 Carsten Grønning, Jan Abkjer Tofft
+**
+** Keeps the temperatures of the two NTCs in three fixed size ring buffers:
+**   - one sample per second
+**   - min/max/average per minute
+**   - min/max/average per hour
+** All memory is allocated at compile time - the size is given by the TEMP_HISTORY_xxx values.
+** Temperatures are kept in 1/10 degrees Celcius.
+**
+*/
+
+#ifndef TemperatureHistory_h
+#define TemperatureHistory_h
+
+#include <stdint.h>
+
+#ifndef TEMP_HISTORY_SECONDS
+#define TEMP_HISTORY_SECONDS 600 // 10 minutes of samples per second
+#endif
+#ifndef TEMP_HISTORY_MINUTES
+#define TEMP_HISTORY_MINUTES 720 // 12 hours of minute aggregates
+#endif
+#ifndef TEMP_HISTORY_HOURS
+#define TEMP_HISTORY_HOURS 168 // 7 days of hour aggregates
+#endif
+
+#define TEMP_HISTORY_CHANNELS 2
+
+// Ring buffer addressed by absolute index - the index of an element never changes, so a reader can continue where it left off
+// even if new elements have been added in between. Elements older than the N latest are gone.
+template <typename T, uint16_t N>
+class HistoryRing
+{
+public:
+  void push(const T &Value)
+  {
+    buffer[head % N] = Value;
+    head++;
+  }
+
+  // Absolute index of the oldest element still available
+  uint32_t first() const { return head > N ? head - N : 0; }
+
+  // Absolute index of the next element to be added
+  uint32_t next() const { return head; }
+
+  // Copy the element with the absolute index to Value - returns false if it is not available (yet or anymore)
+  bool get(uint32_t Index, T &Value) const
+  {
+    if (Index < first() || Index >= head)
+      return false;
+    Value = buffer[Index % N];
+    return true;
+  }
+
+private:
+  T buffer[N];
+  uint32_t head = 0;
+};
+
+struct TemperatureSample
+{
+  int16_t Temp[TEMP_HISTORY_CHANNELS];
+};
+
+struct TemperatureAggregate
+{
+  int16_t Min[TEMP_HISTORY_CHANNELS];
+  int16_t Max[TEMP_HISTORY_CHANNELS];
+  int16_t Avg[TEMP_HISTORY_CHANNELS];
+};
+
+class TemperatureHistory
+{
+public:
+  // Add the sample of one second. Minute and hour aggregates are added when complete
+  void add(const TemperatureSample &Sample)
+  {
+    seconds.push(Sample);
+
+    for (uint8_t c = 0; c < TEMP_HISTORY_CHANNELS; c++)
+      accumulate(minute, Sample.Temp[c], Sample.Temp[c], Sample.Temp[c], c);
+    if (++minute.Count == 60)
+    {
+      TemperatureAggregate Aggregate = complete(minute);
+      minutes.push(Aggregate);
+
+      for (uint8_t c = 0; c < TEMP_HISTORY_CHANNELS; c++)
+        accumulate(hour, Aggregate.Min[c], Aggregate.Max[c], Aggregate.Avg[c], c);
+      if (++hour.Count == 60)
+        hours.push(complete(hour));
+    }
+  }
+
+  HistoryRing<TemperatureSample, TEMP_HISTORY_SECONDS> seconds;
+  HistoryRing<TemperatureAggregate, TEMP_HISTORY_MINUTES> minutes;
+  HistoryRing<TemperatureAggregate, TEMP_HISTORY_HOURS> hours;
+
+private:
+  struct Accumulator
+  {
+    int16_t Min[TEMP_HISTORY_CHANNELS];
+    int16_t Max[TEMP_HISTORY_CHANNELS];
+    int32_t Sum[TEMP_HISTORY_CHANNELS];
+    uint8_t Count;
+  };
+
+  void accumulate(Accumulator &Acc, int16_t Min, int16_t Max, int16_t Avg, uint8_t Channel)
+  {
+    if (Acc.Count == 0 || Min < Acc.Min[Channel])
+      Acc.Min[Channel] = Min;
+    if (Acc.Count == 0 || Max > Acc.Max[Channel])
+      Acc.Max[Channel] = Max;
+    Acc.Sum[Channel] = (Acc.Count == 0) ? Avg : Acc.Sum[Channel] + Avg;
+  }
+
+  TemperatureAggregate complete(Accumulator &Acc)
+  {
+    TemperatureAggregate Aggregate;
+    for (uint8_t c = 0; c < TEMP_HISTORY_CHANNELS; c++)
+    {
+      Aggregate.Min[c] = Acc.Min[c];
+      Aggregate.Max[c] = Acc.Max[c];
+      Aggregate.Avg[c] = Acc.Sum[c] / Acc.Count;
+    }
+    Acc.Count = 0;
+    return Aggregate;
+  }
+
+  Accumulator minute = {};
+  Accumulator hour = {};
+};
+
+#endif
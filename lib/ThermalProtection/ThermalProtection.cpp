@@ -0,0 +1,77 @@
+/*
+**
+** Over-temperature protection for MezmerizeB1Buffer
+**
+** Copyright (c) 2023 Carsten Grønning, Jan Abkjer Tofft
+**
+*/
+
+#include "ThermalProtection.h"
+
+ThermalProtection::ThermalProtection()
+    : tripTemp(0), warningMargin(0), hysteresis(0), maxRiseRate(0), riseRateMargin(0),
+      currentState(NORMAL), lastTemp(0), rate(0), tripTimestamp(0), tripByRate(false), rateNext(0), rateCount(0)
+{
+}
+
+void ThermalProtection::configure(float TripTemp, float WarningMargin, float Hysteresis, float MaxRiseRate, float RiseRateMargin)
+{
+  tripTemp = TripTemp;
+  warningMargin = WarningMargin;
+  hysteresis = Hysteresis;
+  maxRiseRate = MaxRiseRate;
+  riseRateMargin = RiseRateMargin;
+}
+
+ThermalProtection::State ThermalProtection::update(float Temp, uint32_t Timestamp)
+{
+  lastTemp = Temp;
+
+  // Keep one sample per RateInterval for calculating the rate of rise
+  uint8_t Newest = (rateNext + THERMAL_RATE_SAMPLES - 1) % THERMAL_RATE_SAMPLES;
+  if (rateCount == 0 || Timestamp - rateTimestamps[Newest] >= RateInterval)
+  {
+    rateSamples[rateNext] = Temp;
+    rateTimestamps[rateNext] = Timestamp;
+    rateNext = (rateNext + 1) % THERMAL_RATE_SAMPLES;
+    if (rateCount < THERMAL_RATE_SAMPLES)
+      rateCount++;
+  }
+  if (rateCount == THERMAL_RATE_SAMPLES)
+  {
+    uint8_t Oldest = rateNext; // The ring buffer is full, so the next position holds the oldest sample
+    uint32_t Time = Timestamp - rateTimestamps[Oldest];
+    rate = (Time > 0) ? (Temp - rateSamples[Oldest]) * 60000.0f / Time : 0;
+  }
+
+  if (tripTemp <= 0) // Protection not active
+  {
+    currentState = NORMAL;
+    return currentState;
+  }
+
+  if (currentState != TRIPPED)
+  {
+    bool OverTemp = Temp >= tripTemp;
+    bool OverRate = maxRiseRate > 0 && rateCount == THERMAL_RATE_SAMPLES && rate >= maxRiseRate && Temp >= tripTemp - riseRateMargin;
+    if (OverTemp || OverRate)
+    {
+      currentState = TRIPPED;
+      tripTimestamp = Timestamp;
+      tripByRate = !OverTemp;
+    }
+    else if (Temp >= tripTemp - warningMargin)
+      currentState = WARNING;
+    else if (currentState == WARNING && Temp < tripTemp - warningMargin - hysteresis)
+      currentState = NORMAL;
+  }
+  return currentState;
+}
+
+bool ThermalProtection::reset()
+{
+  if (currentState == TRIPPED && tripTemp > 0 && lastTemp >= tripTemp - hysteresis)
+    return false;
+  currentState = NORMAL;
+  return true;
+}
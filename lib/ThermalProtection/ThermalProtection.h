@@ -0,0 +1,77 @@
+/*
+**
+** Over-temperature protection for MezmerizeB1Buffer
+**
+** Copyright (c) 2023 Carsten Grønning, Jan Abkjer Tofft
+**
+** State machine for one temperature sensor, fed with filtered temperatures at a fixed rate:
+**
+**   NORMAL  -> WARNING  when the temperature reaches TripTemp - WarningMargin
+**   WARNING -> NORMAL   when the temperature falls below TripTemp - WarningMargin - Hysteresis
+**   any     -> TRIPPED  when the temperature reaches TripTemp, or when it rises faster than MaxRiseRate while above
+**                       TripTemp - RiseRateMargin (a fast rise means something is wrong long before the absolute limit is reached)
+**   TRIPPED -> NORMAL   only by reset(), which is refused until the temperature has fallen below TripTemp - Hysteresis
+**
+*/
+
+#ifndef ThermalProtection_h
+#define ThermalProtection_h
+
+#include <stdint.h>
+
+#define THERMAL_RATE_SAMPLES 11 // Number of samples the rate of rise is calculated over (one per RateInterval)
+
+class ThermalProtection
+{
+public:
+  enum State
+  {
+    NORMAL,
+    WARNING,
+    TRIPPED
+  };
+
+  ThermalProtection();
+
+  // Set the limits - a TripTemp of 0 disables the protection. Temperatures in degrees Celcius, MaxRiseRate in degrees Celcius per minute
+  void configure(float TripTemp, float WarningMargin, float Hysteresis, float MaxRiseRate, float RiseRateMargin);
+
+  // Add a temperature measured at Timestamp (milliseconds) and return the new state
+  State update(float Temp, uint32_t Timestamp);
+
+  // Leave the TRIPPED state - returns false (and stays TRIPPED) if the temperature is still too high
+  bool reset();
+
+  State state() const { return currentState; }
+
+  // The rate of rise in degrees Celcius per minute (0 until enough samples are collected)
+  float riseRate() const { return rate; }
+
+  // Timestamp of the sample that caused the trip
+  uint32_t trippedAt() const { return tripTimestamp; }
+
+  // True if the trip was caused by the rate of rise rather than the absolute temperature
+  bool trippedByRate() const { return tripByRate; }
+
+private:
+  static const uint32_t RateInterval = 1000; // Milliseconds between the samples used for the rate of rise
+
+  float tripTemp;
+  float warningMargin;
+  float hysteresis;
+  float maxRiseRate;
+  float riseRateMargin;
+
+  State currentState;
+  float lastTemp;
+  float rate;
+  uint32_t tripTimestamp;
+  bool tripByRate;
+
+  float rateSamples[THERMAL_RATE_SAMPLES];
+  uint32_t rateTimestamps[THERMAL_RATE_SAMPLES];
+  uint8_t rateNext;
+  uint8_t rateCount;
+};
+
+#endif
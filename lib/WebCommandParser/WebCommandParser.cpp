@@ -0,0 +1,81 @@
+/*
+**
+** Parser of the text commands received from the web clients for MezmerizeB1Buffer
+**
+** Copyright (c) 2023 Carsten Grønning, Jan Abkjer Tofft
+**
+*/
+
+#include <string.h>
+#include "WebCommandParser.h"
+
+// The words accepted as arguments
+static const struct
+{
+  const char *word;
+  uint8_t argument;
+} argumentWords[] = {
+    {"Up", WEB_ARG_UP},
+    {"Down", WEB_ARG_DOWN},
+    {"On", WEB_ARG_ON},
+    {"Standby", WEB_ARG_STANDBY},
+    {"Toggle", WEB_ARG_TOGGLE}};
+
+// True if the length bytes at data are the word (and nothing more)
+static bool equals(const uint8_t *data, size_t length, const char *word)
+{
+  return strlen(word) == length && memcmp(data, word, length) == 0;
+}
+
+WebCommandResult parseWebCommand(const uint8_t *data, size_t length, const WebCommandVerb *verbs, uint8_t verbCount, WebCommand &command)
+{
+  // Split at the first ':' into verb and argument
+  size_t verbLength = 0;
+  while (verbLength < length && data[verbLength] != ':')
+    verbLength++;
+  bool hasArgument = verbLength < length;
+  const uint8_t *arg = data + verbLength + 1;
+  size_t argLength = hasArgument ? length - verbLength - 1 : 0;
+
+  const WebCommandVerb *verb = NULL;
+  for (uint8_t i = 0; i < verbCount && verb == NULL; i++)
+    if (equals(data, verbLength, verbs[i].name))
+      verb = &verbs[i];
+  if (verb == NULL)
+    return WEB_CMD_UNKNOWN_VERB;
+  command.id = verb->id;
+  command.value = 0;
+
+  if (!hasArgument)
+  {
+    command.argument = WEB_ARG_NONE;
+    return (verb->arguments & WEB_ARG_NONE) ? WEB_CMD_OK : WEB_CMD_BAD_ARGUMENT;
+  }
+
+  // A number - optionally negative, and limited to 5 digits so it can not overflow
+  size_t i = (argLength > 0 && arg[0] == '-') ? 1 : 0;
+  if (argLength > i && argLength - i <= 5 && (verb->arguments & WEB_ARG_NUMBER))
+  {
+    int32_t value = 0;
+    for (; i < argLength && arg[i] >= '0' && arg[i] <= '9'; i++)
+      value = value * 10 + (arg[i] - '0');
+    if (i == argLength)
+    {
+      if (arg[0] == '-')
+        value = -value;
+      if (value < verb->min || value > verb->max)
+        return WEB_CMD_OUT_OF_RANGE;
+      command.argument = WEB_ARG_NUMBER;
+      command.value = value;
+      return WEB_CMD_OK;
+    }
+  }
+
+  for (uint8_t w = 0; w < sizeof(argumentWords) / sizeof(argumentWords[0]); w++)
+    if ((verb->arguments & argumentWords[w].argument) && equals(arg, argLength, argumentWords[w].word))
+    {
+      command.argument = argumentWords[w].argument;
+      return WEB_CMD_OK;
+    }
+  return WEB_CMD_BAD_ARGUMENT;
+}
@@ -0,0 +1,58 @@
+/*
+**
+** Parser of the text commands received from the web clients for MezmerizeB1Buffer
+**
+** Copyright (c) 2023 Carsten Grønning, Jan Abkjer Tofft
+**
+** A command is a verb optionally followed by ':' and an argument, eg. "Volume:Up", "Volume:42" or "getValues".
+** The verbs, the arguments they accept and the range of numeric arguments are given by a table, so a command is
+** parsed in one pass over the received bytes without copying them - and no command can match the branch of another.
+**
+*/
+
+#ifndef WebCommandParser_h
+#define WebCommandParser_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Arguments - a verb lists the ones it accepts in WebCommandVerb.arguments
+#define WEB_ARG_NONE 0x01    // No argument (just the verb)
+#define WEB_ARG_NUMBER 0x02  // A decimal number within WebCommandVerb.min - max
+#define WEB_ARG_UP 0x04      // "Up"
+#define WEB_ARG_DOWN 0x08    // "Down"
+#define WEB_ARG_ON 0x10      // "On"
+#define WEB_ARG_STANDBY 0x20 // "Standby"
+#define WEB_ARG_TOGGLE 0x40  // "Toggle"
+
+// Result of parseWebCommand
+enum WebCommandResult
+{
+  WEB_CMD_OK,
+  WEB_CMD_UNKNOWN_VERB,
+  WEB_CMD_BAD_ARGUMENT, // The argument is not one the verb accepts
+  WEB_CMD_OUT_OF_RANGE  // The number is outside min - max of the verb
+};
+
+// An entry of the table of verbs
+struct WebCommandVerb
+{
+  const char *name;  // The verb as sent by the client (case sensitive)
+  uint8_t id;        // Returned in WebCommand.id
+  uint8_t arguments; // The arguments accepted (WEB_ARG_xxx)
+  int16_t min;       // Range of WEB_ARG_NUMBER
+  int16_t max;
+};
+
+// A parsed command
+struct WebCommand
+{
+  uint8_t id;       // WebCommandVerb.id of the verb
+  uint8_t argument; // The WEB_ARG_xxx given
+  int16_t value;    // The number if argument is WEB_ARG_NUMBER
+};
+
+// Parse the command in data (length bytes - it does not need to be terminated) using the table of verbs
+WebCommandResult parseWebCommand(const uint8_t *data, size_t length, const WebCommandVerb *verbs, uint8_t verbCount, WebCommand &command);
+
+#endif
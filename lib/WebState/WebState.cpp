@@ -0,0 +1,45 @@
+/*
+**
+** Formatting of the state sent to the web clients for MezmerizeB1Buffer
+**
+** Copyright (c) 2023 Carsten Grønning, Jan Abkjer Tofft
+**
+*/
+
+#include <stdio.h>
+#include <ArduinoJson.h>
+#include "WebState.h"
+
+typedef StaticJsonDocument<JSON_OBJECT_SIZE(7)> WebStateDocument; // Strings are added as const char *, so they are not copied into the document
+
+void formatAttenuation_dB(char *Buffer, size_t Size, int Attenuation, uint8_t Balance)
+{
+  if (Balance == 127 || Balance < 118 || Balance > 136)
+    snprintf(Buffer, Size, "%.2f", Attenuation / 2.0f);
+  else if (Balance < 127) // Balance shifted to the left channel by lowering the right channel
+    snprintf(Buffer, Size, "%.2f/%.2f", Attenuation / 2.0f, (Attenuation + (127 - Balance)) / 2.0f);
+  else // Balance shifted to the right channel by lowering the left channel
+    snprintf(Buffer, Size, "%.2f/%.2f", (Attenuation + (Balance - 127)) / 2.0f, Attenuation / 2.0f);
+}
+
+const char *serializeWebState(const WebStateValues &Values, char *Buffer, size_t Size)
+{
+  WebStateDocument Doc;
+  if (Values.OnState != NULL)
+    Doc["OnState"] = Values.OnState;
+  if (Values.Input != NULL)
+    Doc["Input"] = Values.Input;
+  if (Values.HasVolume)
+  {
+    Doc["VolumeSteps"] = Values.VolumeSteps;
+    Doc["Volume"] = Values.Volume;
+    Doc["Volume_dB"] = Values.Volume_dB;
+  }
+  if (Values.HasTemperatures)
+  {
+    Doc["Temp1"] = Values.Temp1;
+    Doc["Temp2"] = Values.Temp2;
+  }
+  serializeJson(Doc, Buffer, Size);
+  return Buffer;
+}
@@ -0,0 +1,40 @@
+/*
+**
+** Formatting of the state sent to the web clients for MezmerizeB1Buffer
+**
+** Copyright (c) 2023 Carsten Grønning, Jan Abkjer Tofft
+**
+** The state is serialized as JSON into a buffer given by the caller - no heap is used, as building Strings for every step of a
+** volume change fragments the heap of a controller that runs for months.
+**
+*/
+
+#ifndef WebState_h
+#define WebState_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define WEB_STATE_DB_SIZE 16 // Room for the longest attenuation text ("127.50/127.50")
+
+// The state fields of a message - a field is left out if it is NULL (the texts) or its Has flag is false
+struct WebStateValues
+{
+  const char *OnState; // "On" or "Standby"
+  const char *Input;   // The name of the current input
+  bool HasVolume;
+  uint8_t VolumeSteps;
+  uint8_t Volume;
+  const char *Volume_dB; // See formatAttenuation_dB
+  bool HasTemperatures;
+  int Temp1;
+  int Temp2;
+};
+
+// Format Attenuation (in 0.5 dB steps) in dB - as "left/right" if Balance (127 = center) is shifted less than 10 steps to a side
+void formatAttenuation_dB(char *Buffer, size_t Size, int Attenuation, uint8_t Balance);
+
+// Serialize Values as a JSON object into Buffer (Size bytes) - returns Buffer
+const char *serializeWebState(const WebStateValues &Values, char *Buffer, size_t Size);
+
+#endif
@@ -0,0 +1,110 @@
+#ifndef _BinaryProtocol_
+#define _BinaryProtocol_
+
+/*
+
+Binary WebSocket protocol of the controller
+
+The web page uses text frames ("Volume:Up", "Input:Down" ...) and receives the state as JSON. Apps and automation clients can use this
+binary protocol instead: every frame starts with an opcode followed by a fixed layout of little endian fields, so no parsing of text
+is needed on either side.
+
+A client switches to the binary protocol by sending BIN_HELLO with the version it supports. The controller answers with BIN_HELLO
+and a BIN_STATE snapshot, and from then on that client receives the state as BIN_STATE frames instead of JSON. Text frames are still
+accepted from a client using the binary protocol.
+
+Frames from the client:
+  BIN_HELLO        BinaryHello  - switch to the binary protocol
+  BIN_GET_STATE    BinaryCommand - send a BIN_STATE snapshot (ignored before BIN_HELLO)
+  BIN_SET_VOLUME   BinaryValue  - volume step (0 - VolumeSteps)
+  BIN_STEP_VOLUME  BinaryStep   - change the volume a number of steps
+  BIN_SET_INPUT    BinaryValue  - input 0 - 5
+  BIN_STEP_INPUT   BinaryStep   - 1 = next input, -1 = previous input
+  BIN_SET_POWER    BinaryValue  - BIN_POWER_xxx
+  BIN_SET_BALANCE  BinaryValue  - 118 - 136 (127 = centered, below shifts the balance to the left channel)
+
+Frames from the controller:
+  BIN_HELLO        BinaryHello  - the version used by the controller
+  BIN_STATE        BinaryState  - the state (sent when it changes and when asked for)
+  BIN_ERROR        BinaryError  - a frame was not understood, or BIN_HELLO was refused
+
+*/
+
+#define BINARY_PROTOCOL_VERSION 1
+
+// The first byte of a binary frame
+#define BIN_HELLO 0x01
+#define BIN_GET_STATE 0x02
+#define BIN_SET_VOLUME 0x10
+#define BIN_STEP_VOLUME 0x11
+#define BIN_SET_INPUT 0x12
+#define BIN_STEP_INPUT 0x13
+#define BIN_SET_POWER 0x14
+#define BIN_SET_BALANCE 0x15
+#define BIN_STATE 0x80
+#define BIN_ERROR 0xFF
+
+// Values of BIN_SET_POWER
+#define BIN_POWER_STANDBY 0
+#define BIN_POWER_ON 1
+#define BIN_POWER_TOGGLE 2
+
+// Codes of BIN_ERROR
+#define BIN_ERROR_UNKNOWN_OPCODE 1
+#define BIN_ERROR_LENGTH 2  // The frame is too short for the opcode
+#define BIN_ERROR_VERSION 3 // BIN_HELLO with a version not supported
+#define BIN_ERROR_BUSY 4    // BIN_HELLO while the controller has as many binary clients as it can serve
+
+// The state fields - used in BinaryState.Changed (and for the JSON state sent to the web page)
+#define STATE_ON_STANDBY 0x01 // On
+#define STATE_INPUT 0x02      // Input and InputName
+#define STATE_VOLUME 0x04     // VolumeSteps, Volume, Balance and Attenuation
+#define STATE_TEMPERATURES 0x08
+#define STATE_ALL (STATE_ON_STANDBY | STATE_INPUT | STATE_VOLUME | STATE_TEMPERATURES)
+
+typedef struct __attribute__((packed))
+{
+  uint8_t Opcode;
+} BinaryCommand;
+
+typedef struct __attribute__((packed))
+{
+  uint8_t Opcode;
+  uint8_t Version; // BINARY_PROTOCOL_VERSION
+} BinaryHello;
+
+typedef struct __attribute__((packed))
+{
+  uint8_t Opcode;
+  uint8_t Value;
+} BinaryValue;
+
+typedef struct __attribute__((packed))
+{
+  uint8_t Opcode;
+  int8_t Steps;
+} BinaryStep;
+
+typedef struct __attribute__((packed))
+{
+  uint8_t Opcode;       // BIN_STATE
+  uint8_t Changed;      // The fields changed since the last state sent (STATE_xxx) - all of them in a snapshot
+  uint8_t On;           // 0 = standby, 1 = on
+  uint8_t Input;        // The selected input 0 - 5
+  uint8_t VolumeSteps;  // The number of steps of the volume control
+  uint8_t Volume;       // The volume step
+  uint8_t Balance;      // 127 = centered (see BIN_SET_BALANCE)
+  uint16_t Attenuation; // Attenuation of the volume step in 0.5 dB - the balance lowers one of the channels further by |Balance - 127| * 0.5 dB
+  int16_t Temp1;        // Temperatures in degrees Celcius
+  int16_t Temp2;
+  char InputName[11];   // Name of the selected input
+} BinaryState;
+
+typedef struct __attribute__((packed))
+{
+  uint8_t Opcode;   // BIN_ERROR
+  uint8_t Code;     // BIN_ERROR_xxx
+  uint8_t Rejected; // The opcode of the frame not understood
+} BinaryError;
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef _IRProtocolProfile_
+#define _IRProtocolProfile_
+
+/*
+
+Selection of the IR protocols compiled into the IRMP decoder
+
+The IRMP interrupt runs F_INTERRUPTS times per second and evaluates the state machine of every protocol compiled in on each sample.
+Compiling in only the protocol(s) of the remote(s) in use therefore frees CPU time for everything else - and for NEC only the sample
+rate can be lowered as well.
+
+Select the profile in platformio.ini by adding one of the following to build_flags:
+  -D IR_PROTOCOL_PROFILE=IR_PROFILE_NEC     NEC remotes only - including Apple and Onkyo, which IRMP decodes as NEC (10 kHz sampling)
+  -D IR_PROTOCOL_PROFILE=IR_PROFILE_MAIN15  The 15 most common protocols (default)
+  -D IR_PROTOCOL_PROFILE=IR_PROFILE_ALL     All protocols supported by IRMP
+  -D IR_PROTOCOL_PROFILE=IR_PROFILE_CUSTOM  Only the protocols enabled by -D IRMP_SUPPORT_xxx_PROTOCOL=1 build flags
+
+If the protocol of a remote is not known, use the "Detect protocol" item of the "Learn IR" menu with the MAIN15 or ALL profile
+to see which protocol it sends, and then switch to the smallest profile containing that protocol. The same screen lists the protocols
+of the codes learned so far and writes the build_flags of the profile that decodes just those to the serial port: IR_PROFILE_NEC,
+or IR_PROFILE_CUSTOM with an IRMP_SUPPORT_xxx_PROTOCOL flag per protocol. Codes stored without a protocol (the default codes, and
+codes kept from older firmware) must be learned again first - no profile is suggested while there are any. The flags are made from
+the IRMP protocol names, so check them against irmpSelectAllProtocols.h for protocols whose name differs from their flag (ie. B&O
+and RCMM).
+
+To see how much CPU time a profile frees, build with -D IR_ISR_BENCHMARK=<seconds>: the IRMP interrupt is then timed at startup and
+the result written to the serial port (see benchmarkIRInterrupt in main.cpp).
+
+*/
+
+#define IR_PROFILE_NEC 1
+#define IR_PROFILE_MAIN15 2
+#define IR_PROFILE_ALL 3
+#define IR_PROFILE_CUSTOM 4
+
+#ifndef IR_PROTOCOL_PROFILE
+#define IR_PROTOCOL_PROFILE IR_PROFILE_MAIN15
+#endif
+
+#if IR_PROTOCOL_PROFILE == IR_PROFILE_NEC
+#define IRMP_SUPPORT_NEC_PROTOCOL 1
+#define F_INTERRUPTS 10000 // NEC only requires the minimum sample rate supported by IRMP
+#define IR_PROFILE_NAME "NEC"
+#elif IR_PROTOCOL_PROFILE == IR_PROFILE_MAIN15
+#include <irmpSelectMain15Protocols.h>
+#define IR_PROFILE_NAME "Main 15"
+#elif IR_PROTOCOL_PROFILE == IR_PROFILE_ALL
+#include <irmpSelectAllProtocols.h>
+#define IR_PROFILE_NAME "All"
+#elif IR_PROTOCOL_PROFILE == IR_PROFILE_CUSTOM
+#define IR_PROFILE_NAME "Custom"
+#else
+#error "Unknown IR_PROTOCOL_PROFILE"
+#endif
+
+#define IRMP_PROTOCOL_NAMES 1 // Used to display the name of the protocol received when detecting the protocol of a remote
+
+#endif
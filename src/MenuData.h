@@ -22,6 +22,7 @@ enum ctlMenuCommandId
   mnuCmdMAX_START_VOL,
   mnuCmdMUTE_LVL,
   mnuCmdSTORE_LVL,
+  mnuCmdKEY_REPEAT,
   mnuCmdINPUT_MENU,
   mnuCmdINPUT1_MENU,
   mnuCmdINPUT1_ACTIVE,
@@ -70,6 +71,8 @@ enum ctlMenuCommandId
   mnuCmdIR_4,
   mnuCmdIR_5,
   mnuCmdIR_6,
+  mnuCmdIR_PROFILE,
+  mnuCmdIR_PROTOCOL,
   mnuCmdPWR_CTL_MENU,
   mnuCmdTRIG1_MENU,
   mnuCmdTRIGGER1_ACTIVE,
@@ -93,8 +96,8 @@ enum ctlMenuCommandId
   mnuCmdDISP_TEMP2,
   mnuCmdABOUT,
   mnuCmdRESET_MENU,
-  mnuCmdSAVE_CUST,
-  mnuCmdLOAD_CUST,
+  mnuCmdSAVE_PROFILE,
+  mnuCmdLOAD_PROFILE,
   mnuCmdLOAD_DEFAULT
 };
 
@@ -155,7 +158,8 @@ const char ctlMenu_1_3[] = "Max attenuation";
 const char ctlMenu_1_4[] = "Max start vol";
 const char ctlMenu_1_5[] = "Mute level";
 const char ctlMenu_1_6[] = "Vol. memory";
-const MenuItem ctlMenu_List_1[] = {{mnuCmdVOL_STEPS, ctlMenu_1_1}, {mnuCmdMIN_ATT, ctlMenu_1_2}, {mnuCmdMAX_ATT, ctlMenu_1_3}, {mnuCmdMAX_START_VOL, ctlMenu_1_4}, {mnuCmdMUTE_LVL, ctlMenu_1_5}, {mnuCmdSTORE_LVL, ctlMenu_1_6}, {mnuCmdBack, ctlMenu_back}};
+const char ctlMenu_1_7[] = "Key repeat";
+const MenuItem ctlMenu_List_1[] = {{mnuCmdVOL_STEPS, ctlMenu_1_1}, {mnuCmdMIN_ATT, ctlMenu_1_2}, {mnuCmdMAX_ATT, ctlMenu_1_3}, {mnuCmdMAX_START_VOL, ctlMenu_1_4}, {mnuCmdMUTE_LVL, ctlMenu_1_5}, {mnuCmdSTORE_LVL, ctlMenu_1_6}, {mnuCmdKEY_REPEAT, ctlMenu_1_7}, {mnuCmdBack, ctlMenu_back}};
 
 const char ctlMenu_2_1[] = "Input 1";
 const char ctlMenu_2_2[] = "Input 2";
@@ -181,7 +185,9 @@ const char ctlMenu_3_13[] = "3";
 const char ctlMenu_3_14[] = "4";
 const char ctlMenu_3_15[] = "5";
 const char ctlMenu_3_16[] = "6";
-const MenuItem ctlMenu_List_3[] = {{mnuCmdIR_ONOFF, ctlMenu_3_1}, {mnuCmdIR_UP, ctlMenu_3_2}, {mnuCmdIR_DOWN, ctlMenu_3_3}, {mnuCmdIR_REPEAT, ctlMenu_3_4}, {mnuCmdIR_LEFT, ctlMenu_3_5}, {mnuCmdIR_RIGHT, ctlMenu_3_6}, {mnuCmdIR_SELECT, ctlMenu_3_7}, {mnuCmdIR_BACK, ctlMenu_3_8}, {mnuCmdIR_MUTE, ctlMenu_3_9}, {mnuCmdIR_PREV, ctlMenu_3_10}, {mnuCmdIR_1, ctlMenu_3_11}, {mnuCmdIR_2, ctlMenu_3_12}, {mnuCmdIR_3, ctlMenu_3_13}, {mnuCmdIR_4, ctlMenu_3_14}, {mnuCmdIR_5, ctlMenu_3_15}, {mnuCmdIR_6, ctlMenu_3_16}, {mnuCmdBack, ctlMenu_back}};
+const char ctlMenu_3_17[] = "Profile";
+const char ctlMenu_3_18[] = "Detect protocol";
+const MenuItem ctlMenu_List_3[] = {{mnuCmdIR_ONOFF, ctlMenu_3_1}, {mnuCmdIR_UP, ctlMenu_3_2}, {mnuCmdIR_DOWN, ctlMenu_3_3}, {mnuCmdIR_REPEAT, ctlMenu_3_4}, {mnuCmdIR_LEFT, ctlMenu_3_5}, {mnuCmdIR_RIGHT, ctlMenu_3_6}, {mnuCmdIR_SELECT, ctlMenu_3_7}, {mnuCmdIR_BACK, ctlMenu_3_8}, {mnuCmdIR_MUTE, ctlMenu_3_9}, {mnuCmdIR_PREV, ctlMenu_3_10}, {mnuCmdIR_1, ctlMenu_3_11}, {mnuCmdIR_2, ctlMenu_3_12}, {mnuCmdIR_3, ctlMenu_3_13}, {mnuCmdIR_4, ctlMenu_3_14}, {mnuCmdIR_5, ctlMenu_3_15}, {mnuCmdIR_6, ctlMenu_3_16}, {mnuCmdIR_PROFILE, ctlMenu_3_17}, {mnuCmdIR_PROTOCOL, ctlMenu_3_18}, {mnuCmdBack, ctlMenu_back}};
 
 const char ctlMenu_4_1[] = "Trigger 1";
 const char ctlMenu_4_2[] = "Trigger 2";
@@ -198,10 +204,10 @@ const char ctlMenu_5_7[] = "Temp 1 display";
 const char ctlMenu_5_8[] = "Temp 2 display";
 const MenuItem ctlMenu_List_5[] = {{mnuCmdDISP_SAVER_ACTIVE, ctlMenu_5_1}, {mnuCmdDISP_ON_LEVEL, ctlMenu_5_2}, {mnuCmdDISP_DIM_LEVEL, ctlMenu_5_3}, {mnuCmdDISP_DIM_TIMEOUT, ctlMenu_5_4}, {mnuCmdDISP_VOL, ctlMenu_5_5}, {mnuCmdDISP_INPUT, ctlMenu_5_6}, {mnuCmdDISP_TEMP1, ctlMenu_5_7}, {mnuCmdDISP_TEMP2, ctlMenu_5_8}, {mnuCmdBack, ctlMenu_back}};
 
-const char ctlMenu_7_1[] = "Save user setup";
-const char ctlMenu_7_2[] = "Load user setup";
+const char ctlMenu_7_1[] = "Save profile";
+const char ctlMenu_7_2[] = "Load profile";
 const char ctlMenu_7_3[] = "Factory reset";
-const MenuItem ctlMenu_List_7[] = {{mnuCmdSAVE_CUST, ctlMenu_7_1}, {mnuCmdLOAD_CUST, ctlMenu_7_2}, {mnuCmdLOAD_DEFAULT, ctlMenu_7_3}, {mnuCmdBack, ctlMenu_back}};
+const MenuItem ctlMenu_List_7[] = {{mnuCmdSAVE_PROFILE, ctlMenu_7_1}, {mnuCmdLOAD_PROFILE, ctlMenu_7_2}, {mnuCmdLOAD_DEFAULT, ctlMenu_7_3}, {mnuCmdBack, ctlMenu_back}};
 
 const char ctlMenu_1[] = "Volume";
 const char ctlMenu_2[] = "Inputs";
@@ -225,6 +231,8 @@ case mnuCmdMUTE_LVL :
 	break;
 case mnuCmdSTORE_LVL :
 	break;
+case mnuCmdKEY_REPEAT :
+	break;
 case mnuCmdINPUT1_ACTIVE :
 	break;
 case mnuCmdINPUT1_NAME :
@@ -305,6 +313,10 @@ case mnuCmdIR_5 :
 	break;
 case mnuCmdIR_6 :
 	break;
+case mnuCmdIR_PROFILE :
+	break;
+case mnuCmdIR_PROTOCOL :
+	break;
 case mnuCmdTRIGGER1_ACTIVE :
 	break;
 case mnuCmdTRIGGER1_TYPE :
@@ -341,9 +353,9 @@ case mnuCmdDISP_TEMP2 :
 	break;
 case mnuCmdABOUT :
 	break;
-case mnuCmdSAVE_CUST :
+case mnuCmdSAVE_PROFILE :
 	break;
-case mnuCmdLOAD_CUST :
+case mnuCmdLOAD_PROFILE :
 	break;
 case mnuCmdLOAD_DEFAULT :
 	break;
@@ -363,6 +375,7 @@ case mnuCmdLOAD_DEFAULT :
                 <Item Id="MAX_START_VOL" Name="Max start vol"/>
                 <Item Id="MUTE_LVL" Name="Mute level"/>
                 <Item Id="STORE_LVL" Name="Vol. memory"/>
+                <Item Id="KEY_REPEAT" Name="Key repeat"/>
             </MenuItems>
         </Item>
         <Item Id="INPUT_MENU" Name="Inputs">
@@ -435,6 +448,8 @@ case mnuCmdLOAD_DEFAULT :
                 <Item Id="IR_4" Name="4"/>
                 <Item Id="IR_5" Name="5"/>
                 <Item Id="IR_6" Name="6"/>
+                <Item Id="IR_PROFILE" Name="Profile"/>
+                <Item Id="IR_PROTOCOL" Name="Detect protocol"/>
             </MenuItems>
         </Item>
         <Item Id="PWR_CTL_MENU" Name="Triggers">
@@ -474,8 +489,8 @@ case mnuCmdLOAD_DEFAULT :
         <Item Id="ABOUT" Name="About"/>
         <Item Id="RESET_MENU" Name="Save/load/reset">
             <MenuItems>
-                <Item Id="SAVE_CUST" Name="Save user setup"/>
-                <Item Id="LOAD_CUST" Name="Load user setup"/>
+                <Item Id="SAVE_PROFILE" Name="Save profile"/>
+                <Item Id="LOAD_PROFILE" Name="Load profile"/>
                 <Item Id="LOAD_DEFAULT" Name="Factory reset"/>
             </MenuItems>
         </Item>
@@ -26,15 +26,29 @@
 // Jan (1.085)
 #define ADC_CALIBRATION 1.045 
 
+// The NTCs used for measuring temperatures - change these values to use another type of NTC
+#define NTC_R25 4700   // Resistance of the NTC at 25 degrees Celcius in ohms
+#define NTC_BETA 3977  // Beta value (B25/85) of the NTC
+#define NTC_RREF 2200  // Value of the reference resistor in series with the NTC in ohms
+
 
 #include <Wire.h>
 #include <Adafruit_MCP23008.h>
 #include <OLedI2C.h>
 #include <extEEPROM.h>
+#include <EEPROMJournal.h>
+#include <EEPROMPages.h>
 #include <Muses72320.h>
 #include <MenuManager.h>
 #include <MenuData.h>
+#include <TemperatureHistory.h>
+#include <ThermalProtection.h>
+#include <NTCTable.h>
 #include <esp_adc_cal.h> // To enable improved accuracy of ADC readings (used for reading NTC's value to calculate temperature)
+#define NTC_ADC_CONTINUOUS // Read the NTCs with the continuous (DMA) mode of the ADC - comment out to always use analogRead()
+#ifdef NTC_ADC_CONTINUOUS
+#include <driver/adc.h>
+#endif
 
 #undef minimum
 #ifndef minimum
@@ -47,6 +61,8 @@
 #define IRMP_INPUT_PIN 32
 #define NTC1_PIN 35
 #define NTC2_PIN 34
+#define NTC1_ADC_CHANNEL ADC1_CHANNEL_7 // ADC channel of NTC1_PIN - used when the NTCs are read in continuous mode
+#define NTC2_ADC_CHANNEL ADC1_CHANNEL_6 // ADC channel of NTC2_PIN
 #define ROTARY2_CW_PIN 14
 #define ROTARY2_CCW_PIN 12
 #define ROTARY2_SW_PIN 13
@@ -55,10 +71,9 @@
 #define ROTARY1_SW_PIN 27
 #define POWER_RELAY_PIN 4
 
-#include <irmpSelectMain15Protocols.h> // This enables 15 main protocols
-#define IRMP_SUPPORT_NEC_PROTOCOL 1    // this enables only one protocol
-
+#include <IRProtocolProfile.h> // Selects the IR protocols to decode - see the file for the available profiles
 #include <irmp.hpp>
+#include <IRKeyMap.h>
 
 // Declarations
 void startUp(void);
@@ -70,40 +85,78 @@ void setTrigger2On(void);
 void setTrigger1Off(void);
 void setTrigger2Off(void);
 void displayTemperatures(void);
-void displayTempDetails(float, uint8_t, uint8_t, uint8_t);
-float readVoltage(byte);
+void displayTempDetails(float, uint8_t, uint8_t, uint8_t, bool);
+void initADC(void);
+void buildNTCTable(void);
+void updateADCScale(void);
+float measureTemperature(uint8_t);
+bool startContinuousADC(void);
+bool measureTemperaturesContinuous(float &, float &);
 float getTemperature(uint8_t);
+byte getThermalState(uint8_t);
+bool resetThermalProtection(void);
+void checkThermalProtection(void);
+void setupTemperatureSampling(void);
 void displayVolume(void);
 void displayMute(void);
 void displayInput(void);
 int16_t getAttenuation(uint8_t, uint8_t, uint8_t, uint8_t);
 void setVolume(int16_t);
+void changeVolume(int8_t);
+void endVolumeRamp(void);
 bool changeBalance(void);
+void setBalance(byte);
 void displayBalance(byte);
 void mute(void);
 void unmute(void);
 boolean setInput(uint8_t);
+bool isInputSelectable(uint8_t);
 void setPrevInput(void);
 void setNextInput(void);
-String getJSONCurrentValues(void);
-String getJSONOnStandbyState(void);
-String getJSONCurrentInput(void);
-String getJSONCurrentVolume(void);
-String getJSONTempValues(void);
-void readSettingsFromEEPROM(void);
+void notifyClients(const char *);
+void markStateDirty(byte);
+void broadcastState(void);
+void updateAPISnapshots(void);
+void processControlCommands(void);
+void applyWiFiSettings(void);
+bool readSettingsFromEEPROM(void);
 void writeSettingsToEEPROM(void);
+bool writeEEPROMPage(uint16_t, const uint8_t *, uint16_t);
+bool readRecordFromEEPROM(uint16_t, byte *, uint16_t, uint16_t &, uint16_t &, uint16_t &);
+bool writeRecordToEEPROM(uint16_t, const byte *, byte *, uint16_t, uint16_t, uint16_t);
+bool migrateSettings(uint16_t);
 void writeDefaultSettingsToEEPROM(void);
-void readRuntimeSettingsFromEEPROM(void);
+bool readRuntimeSettingsFromEEPROM(void);
 void writeRuntimeSettingsToEEPROM(void);
-void readUserSettingsFromEEPROM(void);
-void writeUserSettingsToEEPROM(void);
+void checkRuntimeSettingsChanged(void);
+void setupEEPROM(void);
+void markSettingsDirty(void);
+void markRuntimeSettingsDirty(void);
+void markIRBindingsDirty(void);
+void flushEEPROM(bool);
+void serviceEEPROM(void);
+void setupPowerFailDetection(void);
+bool profileExists(byte);
+void setActiveProfile(byte);
+void saveProfile(byte);
+bool loadProfile(byte);
+void loadNextProfile(void);
+void setupProfiles(void);
+bool readIRBindingsFromEEPROM(void);
+void writeIRBindingsToEEPROM(void);
 void editInputName(uint8_t InputNumber);
 void drawEditInputNameScreen(bool isUpperCase);
+bool pickNumericValue(byte &Value, byte MinValue, byte MaxValue, const char Unit[5]);
 bool editNumericValue(byte &Value, byte MinValue, byte MaxValue, const char Unit[5]);
 bool editOptionValue(byte &Value, byte NumOptions, const char Option1[9], const char Option2[9], const char Option3[9], const char Option4[9]);
 
-IRMP_DATA irmp_data;
 bool editIRCode(IRMP_DATA &Value);
+void detectIRProtocol(void);
+void addLearnedIRProtocol(const IRMP_DATA &, const char *, uint64_t &, byte &);
+uint64_t getLearnedIRProtocols(byte &);
+const char *getIRSupportName(byte);
+void showLearnedIRProtocols(byte);
+void buildIRKeyMap(void);
 
 void drawMenu();
 void refreshMenuDisplay(byte refreshMode);
@@ -131,7 +184,7 @@ struct InputSettings
 // This holds all the settings of the controller
 // It is saved to the I2C EEPROM on the first run and read back into memory on subsequent runs
 // The settings can be changed from the menu and the user can also chose to reset to default values if something goes wrong
-// On startup of the controller it is checked if the EEPROM contains valid data by checking if the Version field equals the VERSION defined by the source code. If they are not the same default values will be written to EEPROM
+// The settings are stored in the EEPROM as a record with a CRC and a schema version (see readRecordFromEEPROM) - if the layout is changed SETTINGS_SCHEMA_VERSION must be increased and a migration added to migrateSettings()
 // This is created as a union to be able to serialize/deserialize the data when writing and reading to/from the EEPROM
 typedef union
 {
@@ -186,13 +239,16 @@ typedef union
     byte DisplaySelectedInput;     // 0 = the name of the active input is not shown on the display (ie. if only one input is used), 1 = the name of the selected input is shown on the display
     byte DisplayTemperature1;      // 0 = do not display the temperature measured by NTC 1, 1 = display in number of degrees Celcious, 2 = display as graphical representation, 3 = display both
     byte DisplayTemperature2;      // 0 = do not display the temperature measured by NTC 2, 1 = display in number of degrees Celcious, 2 = display as graphical representation, 3 = display both
-    float Version;                 // Used to check if data read from the EEPROM is valid with the compiled version of the code - if not a reset to default settings is necessary and they must be written to the EEPROM
+    float Version;                 // The firmware version the settings were last set to defaults by (before schema versions were used it was required to be equal to VERSION)
+    byte KeyRepeatRate;            // Number of times per second a held key is repeated (see getUserInput)
   };
-  byte data[232]; // Allows us to be able to write/read settings from EEPROM byte-by-byte (to avoid specific serialization/deserialization code)
+  byte data[316]; // Allows us to be able to write/read settings from EEPROM byte-by-byte (to avoid specific serialization/deserialization code) - all of the struct (see the static_assert of sizeof(mySettings))
 } mySettings;
 
 mySettings Settings; // Holds all the current settings
 void setSettingsToDefault(void);
+void setRuntimeSettingsToDefault(void);
+void applySettings(const mySettings &);
 
 typedef union
 {
@@ -211,6 +267,28 @@ typedef union
 
 myRuntimeSettings RuntimeSettings;
 
+// Additional IR codes bound to the keys - allows more than one remote (or more than one button) to be used for the same key
+// The primary code of each key is kept in Settings (IR_ONOFF, IR_UP ...), the additional codes are learned from the "Learn IR" menu and saved to the EEPROM separately
+#define IR_EXTRA_BINDINGS 32
+struct IRBinding
+{
+  byte Key;       // The UserInput value the code is bound to
+  IRMP_DATA Code; // The received IR code (protocol, address and command)
+};
+
+typedef struct
+{
+  byte Count;                                  // Number of bindings in use
+  struct IRBinding Binding[IR_EXTRA_BINDINGS]; // The additional bindings
+  float Version;                               // Used to check if data read from the EEPROM is valid with the compiled version of the code
+  IRMP_DATA IR_PROFILE;                        // IR data to be interpreted as "switch to the next profile" (kept here as there is no room for it in Settings)
+} myIRBindings;
+
+myIRBindings IRBindings;
+
+// Lookup table for received IR codes - rebuilt from Settings and IRBindings whenever a code is learned or the settings are loaded
+IRKeyMap irKeyMap;
+
 // Setup Rotary encoders ------------------------------------------------------
 ClickEncoder *encoder1 = new ClickEncoder(ROTARY1_CW_PIN, ROTARY1_CCW_PIN, ROTARY1_SW_PIN, ROTARY_ENCODER_STEPS, LOW);
 ClickEncoder::Button button1;
@@ -252,7 +330,127 @@ Adafruit_MCP23008 relayController;
 
 // Setup EEPROM ---------------------------------------------------------------
 #define EEPROM_Address 0x50
-extEEPROM eeprom(kbits_64, 1, 32); // Set to use 24C64 Eeprom - if you use another type look in the datasheet for capacity in kbits (kbits_64) and page size in bytes (32)
+#define EEPROM_SIZE 8192     // Bytes in the EEPROM
+#define EEPROM_PAGE_SIZE 32  // Bytes in an EEPROM page - a write within a page is done in one write cycle
+extEEPROM eeprom(kbits_64, 1, EEPROM_PAGE_SIZE); // Set to use 24C64 Eeprom - if you use another type look in the datasheet for capacity in kbits (kbits_64) and page size in bytes (32)
+
+// Layout of the EEPROM - Settings, user settings, IR bindings and profiles are records: a RecordHeader in a page of its own followed by the data from the next page
+// Settings and IR bindings are kept in two slots each, written alternately (see RecordSlots)
+#define EEPROM_SETTINGS_ADDRESS 0           // Settings - first slot
+#define EEPROM_USER_SETTINGS_ADDRESS 512    // Settings saved by the user before profiles were added - only read to move them to profile 1 (see setupProfiles)
+#define EEPROM_IR_BINDINGS_ADDRESS 1024     // Additional IR bindings - first slot
+#define EEPROM_IR_BINDINGS_ADDRESS_2 1312   // Additional IR bindings - second slot
+#define EEPROM_POWER_FAIL_LOG_ADDRESS 2048  // Timing of the last save of the runtime settings when the power failed (see powerFailTask)
+#define EEPROM_SETTINGS_ADDRESS_2 2080      // Settings - second slot
+#define EEPROM_PROFILES_ADDRESS 2560        // PROFILE_COUNT profiles of PROFILE_SLOT_SIZE bytes each
+#define EEPROM_PROFILE_BASE_ADDRESS 3840    // The settings the profiles are stored as changes from (see setupProfiles)
+#define EEPROM_JOURNAL_ADDRESS 4096         // Journal with RuntimeSettings - EEPROM_JOURNAL_SLOTS pages to the end of the EEPROM
+#define EEPROM_JOURNAL_SLOTS ((EEPROM_SIZE - EEPROM_JOURNAL_ADDRESS) / EEPROM_PAGE_SIZE)
+#define PROFILE_COUNT 8                          // Number of profiles the user can save
+#define PROFILE_SLOT_SIZE (EEPROM_PAGE_SIZE * 5) // A record header and up to 4 pages of changes from the default settings
+#define PROFILE_MAX_DELTA (PROFILE_SLOT_SIZE - EEPROM_PAGE_SIZE)
+static_assert(EEPROM_SETTINGS_ADDRESS + EEPROM_PAGE_SIZE + sizeof(Settings) <= EEPROM_USER_SETTINGS_ADDRESS, "The settings overlap the user settings in the EEPROM");
+static_assert(EEPROM_USER_SETTINGS_ADDRESS + EEPROM_PAGE_SIZE + sizeof(Settings) <= EEPROM_IR_BINDINGS_ADDRESS, "The user settings overlap the IR bindings in the EEPROM");
+static_assert(EEPROM_IR_BINDINGS_ADDRESS + EEPROM_PAGE_SIZE + sizeof(IRBindings) <= EEPROM_IR_BINDINGS_ADDRESS_2, "The IR bindings overlap their second slot in the EEPROM");
+static_assert(EEPROM_IR_BINDINGS_ADDRESS_2 % EEPROM_PAGE_SIZE == 0 && EEPROM_IR_BINDINGS_ADDRESS_2 + EEPROM_PAGE_SIZE + sizeof(IRBindings) <= EEPROM_POWER_FAIL_LOG_ADDRESS, "The IR bindings overlap the power fail log in the EEPROM");
+static_assert(EEPROM_POWER_FAIL_LOG_ADDRESS + EEPROM_PAGE_SIZE <= EEPROM_SETTINGS_ADDRESS_2, "The power fail log overlaps the settings in the EEPROM");
+static_assert(EEPROM_SETTINGS_ADDRESS_2 % EEPROM_PAGE_SIZE == 0 && EEPROM_SETTINGS_ADDRESS_2 + EEPROM_PAGE_SIZE + sizeof(Settings) <= EEPROM_PROFILES_ADDRESS, "The settings overlap the profiles in the EEPROM");
+static_assert(EEPROM_PROFILES_ADDRESS + PROFILE_COUNT * PROFILE_SLOT_SIZE <= EEPROM_PROFILE_BASE_ADDRESS, "The profiles overlap the profile base in the EEPROM");
+
+// Layout used by firmware 0.99 and earlier - the data had no header and was valid if the Version field was LEGACY_VERSION. Only read to migrate it
+#define LEGACY_VERSION (float)0.99
+#define LEGACY_SETTINGS_SIZE 312
+#define EEPROM_LEGACY_SETTINGS_ADDRESS 0
+#define EEPROM_LEGACY_RUNTIME_ADDRESS 313
+#define EEPROM_LEGACY_USER_SETTINGS_ADDRESS 333
+#define EEPROM_LEGACY_IR_BINDINGS_ADDRESS 1024
+
+// Header of a record in the EEPROM
+#define EEPROM_RECORD_MAGIC 0x3242454D   // "MEB2"
+#define EEPROM_RECORD_MAGIC_1 0x3142454D // "MEB1" - written before Sequence was added, still read (with Sequence 0)
+typedef struct __attribute__((packed))
+{
+  uint32_t Magic;         // EEPROM_RECORD_MAGIC - anything else means the record has never been written
+  uint16_t SchemaVersion; // Layout of the data - see migrateSettings()
+  uint16_t Length;        // Number of bytes of data
+  uint16_t Crc;           // CRC-16 of the data and Sequence
+  uint16_t Sequence;      // Counted up for every write of a record kept in two slots - the valid slot with the highest is the newest (see RecordSlots)
+} RecordHeader;
+static_assert(sizeof(RecordHeader) <= EEPROM_PAGE_SIZE, "The record header must fit in one page");
+
+// A record kept in two slots. A new version is written to the slot not holding the newest one, so if the power fails while writing
+// (leaving a slot with a wrong CRC) the previous version is still there to be read at the next start
+typedef struct
+{
+  uint16_t Address[2];
+  byte Newest;       // The slot holding the newest valid record - the next write goes to the other one
+  uint16_t Sequence; // Sequence of the newest valid record
+} RecordSlots;
+
+// Increase when the layout of mySettings or myIRBindings is changed - the static_asserts are there to catch changes made by accident
+#define SETTINGS_SCHEMA_VERSION 2     // 2: KeyRepeatRate added
+#define IR_BINDINGS_SCHEMA_VERSION 2 // 2: IR_PROFILE added
+static_assert(sizeof(mySettings) == 316 && sizeof(mySettings) == sizeof(Settings.data) && offsetof(mySettings, ADC_Calibration) == 104 && offsetof(mySettings, IR_ONOFF) == 108 && offsetof(mySettings, Input) == 204 && offsetof(mySettings, ExtPowerRelayTrigger) == 288 && offsetof(mySettings, Version) == 308 && offsetof(mySettings, KeyRepeatRate) == LEGACY_SETTINGS_SIZE,
+              "The layout of Settings has changed - increase SETTINGS_SCHEMA_VERSION and add a migration to migrateSettings()");
+static_assert(sizeof(myIRBindings) == 240 && offsetof(myIRBindings, Version) == 228 && offsetof(myIRBindings, IR_PROFILE) == 232, "The layout of IRBindings has changed - increase IR_BINDINGS_SCHEMA_VERSION");
+static_assert(sizeof(myRuntimeSettings) == 20, "The layout of RuntimeSettings has changed - the journal only accepts records of the same length, so they will be reset to defaults");
+static_assert(EEPROMJournal::HeaderSize + sizeof(RuntimeSettings) + EEPROMJournal::TrailerSize <= EEPROM_PAGE_SIZE, "RuntimeSettings do not fit in one page of the journal");
+
+// RuntimeSettings are saved to the next page of a journal every time they have been changed (and left unchanged for EEPROM_FLUSH_DELAY),
+// so the volume, input etc. are kept even without going to standby, and the wear is spread over all the pages of the journal (see EEPROMJournal)
+EEPROMJournal runtimeJournal(eeprom, EEPROM_JOURNAL_ADDRESS, EEPROM_JOURNAL_SLOTS, EEPROM_PAGE_SIZE);
+
+// The settings kept in a profile - the WiFi setup, ADC calibration, IR codes and power relay belong to the amplifier, not to a profile
+// A profile is stored as its changes from profileBase: the CRC-16 of profileBase (2 bytes) followed by runs of an offset into Settings (2 bytes),
+// a length (1 byte) and the changed bytes. Increase PROFILE_SCHEMA_VERSION if the fields or their layout are changed - saved profiles are then not loaded
+#define PROFILE_SCHEMA_VERSION 1
+const struct
+{
+  uint16_t Offset;
+  uint16_t Length;
+} ProfileFields[] = {
+    {offsetof(mySettings, VolumeSteps), offsetof(mySettings, ADC_Calibration) - offsetof(mySettings, VolumeSteps)},
+    {offsetof(mySettings, Input), offsetof(mySettings, ExtPowerRelayTrigger) - offsetof(mySettings, Input)},
+    {offsetof(mySettings, Trigger1Active), offsetof(mySettings, Version) - offsetof(mySettings, Trigger1Active)}};
+#define PROFILE_FIELDS_SIZE (offsetof(mySettings, ADC_Calibration) - offsetof(mySettings, VolumeSteps) + offsetof(mySettings, ExtPowerRelayTrigger) - offsetof(mySettings, Input) + offsetof(mySettings, Version) - offsetof(mySettings, Trigger1Active))
+#define PROFILE_BASE_CRC 2
+#define PROFILE_RUN_HEADER 3
+// Every run but the last of a field is followed by at least PROFILE_RUN_HEADER unchanged bytes (see buildProfileDelta), so the changes can never take more than this
+static_assert(PROFILE_BASE_CRC + offsetof(mySettings, ADC_Calibration) - offsetof(mySettings, VolumeSteps) + offsetof(mySettings, Version) - offsetof(mySettings, Input) + 3 * PROFILE_RUN_HEADER <= PROFILE_MAX_DELTA,
+              "The changes of a profile may not fit in PROFILE_SLOT_SIZE");
+static_assert(EEPROM_PROFILE_BASE_ADDRESS + EEPROM_PAGE_SIZE + PROFILE_FIELDS_SIZE <= EEPROM_JOURNAL_ADDRESS, "The profile base overlaps the journal in the EEPROM");
+
+// The profiles are stored as changes from the default settings of the firmware that saved the first profile. These are kept in the EEPROM,
+// so a change of the defaults in a later firmware doesn't change the saved profiles (see setupProfiles)
+mySettings profileBase;     // Only the profile fields are used
+uint16_t profileBaseCrc;    // CRC-16 of the profile fields of profileBase - stored with each profile, which is not loaded if it doesn't match
+byte activeProfile = 0;     // The profile loaded or saved last (0 = none) - only kept until restart
+myRuntimeSettings changedRuntimeSettings; // RuntimeSettings as they were when last seen changed (see checkRuntimeSettingsChanged)
+
+// Changed settings are not written to the EEPROM right away but marked as dirty (markSettingsDirty etc.) and written by serviceEEPROM
+// from loop() when there have been no further changes for EEPROM_FLUSH_DELAY - or right away if requested by flushEEPROM. A series of
+// changes in the menu is then one write. The writes are done from loop() as the display and the relay controller (MCP23008) share the
+// I2C bus with the EEPROM and are used from loop() as well - the bus is never used from two places at once
+#define EEPROM_FLUSH_DELAY 3000          // Milliseconds without changes before the dirty settings are written
+#define EEPROM_FLUSH_CHECK_INTERVAL 100  // Milliseconds between checks for dirty settings - the latency of a write is at most EEPROM_FLUSH_DELAY plus this
+#define EEPROM_DIRTY_SETTINGS 0x01
+#define EEPROM_DIRTY_RUNTIME_SETTINGS 0x02
+#define EEPROM_DIRTY_IR_BINDINGS 0x04
+byte eepromDirty = 0;                                       // EEPROM_DIRTY_xxx flags of the data waiting to be written
+unsigned long mil_EEPROMDirty;                              // Time of the last change
+portMUX_TYPE eepromDirtyMux = portMUX_INITIALIZER_UNLOCKED; // Protects eepromDirty and mil_EEPROMDirty
+volatile uint32_t settingsVersion = 0;                      // Counted up when Settings is changed (used as ETag of the settings by the REST API)
+SemaphoreHandle_t eepromMutex;                              // Held while reading from or writing to the EEPROM (and while using the copies of what is in it)
+TaskHandle_t eepromWriterTask;                              // The task running loop() - the one writing to the EEPROM
+volatile bool eepromFlushRequested = false;                 // Set by flushEEPROM to have serviceEEPROM write the dirty data without waiting for EEPROM_FLUSH_DELAY
+unsigned long mil_EEPROMCheck;                              // Time of the last check for dirty data
+volatile bool powerFailed = false; // True while the power is failing - no new writes are started by serviceEEPROM (see powerFailTask)
+
+// Settings are written to the EEPROM page by page and only the pages that differ from savedSettings are written (see writeChangedPages)
+RecordSlots settingsSlots = {{EEPROM_SETTINGS_ADDRESS, EEPROM_SETTINGS_ADDRESS_2}, 1, 0};
+RecordSlots irBindingsSlots = {{EEPROM_IR_BINDINGS_ADDRESS, EEPROM_IR_BINDINGS_ADDRESS_2}, 1, 0};
+mySettings savedSettings[2];    // Settings as they are in each of the two slots in the EEPROM
+uint32_t eepromPageWrites;      // Number of page writes done by writeRecordToEEPROM since startup
 
 // Setup Display ---------------------------------------------------------------
 OLedI2C oled;
@@ -266,6 +464,17 @@ unsigned long mil_onRefreshTemperatureDisplay;
 #define TEMP_REFRESH_INTERVAL 10000         // Interval while on
 #define TEMP_REFRESH_INTERVAL_STANDBY 60000 // Interval while in standby
 
+// History of the temperatures - added to once per second by the temperature task and served as CSV by the web server (see sendTemperatureHistory)
+TemperatureHistory temperatureHistory;
+portMUX_TYPE temperatureHistoryMux = portMUX_INITIALIZER_UNLOCKED;
+static_assert(sizeof(TemperatureHistory) < 16 * 1024, "The temperature history uses too much RAM - reduce TEMP_HISTORY_xxx");
+
+// Volume ramp - when volume keys are received in a fast sequence (encoder 1 turned fast or IR UP/DOWN held down) the volume is changed by a rate in dB per second instead of one step per key
+#define VOLUME_RAMP_TIMEOUT 250    // Milliseconds without a volume key before a new ramp is started (the first key always changes the volume by exactly one step)
+#define VOLUME_RAMP_START_RATE 10  // dB per second when the ramp starts
+#define VOLUME_RAMP_MAX_RATE 40    // dB per second when the ramp is fully accelerated
+#define VOLUME_RAMP_ACCEL_TIME 800 // Milliseconds from the start of the ramp until VOLUME_RAMP_MAX_RATE is reached
+
 //  Initialize the menu
 enum AppModeValues
 {
@@ -335,16 +544,204 @@ enum UserInput
   KEY_6,       // IR
   KEY_MUTE,    // IR
   KEY_ONOFF,   // IR
-  KEY_PREVIOUS // IR
+  KEY_PREVIOUS, // IR
+  KEY_PROFILE   // IR
 };
 
 byte UIkey; // holds the last received user input (from rotary encoders or IR)
+unsigned long mil_LastInputEvent; // The time the last user input was made - for IR this is the time the frame was decoded
+
+// IR receiver task ----------------------------------------------------------------------------------------
+// Frames are fetched from the IR decoder by a separate task and timestamped when decoded, so the timing of IR input does not depend on
+// how long the main loop is busy (ie. writing to the display). The task classifies the frames as press and release events and passes
+// them to getUserInput through a queue. The repeat frames of a held key are not queued - they only update mil_LastIRFrame - so the
+// queue does not fill up while the main loop is busy, and a press is only queued if there is room for its release as well
+
+#define IR_TASK_INTERVAL 2       // Milliseconds between checks for a decoded frame
+#define IR_RELEASE_TIMEOUT 200   // Milliseconds without a frame before a held key is considered released (NEC remotes send repeat frames every 108 ms)
+#define IR_DEBOUNCE_TIME 150     // The same code received within this number of milliseconds is treated as a repeat - for remotes that repeat the full frame instead of sending repeat frames
+#define IR_EVENT_QUEUE_LENGTH 16
+
+enum IREventType
+{
+  IR_EVENT_PRESS,  // A key on the remote was pressed
+  IR_EVENT_RELEASE // The key has been released
+};
+
+typedef struct
+{
+  IRMP_DATA Data;          // The decoded frame (for IR_EVENT_RELEASE the frame of the key released)
+  byte Type;               // IREventType
+  unsigned long Timestamp; // millis() when the frame was decoded
+} IREvent;
+
+QueueHandle_t irEventQueue;
+volatile unsigned long mil_LastIRFrame = 0; // millis() when the last frame was decoded (including the repeat frames of a held key)
+
+void irTask(void *parameter)
+{
+  IRMP_DATA Data;
+  IREvent Event;
+  bool KeyHeld = false;
+  unsigned long mil_LastFrame = 0;
+
+  for (;;)
+  {
+    unsigned long Now = millis();
+    if (irmp_get_data(&Data))
+    {
+      bool SameCode = KeyHeld && Data.protocol == Event.Data.protocol && Data.address == Event.Data.address && Data.command == Event.Data.command;
+      if (!SameCode || !((Data.flags & IRMP_FLAG_REPETITION) || Now - mil_LastFrame < IR_DEBOUNCE_TIME))
+      {
+        Event.Type = IR_EVENT_PRESS;
+        Event.Data = Data;
+        Event.Timestamp = Now;
+        // Keep a place for the release - a release is only sent after a frame, so it always finds the place left by the last press
+        if (uxQueueSpacesAvailable(irEventQueue) > 1)
+          xQueueSend(irEventQueue, &Event, 0);
+      }
+      KeyHeld = true;
+      mil_LastFrame = Now;
+      mil_LastIRFrame = Now;
+    }
+    else if (KeyHeld && Now - mil_LastFrame > IR_RELEASE_TIMEOUT)
+    {
+      Event.Type = IR_EVENT_RELEASE;
+      Event.Timestamp = Now;
+      xQueueSend(irEventQueue, &Event, 0);
+      KeyHeld = false;
+    }
+    vTaskDelay(pdMS_TO_TICKS(IR_TASK_INTERVAL));
+  }
+}
+
+#ifdef IR_ISR_BENCHMARK
+// Measure the time used by the IRMP interrupt with the protocols of the IR protocol profile compiled in - build with -D IR_ISR_BENCHMARK=<seconds>
+// irmp_ISR() is called F_INTERRUPTS times per second for that many seconds before the decoder is started. Press keys on the remote meanwhile,
+// as decoding the pulses of a frame is what costs time. The average and the longest call are written to the serial port
+void benchmarkIRInterrupt()
+{
+  const uint32_t Calls = IR_ISR_BENCHMARK * F_INTERRUPTS;
+  const uint32_t CyclesPerMicrosecond = ESP.getCpuFreqMHz();
+  const uint32_t Period = CyclesPerMicrosecond * 1000000 / F_INTERRUPTS;
+  uint64_t Total = 0;
+  uint32_t Longest = 0;
+
+  pinMode(IRMP_INPUT_PIN, INPUT);
+  Serial.printf("Measuring the IR interrupt for %u s - press keys on the remote\n", (unsigned)IR_ISR_BENCHMARK);
+  uint32_t Next = ESP.getCycleCount();
+  for (uint32_t i = 0; i < Calls; i++)
+  {
+    while ((int32_t)(ESP.getCycleCount() - Next) < 0)
+      ;
+    Next += Period;
+    uint32_t Start = ESP.getCycleCount();
+    irmp_ISR();
+    uint32_t Cycles = ESP.getCycleCount() - Start;
+    Total += Cycles;
+    if (Cycles > Longest)
+      Longest = Cycles;
+  }
+  float Average = (float)Total / Calls / CyclesPerMicrosecond;
+  Serial.printf("IR interrupt, profile %s at %u Hz: %.2f us average, %.2f us longest, %.2f%% CPU\n", IR_PROFILE_NAME, (unsigned)F_INTERRUPTS,
+                Average, (float)Longest / CyclesPerMicrosecond, Average * F_INTERRUPTS / 10000);
+}
+#endif
+
+void setupIRReceiver()
+{
+#ifdef IR_ISR_BENCHMARK
+  benchmarkIRInterrupt();
+#endif
+  irmp_init();
+  irEventQueue = xQueueCreate(IR_EVENT_QUEUE_LENGTH, sizeof(IREvent));
+  // Run on the same core as the main loop (and the IRMP timer interrupt) but with a higher priority so frames are handled right away
+  xTaskCreatePinnedToCore(irTask, "IR", 2048, NULL, 2, NULL, 1);
+}
+
+// The primary IR code of each key (kept in Settings)
+const struct
+{
+  IRMP_DATA *Code;
+  byte Key;
+  const char *Name; // Used by the REST API
+} IRKeys[] = {
+    {&Settings.IR_ONOFF, KEY_ONOFF, "IR_ONOFF"},
+    {&Settings.IR_UP, KEY_UP, "IR_UP"},
+    {&Settings.IR_DOWN, KEY_DOWN, "IR_DOWN"},
+    {&Settings.IR_REPEAT, KEY_REPEAT, "IR_REPEAT"},
+    {&Settings.IR_LEFT, KEY_LEFT, "IR_LEFT"},
+    {&Settings.IR_RIGHT, KEY_RIGHT, "IR_RIGHT"},
+    {&Settings.IR_SELECT, KEY_SELECT, "IR_SELECT"},
+    {&Settings.IR_BACK, KEY_BACK, "IR_BACK"},
+    {&Settings.IR_MUTE, KEY_MUTE, "IR_MUTE"},
+    {&Settings.IR_PREVIOUS, KEY_PREVIOUS, "IR_PREVIOUS"},
+    {&Settings.IR_1, KEY_1, "IR_1"},
+    {&Settings.IR_2, KEY_2, "IR_2"},
+    {&Settings.IR_3, KEY_3, "IR_3"},
+    {&Settings.IR_4, KEY_4, "IR_4"},
+    {&Settings.IR_5, KEY_5, "IR_5"},
+    {&Settings.IR_6, KEY_6, "IR_6"}};
+
+bool IRLearnMode = false;           // Set by editIRCode while learning a code - received codes are not mapped to keys
+bool IRLearnedCodeReceived = false; // Set when a code has been received while IRLearnMode is set
+IRMP_DATA IRLearnedCode;            // The code received while IRLearnMode is set
+
+// Rebuild the lookup table of IR codes from the primary codes in Settings and the additional codes in IRBindings
+// The primary codes are added last so they take precedence if the same code is bound to more than one key
+void buildIRKeyMap()
+{
+  irKeyMap.clear();
+  for (byte i = 0; i < IRBindings.Count && i < IR_EXTRA_BINDINGS; i++)
+    irKeyMap.add(IRBindings.Binding[i].Code.protocol, IRBindings.Binding[i].Code.address, IRBindings.Binding[i].Code.command, IRBindings.Binding[i].Key);
+  for (byte i = 0; i < sizeof(IRKeys) / sizeof(IRKeys[0]); i++)
+    if (IRKeys[i].Code->address != 0 || IRKeys[i].Code->command != 0) // Skip keys with no code learned
+      irKeyMap.add(IRKeys[i].Code->protocol, IRKeys[i].Code->address, IRKeys[i].Code->command, IRKeys[i].Key);
+  if (IRBindings.IR_PROFILE.address != 0 || IRBindings.IR_PROFILE.command != 0)
+    irKeyMap.add(IRBindings.IR_PROFILE.protocol, IRBindings.IR_PROFILE.address, IRBindings.IR_PROFILE.command, KEY_PROFILE);
+  debug("IR codes in key map: ");
+  debugln(irKeyMap.count());
+}
 byte lastReceivedInput = KEY_NONE;
 unsigned long last_KEY_ONOFF = millis(); // Used to ensure that fast repetition of KEY_ONOFF is not accepted
 
+// Hold-to-repeat - a held key is repeated Settings.KeyRepeatRate times per second. The keys that can be held are UP, DOWN, LEFT and RIGHT on
+// the IR remote, and the button of an encoder held down right after the encoder has been turned: the last turn is then repeated (turn the
+// volume one step and keep the button pressed to keep changing the volume). Volume keys go through the volume ramp (see changeVolume)
+#define KEY_REPEAT_DELAY 400      // Milliseconds from an IR key is pressed until it starts repeating (the encoder buttons are held after ENC_HOLDTIME)
+#define KEY_REPEAT_TURN_TIME 4000 // Milliseconds from a turn of an encoder until its button is reported held (1.2 s after it is pressed) where the turn is repeated - holding the button alone does nothing
+#define KEY_REPEAT_MAX_RATE 30    // Highest number of repeats per second that can be set
+byte repeatKey = KEY_NONE;        // The key repeated while it is held - KEY_NONE if no key is held
+bool repeatFromIR = false;        // True if repeatKey is held on the remote - it is then stopped if no frame is received for IR_RELEASE_TIMEOUT
+unsigned long mil_NextRepeat;     // Time of the next repeat of repeatKey
+byte lastEncoder1Turn = KEY_NONE; // The last turn of each encoder (KEY_UP/KEY_DOWN and KEY_LEFT/KEY_RIGHT) - repeated while its button is held
+byte lastEncoder2Turn = KEY_NONE;
+unsigned long mil_LastEncoder1Turn;
+unsigned long mil_LastEncoder2Turn;
+
+// Start repeating Key at Start (if it isn't repeated already)
+void startKeyRepeat(byte Key, unsigned long Start, bool FromIR)
+{
+  if (repeatKey == KEY_NONE)
+  {
+    repeatKey = Key;
+    repeatFromIR = FromIR;
+    mil_NextRepeat = Start;
+  }
+}
+
+// Stop repeating the held key - the next volume key starts a new volume ramp
+void stopKeyRepeat()
+{
+  if (repeatKey == KEY_UP || repeatKey == KEY_DOWN)
+    endVolumeRamp();
+  repeatKey = KEY_NONE;
+}
+
 // Returns input from the user - enumerated to be the same value no matter if input is from encoders or IR remote
 byte getUserInput()
 {
+  broadcastState();
 
   if (interruptCounter > 0)
   {
@@ -356,6 +753,7 @@ byte getUserInput()
   }
 
   byte receivedInput = KEY_NONE;
+  mil_LastInputEvent = millis();
 
   // Read input from encoder 1
   e1value += encoder1->getValue();
@@ -367,15 +765,25 @@ byte getUserInput()
     if (e1value < e1last)
       receivedInput = KEY_DOWN;
     e1last = e1value;
+    lastEncoder1Turn = receivedInput;
+    mil_LastEncoder1Turn = millis();
   }
 
-  // Check if button on encoder 1 is clicked
+  // Check if button on encoder 1 is clicked - or held right after a turn
   button1 = encoder1->getButton();
   switch (button1)
   {
   case ClickEncoder::Clicked:
     receivedInput = KEY_SELECT;
     break;
+  case ClickEncoder::Held:
+    if (lastEncoder1Turn != KEY_NONE && millis() - mil_LastEncoder1Turn < KEY_REPEAT_TURN_TIME)
+      startKeyRepeat(lastEncoder1Turn, millis(), false);
+    break;
+  case ClickEncoder::Released:
+    stopKeyRepeat();
+    lastEncoder1Turn = KEY_NONE;
+    break;
   default:
     break;
   }
@@ -390,9 +798,11 @@ byte getUserInput()
     if (e2value < e2last)
       receivedInput = KEY_LEFT;
     e2last = e2value;
+    lastEncoder2Turn = receivedInput;
+    mil_LastEncoder2Turn = millis();
   }
 
-  // Check if button on encoder 2 is clicked
+  // Check if button on encoder 2 is clicked - or held right after a turn
   button2 = encoder2->getButton();
   switch (button2)
   {
@@ -402,62 +812,69 @@ byte getUserInput()
   case ClickEncoder::DoubleClicked:
     receivedInput = KEY_ONOFF;
     break;
+  case ClickEncoder::Held:
+    if (lastEncoder2Turn != KEY_NONE && millis() - mil_LastEncoder2Turn < KEY_REPEAT_TURN_TIME)
+      startKeyRepeat(lastEncoder2Turn, millis(), false);
+    break;
+  case ClickEncoder::Released:
+    stopKeyRepeat();
+    lastEncoder2Turn = KEY_NONE;
+    break;
   default:
     break;
   }
 
   // Check if any input from the IR remote
-  if (irmp_get_data(&irmp_data))
+  IREvent Event;
+  if (xQueueReceive(irEventQueue, &Event, 0) == pdTRUE)
   {
-
-    // Often the IR remote is to sensitive, reset reading if its to fast, but only if IR code is not REPEAT
-    if (millis() - mil_LastUserInput < 100 && (irmp_data.address != Settings.IR_REPEAT.address && irmp_data.command != Settings.IR_REPEAT.command))
+    if (IRLearnMode)
     {
-      irmp_data.address = 0;
-      irmp_data.command = 0;
-      receivedInput = KEY_NONE;
+      // The code is being learned by editIRCode - pass it on without mapping it to a key
+      if (Event.Type == IR_EVENT_PRESS)
+      {
+        IRLearnedCode = Event.Data;
+        IRLearnedCodeReceived = true;
+      }
+    }
+    else if (Event.Type == IR_EVENT_RELEASE)
+    {
+      // The key on the remote has been released
+      stopKeyRepeat();
+      lastReceivedInput = KEY_NONE;
     }
     else
+    {
       // Map the received IR input to UserInput values
-      if (irmp_data.address == Settings.IR_UP.address && irmp_data.command == Settings.IR_UP.command)
-        receivedInput = KEY_UP;
-      else if (irmp_data.address == Settings.IR_DOWN.address && irmp_data.command == Settings.IR_DOWN.command)
-        receivedInput = KEY_DOWN;
-      else if (irmp_data.address == Settings.IR_LEFT.address && irmp_data.command == Settings.IR_LEFT.command)
-        receivedInput = KEY_LEFT;
-      else if (irmp_data.address == Settings.IR_RIGHT.address && irmp_data.command == Settings.IR_RIGHT.command)
-        receivedInput = KEY_RIGHT;
-      else if (irmp_data.address == Settings.IR_SELECT.address && irmp_data.command == Settings.IR_SELECT.command)
-        receivedInput = KEY_SELECT;
-      else if (irmp_data.address == Settings.IR_BACK.address && irmp_data.command == Settings.IR_BACK.command)
-        receivedInput = KEY_BACK;
-      else if (irmp_data.address == Settings.IR_MUTE.address && irmp_data.command == Settings.IR_MUTE.command)
-        receivedInput = KEY_MUTE;
-      else if (irmp_data.address == Settings.IR_ONOFF.address && irmp_data.command == Settings.IR_ONOFF.command)
-        receivedInput = KEY_ONOFF;
-      else if (irmp_data.address == Settings.IR_1.address && irmp_data.command == Settings.IR_1.command)
-        receivedInput = KEY_1;
-      else if (irmp_data.address == Settings.IR_2.address && irmp_data.command == Settings.IR_2.command)
-        receivedInput = KEY_2;
-      else if (irmp_data.address == Settings.IR_3.address && irmp_data.command == Settings.IR_3.command)
-        receivedInput = KEY_3;
-      else if (irmp_data.address == Settings.IR_4.address && irmp_data.command == Settings.IR_4.command)
-        receivedInput = KEY_4;
-      else if (irmp_data.address == Settings.IR_5.address && irmp_data.command == Settings.IR_5.command)
-        receivedInput = KEY_5;
-      else if (irmp_data.address == Settings.IR_6.address && irmp_data.command == Settings.IR_6.command)
-        receivedInput = KEY_6;
-      else if (irmp_data.address == Settings.IR_PREVIOUS.address && irmp_data.command == Settings.IR_PREVIOUS.command)
-        receivedInput = KEY_PREVIOUS;
-      else if (irmp_data.address == Settings.IR_REPEAT.address && irmp_data.command == Settings.IR_REPEAT.command)
+      receivedInput = irKeyMap.find(Event.Data.protocol, Event.Data.address, Event.Data.command);
+      bool Repeatable = receivedInput == KEY_UP || receivedInput == KEY_DOWN || receivedInput == KEY_LEFT || receivedInput == KEY_RIGHT;
+      if (receivedInput == KEY_REPEAT) // A specific repeat code (ie. Apple remotes) - the previous key is held if it was UP or DOWN
+      {
+        if (lastReceivedInput == KEY_UP || lastReceivedInput == KEY_DOWN)
+          startKeyRepeat(lastReceivedInput, Event.Timestamp, true);
+        receivedInput = KEY_NONE;
+      }
+      else
       {
-        receivedInput = KEY_REPEAT;
-        if (lastReceivedInput == KEY_UP)
-          receivedInput = KEY_UP;
-        else if (lastReceivedInput == KEY_DOWN)
-          receivedInput = KEY_DOWN;
+        // Only the keys used to change values or to navigate are repeated while held (below), not ie. MUTE or ON/OFF
+        lastReceivedInput = receivedInput;
+        if (Repeatable)
+          startKeyRepeat(receivedInput, Event.Timestamp + KEY_REPEAT_DELAY, true);
       }
-    lastReceivedInput = receivedInput;
+      mil_LastInputEvent = Event.Timestamp;
+    }
+  }
+
+  // Stop repeating a key held on the remote if no frame has been received for a while - in case the release is handled late
+  if (repeatFromIR && repeatKey != KEY_NONE && millis() - mil_LastIRFrame > IR_RELEASE_TIMEOUT)
+    stopKeyRepeat();
+
+  // Repeat the held key
+  if (receivedInput == KEY_NONE && repeatKey != KEY_NONE && (long)(millis() - mil_NextRepeat) >= 0)
+  {
+    receivedInput = repeatKey;
+    mil_LastInputEvent = millis();
+    mil_NextRepeat = mil_LastInputEvent + 1000 / Settings.KeyRepeatRate;
   }
 
   // Cancel received KEY_ONOFF if it has been received before within the last 5 seconds
@@ -492,6 +909,9 @@ byte getUserInput()
   else if (appMode != APP_STANDBY_MODE)
     ScreenSaverOff();
 
+  // Go to standby if the temperature protection has tripped - done here as getUserInput is called by all parts of the user interface
+  checkThermalProtection();
+
   // If inactivity timer is set, go to standby if the set number of hours have passed since last user input
   if ((appMode != APP_STANDBY_MODE) && (Settings.TriggerInactOffTimer > 0) && ((mil_LastUserInput + Settings.TriggerInactOffTimer * 3600000) < millis()))
   {
@@ -518,341 +938,1332 @@ void ScreenSaverOff()
 #include <AsyncTCP.h>
 #include <ESPAsyncWebServer.h>
 #include <AsyncElegantOTA.h>
-#include "SPIFFS.h"
-#include <Arduino_JSON.h>
-// #include <ArduinoJson.h>
+#include <LittleFS.h>
+#include <ArduinoJson.h>
+#include <BinaryProtocol.h> // Binary WebSocket protocol for apps - see the file for the frames
+#include <WebCommandParser.h>
+#include <WebState.h>
 
 // Create AsyncWebServer object on port 80
 AsyncWebServer server(80);
 
+// The files of the web pages are prepared by tools/build_web_assets.py: they are gzipped, and other files than the pages are renamed with
+// a hash of their content and served from /static/ - so they can be cached by the browsers for as long as they like
+#define STATIC_CACHE_CONTROL "public, max-age=31536000, immutable"
+
 // Create a WebSocket object
 AsyncWebSocket ws("/ws");
 
-// Get all current values as JSON
-String getJSONCurrentValues()
-{
-  JSONVar JSONValues; // Json variable to hold values
-  if (appMode == APP_STANDBY_MODE)
-    JSONValues["OnState"] = "Standby";
-  else
-    JSONValues["OnState"] = "On";
-  JSONValues["Input"] = String(Settings.Input[RuntimeSettings.CurrentInput].Name);
-  JSONValues["VolumeSteps"] = Settings.VolumeSteps;
-  JSONValues["Volume"] = RuntimeSettings.CurrentVolume;
+// Server-Sent Events - the same JSON state as sent to the WebSocket clients, as "state" events
+AsyncEventSource events("/events");
 
-  int Attenuation = getAttenuation(Settings.VolumeSteps, RuntimeSettings.CurrentVolume, Settings.MinAttenuation, Settings.MaxAttenuation);
+// The state is sent to the web clients as JSON serialized into a buffer on the stack of the caller (see WebState.h)
+#define JSON_BUFFER_SIZE 192 // Room for the longest message (getJSONCurrentValues)
+typedef char JSONBuffer[JSON_BUFFER_SIZE];
 
-  JSONValues["Volume"] = RuntimeSettings.CurrentVolume;
-  if (RuntimeSettings.InputLastBal[RuntimeSettings.CurrentInput] == 127 || RuntimeSettings.InputLastBal[RuntimeSettings.CurrentInput] < 118 || RuntimeSettings.InputLastBal[RuntimeSettings.CurrentInput] > 136)
-    JSONValues["Volume_dB"] = String(float(Attenuation / 2));
-  else if (RuntimeSettings.InputLastBal[RuntimeSettings.CurrentInput] < 127) // Balance shifted to the left channel by lowering the right channel
-    JSONValues["Volume_dB"] = String(float(Attenuation / 2)) + String("/") + String(float((Attenuation + (127 - RuntimeSettings.InputLastBal[RuntimeSettings.CurrentInput])) / 2));
-  else if (RuntimeSettings.InputLastBal[RuntimeSettings.CurrentInput] > 127) // Balance shifted to the right channel by lowering the left channel
-    JSONValues["Volume_dB"] = String(float((Attenuation + (RuntimeSettings.InputLastBal[RuntimeSettings.CurrentInput] - 127)) / 2)) + String("/") + String(float(Attenuation / 2));
+#define WS_BROADCAST_INTERVAL 100 // Minimum ms between two messages with changed state to the web clients
 
-  JSONValues["Temp1"] = int(getTemperature(NTC1_PIN));
-  JSONValues["Temp2"] = int(getTemperature(NTC2_PIN));
-  return JSON.stringify(JSONValues);
-}
+volatile byte stateDirty = 0;        // The state fields changed since they were last sent to the web clients
+volatile uint32_t stateVersion = 0;  // Counted up when a state field is changed (used as ETag of the state by the REST API)
+unsigned long mil_LastBroadcast = 0; // The time the changed state was last sent
+byte wsPending = 0;                  // The state fields changed but not sent to the WebSocket clients yet (they were busy)
+byte eventsPending = 0;              // The state fields changed but not sent to the event source clients yet (they were busy)
 
-// Get On/Standby state as JSON
-String getJSONOnStandbyState()
+// The id of the last event sent - starts from a random number, so the Last-Event-ID of a client reconnecting after a restart does not match
+volatile uint32_t eventsLastId;
+// The state as shown in index.html when it is sent (see processor) - kept as text and updated by broadcastState, so the page can be rendered
+// without reading the temperatures or calculating the attenuation while it is sent
+typedef struct
 {
-  JSONVar JSONValues; // Json variable to hold values
-  if (appMode == APP_STANDBY_MODE)
-    JSONValues["OnState"] = "Standby";
-  else
-    JSONValues["OnState"] = "On";
-  return JSON.stringify(JSONValues);
-}
-
-// Get selected input name as JSON
-String getJSONCurrentInput()
+  char OnState[8]; // As in the JSON state
+  char Input[11];
+  char Volume[4];
+  char VolumeSteps[4];
+  char Volume_dB[WEB_STATE_DB_SIZE];
+  char Temp1[6];
+  char Temp2[6];
+} PageState;
+PageState pageState;
+portMUX_TYPE pageStateMux = portMUX_INITIALIZER_UNLOCKED;
+
+volatile bool eventsSnapshot = false; // Set when a client has (re)connected without having the last event - all fields are sent in the next event
+#define EVENTS_RETRY 2000             // ms before a client reconnects when the connection is lost
+portMUX_TYPE stateDirtyMux = portMUX_INITIALIZER_UNLOCKED;
+
+// Clients that have switched to the binary protocol (see BinaryProtocol.h) - they are sent BinaryState instead of JSON
+#define BINARY_MAX_CLIENTS 8
+uint32_t binaryClients[BINARY_MAX_CLIENTS];
+bool binarySnapshot[BINARY_MAX_CLIENTS]; // Set for a client to be sent all fields by broadcastState (after BIN_HELLO and BIN_GET_STATE)
+volatile byte binaryClientCount = 0;
+volatile bool binarySnapshotPending = false; // Set when any binarySnapshot is set
+portMUX_TYPE binaryClientsMux = portMUX_INITIALIZER_UNLOCKED;
+
+// Commands from the web clients are queued by the handlers (running on the AsyncTCP task) and executed by loop(), so the I2C and SPI
+// devices and the EEPROM are only used from one task, and a slow command (eg. startUp) does not hold up the network
+#define CTL_SET_VOLUME 1   // Value: volume step
+#define CTL_STEP_VOLUME 2  // Value: number of steps up (or down if negative)
+#define CTL_SET_INPUT 3    // Value: input 0 - 5
+#define CTL_STEP_INPUT 4   // Value: 1 = next input, -1 = previous input
+#define CTL_POWER 5        // Value: BIN_POWER_xxx
+#define CTL_SET_BALANCE 6  // Value: balance (see setBalance)
+#define CTL_LOAD_PROFILE 7 // Value: profile 1 - PROFILE_COUNT
+#define CTL_SET_WIFI 8     // Value: not used - the network settings are in pendingWiFi
+#define CONTROL_QUEUE_LENGTH 16
+typedef struct
+{
+  byte Command; // CTL_xxx
+  int16_t Value;
+} ControlCommand;
+QueueHandle_t controlQueue = NULL;
+
+// Settings changed by PUT /api/settings - applied by processControlCommands (only the newest is kept)
+mySettings pendingSettings;
+bool settingsPending = false;
+portMUX_TYPE pendingSettingsMux = portMUX_INITIALIZER_UNLOCKED;
+
+// Network settings posted to the WiFi configuration page (access point mode) - applied by processControlCommands on CTL_SET_WIFI
+#define WIFI_SSID 0x01 // The fields posted
+#define WIFI_PASS 0x02
+#define WIFI_IP 0x04
+#define WIFI_GATEWAY 0x08
+typedef struct
+{
+  byte Fields; // WIFI_xxx
+  char ssid[sizeof(Settings.ssid)];
+  char pass[sizeof(Settings.pass)];
+  char ip[sizeof(Settings.ip)];
+  char gateway[sizeof(Settings.gateway)];
+} WiFiSettings;
+WiFiSettings pendingWiFi;
+portMUX_TYPE pendingWiFiMux = portMUX_INITIALIZER_UNLOCKED;
+
+// Queue a command for loop() - returns false if the queue is full (the command is dropped)
+bool postControlCommand(byte Command, int16_t Value)
 {
-  JSONVar JSONValues; // Json variable to hold values
-  JSONValues["Input"] = String(Settings.Input[RuntimeSettings.CurrentInput].Name);
-  return JSON.stringify(JSONValues);
+  ControlCommand Cmd = {Command, Value};
+  if (controlQueue == NULL || xQueueSend(controlQueue, &Cmd, 0) != pdTRUE)
+  {
+    debugln("Control queue full - web command dropped");
+    return false;
+  }
+  return true;
 }
 
-// Get current volume as JSON
-String getJSONCurrentVolume()
+// Format the attenuation of the current volume in -dB - as "left/right" if the balance is shifted
+void formatVolume_dB(char *Buffer, size_t Size)
 {
-  JSONVar JSONValues; // Json variable to hold values
   int Attenuation = getAttenuation(Settings.VolumeSteps, RuntimeSettings.CurrentVolume, Settings.MinAttenuation, Settings.MaxAttenuation);
-
-  JSONValues["Volume"] = RuntimeSettings.CurrentVolume;
-  if (RuntimeSettings.InputLastBal[RuntimeSettings.CurrentInput] == 127 || RuntimeSettings.InputLastBal[RuntimeSettings.CurrentInput] < 118 || RuntimeSettings.InputLastBal[RuntimeSettings.CurrentInput] > 136)
-    JSONValues["Volume_dB"] = String(float(Attenuation / 2));
-  else if (RuntimeSettings.InputLastBal[RuntimeSettings.CurrentInput] < 127) // Balance shifted to the left channel by lowering the right channel
-    JSONValues["Volume_dB"] = String(float(Attenuation / 2)) + String("/") + String(float((Attenuation + (127 - RuntimeSettings.InputLastBal[RuntimeSettings.CurrentInput])) / 2));
-  else if (RuntimeSettings.InputLastBal[RuntimeSettings.CurrentInput] > 127) // Balance shifted to the right channel by lowering the left channel
-    JSONValues["Volume_dB"] = String(float((Attenuation + (RuntimeSettings.InputLastBal[RuntimeSettings.CurrentInput] - 127)) / 2)) + String("/") + String(float(Attenuation / 2));
-  return JSON.stringify(JSONValues);
+  formatAttenuation_dB(Buffer, Size, Attenuation, RuntimeSettings.InputLastBal[RuntimeSettings.CurrentInput]);
 }
 
-// Get temperatures as JSON
-String getJSONTempValues()
+// Get the state fields in Fields (STATE_xxx) as JSON
+const char *getJSONState(JSONBuffer Buffer, byte Fields)
 {
-  JSONVar JSONValues; // Json variable to hold values
-  JSONValues["Temp1"] = int(getTemperature(NTC1_PIN));
-  JSONValues["Temp2"] = int(getTemperature(NTC2_PIN));
-  return JSON.stringify(JSONValues);
+  WebStateValues Values = {};
+  char Volume_dB[WEB_STATE_DB_SIZE];
+  if (Fields & STATE_ON_STANDBY)
+    Values.OnState = (appMode == APP_STANDBY_MODE) ? "Standby" : "On";
+  if (Fields & STATE_INPUT)
+    Values.Input = (const char *)Settings.Input[RuntimeSettings.CurrentInput].Name;
+  if (Fields & STATE_VOLUME)
+  {
+    formatVolume_dB(Volume_dB, sizeof(Volume_dB));
+    Values.HasVolume = true;
+    Values.VolumeSteps = Settings.VolumeSteps;
+    Values.Volume = RuntimeSettings.CurrentVolume;
+    Values.Volume_dB = Volume_dB;
+  }
+  if (Fields & STATE_TEMPERATURES)
+  {
+    Values.HasTemperatures = true;
+    Values.Temp1 = int(getTemperature(NTC1_PIN));
+    Values.Temp2 = int(getTemperature(NTC2_PIN));
+  }
+  return serializeWebState(Values, Buffer, JSON_BUFFER_SIZE);
 }
 
-void notifyClients(String message)
+// Update the state fields in Fields (STATE_xxx) of pageState
+void updatePageState(byte Fields)
 {
-  ws.textAll(message);
-  debugln("Sent: " + message);
+  PageState State;
+  portENTER_CRITICAL(&pageStateMux);
+  State = pageState;
+  portEXIT_CRITICAL(&pageStateMux);
+  if (Fields & STATE_ON_STANDBY)
+    strcpy(State.OnState, (appMode == APP_STANDBY_MODE) ? "Standby" : "On");
+  if (Fields & STATE_INPUT)
+    memcpy(State.Input, Settings.Input[RuntimeSettings.CurrentInput].Name, sizeof(State.Input));
+  if (Fields & STATE_VOLUME)
+  {
+    snprintf(State.Volume, sizeof(State.Volume), "%u", RuntimeSettings.CurrentVolume);
+    snprintf(State.VolumeSteps, sizeof(State.VolumeSteps), "%u", Settings.VolumeSteps);
+    formatVolume_dB(State.Volume_dB, sizeof(State.Volume_dB));
+  }
+  if (Fields & STATE_TEMPERATURES)
+  {
+    snprintf(State.Temp1, sizeof(State.Temp1), "%d", int(getTemperature(NTC1_PIN)));
+    snprintf(State.Temp2, sizeof(State.Temp2), "%d", int(getTemperature(NTC2_PIN)));
+  }
+  portENTER_CRITICAL(&pageStateMux);
+  pageState = State;
+  portEXIT_CRITICAL(&pageStateMux);
 }
 
-void handleWebSocketMessage(void *arg, uint8_t *data, size_t len)
+// Get the state as BinaryState - Changed is the fields changed since the last state sent (STATE_xxx)
+void getBinaryState(BinaryState &State, byte Changed)
 {
-  AwsFrameInfo *info = (AwsFrameInfo *)arg;
-  if (info->final && info->index == 0 && info->len == len && info->opcode == WS_TEXT)
-  {
-    data[len] = 0;
-    String message = (char *)data;
-
-    if (message.indexOf("Volume:Up") >= 0)
-      setVolume(RuntimeSettings.CurrentVolume + 1);
-    else if (message.indexOf("Volume:Down") >= 0)
-      setVolume(RuntimeSettings.CurrentVolume - 1);
-    else if (message.indexOf("Volume:") >= 0)
-      setVolume(message.substring(7).toInt());
+  State.Opcode = BIN_STATE;
+  State.Changed = Changed;
+  State.On = (appMode != APP_STANDBY_MODE);
+  State.Input = RuntimeSettings.CurrentInput;
+  State.VolumeSteps = Settings.VolumeSteps;
+  State.Volume = RuntimeSettings.CurrentVolume;
+  State.Balance = RuntimeSettings.InputLastBal[RuntimeSettings.CurrentInput];
+  State.Attenuation = getAttenuation(Settings.VolumeSteps, RuntimeSettings.CurrentVolume, Settings.MinAttenuation, Settings.MaxAttenuation);
+  State.Temp1 = int(getTemperature(NTC1_PIN));
+  State.Temp2 = int(getTemperature(NTC2_PIN));
+  memcpy(State.InputName, Settings.Input[RuntimeSettings.CurrentInput].Name, sizeof(State.InputName));
+}
 
-    if (message.indexOf("Input:Up") >= 0)
-      setNextInput();
-    else if (message.indexOf("Input:Down") >= 0)
-      setPrevInput();
-    else if (message.indexOf("Input:") >= 0)
-      setInput(message.substring(7).toInt());
+bool isBinaryClient(uint32_t Id)
+{
+  bool Found = false;
+  portENTER_CRITICAL(&binaryClientsMux);
+  for (byte i = 0; i < binaryClientCount; i++)
+    if (binaryClients[i] == Id)
+      Found = true;
+  portEXIT_CRITICAL(&binaryClientsMux);
+  return Found;
+}
 
-    if (message.indexOf("Power:") >= 0)
+// Have broadcastState send all fields to a binary client - returns false if the client has not switched to the binary protocol
+bool requestBinarySnapshot(uint32_t Id)
+{
+  bool Found = false;
+  portENTER_CRITICAL(&binaryClientsMux);
+  for (byte i = 0; i < binaryClientCount; i++)
+    if (binaryClients[i] == Id)
     {
-      if (appMode == APP_STANDBY_MODE && message.indexOf("Power:On") >= 0) startUp();
-      if (appMode == APP_NORMAL_MODE && message.indexOf("Power:Standby") >= 0) toStandbyMode();
-      if (message.indexOf("Power:Toggle") >= 0)
-      {
-        if (appMode == APP_STANDBY_MODE) startUp();
-        else if (appMode == APP_NORMAL_MODE) toStandbyMode();
-      }
-      notifyClients(getJSONOnStandbyState());
+      binarySnapshot[i] = true;
+      binarySnapshotPending = true;
+      Found = true;
     }
+  portEXIT_CRITICAL(&binaryClientsMux);
+  return Found;
+}
 
+// Switch a client to the binary protocol - returns false if there are BINARY_MAX_CLIENTS already
+bool addBinaryClient(uint32_t Id)
+{
+  bool Added = false;
+  portENTER_CRITICAL(&binaryClientsMux);
+  for (byte i = 0; i < binaryClientCount; i++)
+    if (binaryClients[i] == Id)
+      Added = true;
+  if (!Added && binaryClientCount < BINARY_MAX_CLIENTS)
+  {
+    binarySnapshot[binaryClientCount] = false;
+    binaryClients[binaryClientCount++] = Id;
+    Added = true;
+  }
+  portEXIT_CRITICAL(&binaryClientsMux);
+  return Added;
+}
 
-
-    // Default message received when a new Websocket client connects -> Send all values
-    if (strcmp((char *)data, "getValues") == 0)
+void removeBinaryClient(uint32_t Id)
+{
+  portENTER_CRITICAL(&binaryClientsMux);
+  for (byte i = 0; i < binaryClientCount; i++)
+    if (binaryClients[i] == Id)
     {
-      notifyClients(getJSONCurrentValues());
+      binaryClientCount--;
+      binarySnapshot[i] = binarySnapshot[binaryClientCount];
+      binaryClients[i--] = binaryClients[binaryClientCount];
     }
-  }
-  mil_LastUserInput = millis();
+  portEXIT_CRITICAL(&binaryClientsMux);
 }
 
-void onEvent(AsyncWebSocket *server, AsyncWebSocketClient *client, AwsEventType type, void *arg, uint8_t *data, size_t len)
+// Send all fields to the binary clients that have asked for them - called from broadcastState, so the state is read by the task changing it
+void sendBinarySnapshots()
 {
-  switch (type)
+  uint32_t Ids[BINARY_MAX_CLIENTS];
+  byte Count = 0;
+  portENTER_CRITICAL(&binaryClientsMux);
+  binarySnapshotPending = false;
+  for (byte i = 0; i < binaryClientCount; i++)
+    if (binarySnapshot[i])
+    {
+      binarySnapshot[i] = false;
+      Ids[Count++] = binaryClients[i];
+    }
+  portEXIT_CRITICAL(&binaryClientsMux);
+  if (Count == 0)
+    return;
+
+  BinaryState State;
+  getBinaryState(State, STATE_ALL);
+  for (byte i = 0; i < Count; i++)
   {
-  case WS_EVT_CONNECT:
-    Serial.printf("WebSocket client #%u connected from %s\n", client->id(), client->remoteIP().toString().c_str());
-    break;
-  case WS_EVT_DISCONNECT:
-    Serial.printf("WebSocket client #%u disconnected\n", client->id());
-    break;
-  case WS_EVT_DATA:
-    handleWebSocketMessage(arg, data, len);
-    break;
-  case WS_EVT_PONG:
-  case WS_EVT_ERROR:
-    break;
+    AsyncWebSocketClient *Client = ws.client(Ids[i]);
+    if (Client != NULL && Client->status() == WS_CONNECTED)
+      Client->binary((const char *)&State, sizeof(State));
   }
 }
 
-void initWebSocket()
+void sendBinaryError(AsyncWebSocketClient *Client, byte Code, byte Rejected)
 {
-  ws.onEvent(onEvent);
-  server.addHandler(&ws);
+  BinaryError Error = {BIN_ERROR, Code, Rejected};
+  Client->binary((const char *)&Error, sizeof(Error));
 }
 
-// Search for parameter in HTTP POST request - used for wifi configuration page
-const char *PARAM_INPUT_1 = "ssid";
-const char *PARAM_INPUT_2 = "pass";
-const char *PARAM_INPUT_3 = "ip";
-const char *PARAM_INPUT_4 = "gateway";
-
-IPAddress localIP;
-// IPAddress localIP(192, 168, 1, 200); // hardcoded
-
-// Set your Gateway IP address
-IPAddress localGateway;
-// IPAddress localGateway(192, 168, 1, 1); //hardcoded
-IPAddress subnet(255, 255, 0, 0);
-
-// Timer variables
-unsigned long previousMillis = 0;
-const long interval = 10000; // interval to wait for Wi-Fi connection (milliseconds)
-
-// Initialize SPIFFS
-void initSPIFFS()
+void notifyClients(const char *message)
 {
-  if (!SPIFFS.begin(true))
-  {
-    debugln("An error has occurred while mounting SPIFFS");
-  }
-  debugln("SPIFFS mounted successfully");
+  ws.textAll(message);
+  debug("Sent: ");
+  debugln(message);
 }
 
-// Read File from SPIFFS
-String readFile(fs::FS &fs, const char *path)
+// Mark state fields (STATE_xxx) as changed - they are sent to the web clients by broadcastState
+void markStateDirty(byte Fields)
 {
-  Serial.printf("Reading file: %s\r\n", path);
+  portENTER_CRITICAL(&stateDirtyMux);
+  stateDirty |= Fields;
+  stateVersion++;
+  portEXIT_CRITICAL(&stateDirtyMux);
+}
 
-  File file = fs.open(path);
-  if (!file || file.isDirectory())
+// Send the state fields in Fields to each WebSocket client in the protocol it uses
+void sendWebSocketState(byte Fields)
+{
+  JSONBuffer Json;
+  getJSONState(Json, Fields);
+  if (binaryClientCount == 0)
   {
-    debugln("- failed to open file for reading");
-    return String();
+    notifyClients(Json);
+    return;
   }
-
-  String fileContent;
-  while (file.available())
+  BinaryState State;
+  getBinaryState(State, Fields);
+  for (AsyncWebSocketClient *Client : ws.getClients())
   {
-    fileContent = file.readStringUntil('\n');
-    break;
+    if (Client->status() != WS_CONNECTED)
+      continue;
+    if (isBinaryClient(Client->id()))
+      Client->binary((const char *)&State, sizeof(State));
+    else
+      Client->text(Json);
   }
-  return fileContent;
+  debug("Sent: ");
+  debugln(Json);
 }
 
-// Write file to SPIFFS
-void writeFile(fs::FS &fs, const char *path, const char *message)
+// Send the changed state fields to the web clients as one message - at most every WS_BROADCAST_INTERVAL, so eg. a fast turn of the volume
+// encoder does not flood the clients (and the queues of AsyncWebSocket and AsyncEventSource) with a message per step. Called from getUserInput, so the newest state
+// is sent within WS_BROADCAST_INTERVAL from all parts of the user interface
+// The WebSocket and the event source clients are sent the changes when they have sent the previous message - while they are busy the changes are
+// collected in wsPending and eventsPending, so a slow client gets the newest state and the intermediate states are dropped instead of queued
+void broadcastState()
 {
-  Serial.printf("Writing file: %s\r\n", path);
-
-  File file = fs.open(path, FILE_WRITE);
-  if (!file)
-  {
-    debugln("- failed to open file for writing");
+  updateAPISnapshots();
+  if (binarySnapshotPending)
+    sendBinarySnapshots();
+  if (millis() - mil_LastBroadcast < WS_BROADCAST_INTERVAL)
     return;
+  if (eventsSnapshot)
+  {
+    eventsSnapshot = false;
+    eventsPending |= STATE_ALL;
   }
-  if (file.print(message))
+  if (stateDirty != 0)
   {
-    debugln("- file written");
+    portENTER_CRITICAL(&stateDirtyMux);
+    byte Fields = stateDirty;
+    stateDirty = 0;
+    portEXIT_CRITICAL(&stateDirtyMux);
+    wsPending |= Fields;
+    eventsPending |= Fields;
+    updatePageState(Fields);
   }
-  else
+  if (events.count() == 0)
+    eventsPending = 0; // A client connecting is sent all fields
+  if (wsPending == 0 && eventsPending == 0)
+    return;
+  mil_LastBroadcast = millis();
+  ws.cleanupClients();
+  if (wsPending != 0 && ws.availableForWriteAll())
   {
-    debugln("- write failed");
+    sendWebSocketState(wsPending);
+    wsPending = 0;
+  }
+  if (eventsPending != 0 && events.avgPacketsWaiting() == 0) // The average is rounded up, so it is 0 only if no client has a message waiting
+  {
+    JSONBuffer Json;
+    events.send(getJSONState(Json, eventsPending), "state", ++eventsLastId);
+    eventsPending = 0;
   }
 }
 
-// Initialize WiFi
-bool initWiFi()
+// A client has connected to the event source - if it does not have the last event (Last-Event-ID), all fields are sent in the next event
+void onEventsConnect(AsyncEventSourceClient *client)
 {
-  if (Settings.ssid == "" || Settings.ip == "")
-  {
-    debugln("Undefined SSID or IP address.");
-    return false;
-  }
+  if (client->lastId() != eventsLastId)
+    eventsSnapshot = true;
+  client->send(NULL, NULL, 0, EVENTS_RETRY); // No data - only sets the time before the client reconnects
+}
 
-  WiFi.mode(WIFI_STA);
-  localIP.fromString(Settings.ip);
-  localGateway.fromString(Settings.gateway);
+// The commands of the text protocol (see WebCommandParser.h) - Input and Profile are numbered from 1 as on the display
+#define WEB_CMD_VOLUME 1
+#define WEB_CMD_INPUT 2
+#define WEB_CMD_POWER 3
+#define WEB_CMD_PROFILE 4
+#define WEB_CMD_GET_VALUES 5
+const WebCommandVerb webCommands[] = {
+    {"Volume", WEB_CMD_VOLUME, WEB_ARG_UP | WEB_ARG_DOWN | WEB_ARG_NUMBER, 0, 255}, // The maximum is Settings.VolumeSteps - checked in handleWebSocketMessage
+    {"Input", WEB_CMD_INPUT, WEB_ARG_UP | WEB_ARG_DOWN | WEB_ARG_NUMBER, 1, 6},
+    {"Power", WEB_CMD_POWER, WEB_ARG_ON | WEB_ARG_STANDBY | WEB_ARG_TOGGLE, 0, 0},
+    {"Profile", WEB_CMD_PROFILE, WEB_ARG_NUMBER, 1, PROFILE_COUNT},
+    {"getValues", WEB_CMD_GET_VALUES, WEB_ARG_NONE, 0, 0}}; // Sent when a new Websocket client connects -> Send all values
 
-  if (!WiFi.config(localIP, localGateway, subnet))
+void handleWebSocketMessage(void *arg, uint8_t *data, size_t len)
+{
+  AwsFrameInfo *info = (AwsFrameInfo *)arg;
+  if (!info->final || info->index != 0 || info->len != len || info->opcode != WS_TEXT)
+    return;
+
+  WebCommand Command;
+  WebCommandResult Result = parseWebCommand(data, len, webCommands, sizeof(webCommands) / sizeof(webCommands[0]), Command);
+  if (Result == WEB_CMD_OK && Command.id == WEB_CMD_VOLUME && Command.argument == WEB_ARG_NUMBER && Command.value > Settings.VolumeSteps)
+    Result = WEB_CMD_OUT_OF_RANGE;
+  if (Result != WEB_CMD_OK)
   {
-    debugln("STA Failed to configure");
-    return false;
+    debug("Web command not accepted: ");
+    debugln(Result);
+    return;
   }
-  WiFi.begin(Settings.ssid, Settings.pass);
-  debugln("Connecting to WiFi...");
-
-  unsigned long currentMillis = millis();
-  previousMillis = currentMillis;
 
-  while (WiFi.status() != WL_CONNECTED)
+  // The commands are executed by loop() - the resulting state is sent to the clients by broadcastState
+  switch (Command.id)
   {
-    currentMillis = millis();
-    if (currentMillis - previousMillis >= interval)
-    {
-      debugln("Failed to connect.");
-      return false;
-    }
+  case WEB_CMD_VOLUME:
+    if (Command.argument == WEB_ARG_NUMBER)
+      postControlCommand(CTL_SET_VOLUME, Command.value);
+    else
+      postControlCommand(CTL_STEP_VOLUME, (Command.argument == WEB_ARG_UP) ? 1 : -1);
+    break;
+  case WEB_CMD_INPUT:
+    if (Command.argument == WEB_ARG_NUMBER)
+      postControlCommand(CTL_SET_INPUT, Command.value - 1);
+    else
+      postControlCommand(CTL_STEP_INPUT, (Command.argument == WEB_ARG_UP) ? 1 : -1);
+    break;
+  case WEB_CMD_POWER:
+    postControlCommand(CTL_POWER, (Command.argument == WEB_ARG_ON) ? BIN_POWER_ON : (Command.argument == WEB_ARG_STANDBY) ? BIN_POWER_STANDBY : BIN_POWER_TOGGLE);
+    break;
+  case WEB_CMD_PROFILE:
+    postControlCommand(CTL_LOAD_PROFILE, Command.value);
+    break;
+  case WEB_CMD_GET_VALUES:
+    markStateDirty(STATE_ALL);
+    break;
   }
-
-  debugln(WiFi.localIP());
-  return true;
 }
 
-// Replaces placeholders with values
-String processor(const String &var)
+// Handle a frame of the binary protocol (see BinaryProtocol.h)
+void handleBinaryMessage(AsyncWebSocketClient *client, void *arg, uint8_t *data, size_t len)
 {
-  if (var == "STATE")
+  AwsFrameInfo *info = (AwsFrameInfo *)arg;
+  if (!info->final || info->index != 0 || info->len != len || len < sizeof(BinaryCommand))
+    return;
+
+  // The length needed by each opcode
+  size_t Needed;
+  switch (data[0])
+  {
+  case BIN_GET_STATE:
+    Needed = sizeof(BinaryCommand);
+    break;
+  case BIN_HELLO:
+    Needed = sizeof(BinaryHello);
+    break;
+  case BIN_STEP_VOLUME:
+  case BIN_STEP_INPUT:
+    Needed = sizeof(BinaryStep);
+    break;
+  case BIN_SET_VOLUME:
+  case BIN_SET_INPUT:
+  case BIN_SET_POWER:
+  case BIN_SET_BALANCE:
+    Needed = sizeof(BinaryValue);
+    break;
+  default:
+    sendBinaryError(client, BIN_ERROR_UNKNOWN_OPCODE, data[0]);
+    return;
+  }
+  if (len < Needed)
+  {
+    sendBinaryError(client, BIN_ERROR_LENGTH, data[0]);
+    return;
+  }
+
+  const BinaryValue *Value = (const BinaryValue *)data;
+  const BinaryStep *Step = (const BinaryStep *)data;
+  switch (data[0])
   {
-    if (appMode != APP_STANDBY_MODE)
+  case BIN_HELLO:
+  {
+    BinaryHello Hello = {BIN_HELLO, BINARY_PROTOCOL_VERSION};
+    if (((const BinaryHello *)data)->Version != BINARY_PROTOCOL_VERSION)
     {
-      return "ON";
+      sendBinaryError(client, BIN_ERROR_VERSION, BIN_HELLO);
+      return;
     }
-    else
+    if (!addBinaryClient(client->id()))
     {
-      return "SLEEPING";
+      sendBinaryError(client, BIN_ERROR_BUSY, BIN_HELLO);
+      return;
     }
+    client->binary((const char *)&Hello, sizeof(Hello));
+    requestBinarySnapshot(client->id()); // The snapshot is sent by broadcastState after the answer
+    break;
   }
-  if (var == "SELECTEDINPUT")
+  case BIN_GET_STATE:
+    requestBinarySnapshot(client->id());
+    break;
+  case BIN_SET_VOLUME:
+    postControlCommand(CTL_SET_VOLUME, Value->Value);
+    break;
+  case BIN_STEP_VOLUME:
+    postControlCommand(CTL_STEP_VOLUME, Step->Steps);
+    break;
+  case BIN_SET_INPUT:
+    postControlCommand(CTL_SET_INPUT, Value->Value);
+    break;
+  case BIN_STEP_INPUT:
+    postControlCommand(CTL_STEP_INPUT, Step->Steps);
+    break;
+  case BIN_SET_POWER:
+    postControlCommand(CTL_POWER, Value->Value);
+    break;
+  case BIN_SET_BALANCE:
+    postControlCommand(CTL_SET_BALANCE, Value->Value);
+    break;
+  }
+}
+
+// Execute the commands queued by the web clients - called from loop()
+void processControlCommands()
+{
+  ControlCommand Cmd;
+  while (controlQueue != NULL && xQueueReceive(controlQueue, &Cmd, 0) == pdTRUE)
   {
-    return String(Settings.Input[RuntimeSettings.CurrentInput].Name);
+    switch (Cmd.Command)
+    {
+    case CTL_SET_VOLUME:
+      setVolume(Cmd.Value);
+      break;
+    case CTL_STEP_VOLUME:
+      setVolume(RuntimeSettings.CurrentVolume + Cmd.Value);
+      break;
+    case CTL_SET_INPUT:
+      setInput(Cmd.Value);
+      break;
+    case CTL_STEP_INPUT:
+      if (Cmd.Value > 0)
+        setNextInput();
+      else if (Cmd.Value < 0)
+        setPrevInput();
+      break;
+    case CTL_POWER:
+      if (appMode == APP_STANDBY_MODE && (Cmd.Value == BIN_POWER_ON || Cmd.Value == BIN_POWER_TOGGLE))
+        startUp();
+      else if (appMode == APP_NORMAL_MODE && (Cmd.Value == BIN_POWER_STANDBY || Cmd.Value == BIN_POWER_TOGGLE))
+        toStandbyMode();
+      markStateDirty(STATE_ON_STANDBY);
+      break;
+    case CTL_SET_BALANCE:
+      setBalance(Cmd.Value);
+      break;
+    case CTL_LOAD_PROFILE:
+      loadProfile(Cmd.Value);
+      break;
+    case CTL_SET_WIFI:
+      applyWiFiSettings();
+      break;
+    }
+    mil_LastUserInput = millis();
   }
-  if (var == "VOLUME")
+
+  if (settingsPending)
   {
-    if (!RuntimeSettings.Muted)
-      return String(RuntimeSettings.CurrentVolume) + " (" + String(getAttenuation(Settings.VolumeSteps, RuntimeSettings.CurrentVolume, Settings.MinAttenuation, Settings.MaxAttenuation) / 2) + " dB)";
+    mySettings New;
+    portENTER_CRITICAL(&pendingSettingsMux);
+    New = pendingSettings;
+    settingsPending = false;
+    portEXIT_CRITICAL(&pendingSettingsMux);
+    applySettings(New);
+    mil_LastUserInput = millis();
+  }
+}
+
+// Save the network settings posted to the WiFi configuration page and restart to connect to the network
+void applyWiFiSettings()
+{
+  WiFiSettings New;
+  portENTER_CRITICAL(&pendingWiFiMux);
+  New = pendingWiFi;
+  portEXIT_CRITICAL(&pendingWiFiMux);
+
+  if (New.Fields & WIFI_SSID)
+    memcpy(Settings.ssid, New.ssid, sizeof(Settings.ssid));
+  if (New.Fields & WIFI_PASS)
+    memcpy(Settings.pass, New.pass, sizeof(Settings.pass));
+  if (New.Fields & WIFI_IP)
+    memcpy(Settings.ip, New.ip, sizeof(Settings.ip));
+  if (New.Fields & WIFI_GATEWAY)
+    memcpy(Settings.gateway, New.gateway, sizeof(Settings.gateway));
+  debug("SSID set to: ");
+  debugln(Settings.ssid);
+  debug("IP Address set to: ");
+  debugln(Settings.ip);
+  debug("Gateway set to: ");
+  debugln(Settings.gateway);
+  markSettingsDirty();
+  flushEEPROM(true);
+
+  oled.clear();
+  oled.setCursor(0, 1);
+  oled.print(F("Wifi is configured"));
+  oled.setCursor(0, 3);
+  oled.print(F("Restarting..."));
+  delay(3000); // Let the answer to the browser be sent
+  ESP.restart();
+}
+
+// Web : Select input n (1 - 6) - the answer is "1" if the input can be selected now and the command has been queued, otherwise "0"
+void handleInputRequest(AsyncWebServerRequest *request, byte Input)
+{
+  bool Accepted = isInputSelectable(Input - 1) && postControlCommand(CTL_SET_INPUT, Input - 1);
+  request->send(200, "text/plain", Accepted ? "1" : "0");
+}
+
+// REST API -------------------------------------------------------------------------------------------------------------------------------
+// GET/PUT /api/state and /api/settings as JSON. The answers carry the version of the state or the settings as ETag, so a client polling with
+// If-None-Match is answered 304 Not Modified without building any JSON. A PUT is checked and queued for loop() and answered 202 Accepted
+#define API_MAX_BODY 2048 // The largest body accepted by a PUT
+#define API_STATE_SIZE JSON_OBJECT_SIZE(10)
+#define API_SETTINGS_SIZE (JSON_OBJECT_SIZE(7) + JSON_OBJECT_SIZE(7) + JSON_ARRAY_SIZE(6) + 6 * JSON_OBJECT_SIZE(4) + JSON_OBJECT_SIZE(10) + \
+                           JSON_OBJECT_SIZE(8) + JSON_OBJECT_SIZE(16) + 16 * JSON_OBJECT_SIZE(3) + JSON_OBJECT_SIZE(3))
+#define API_ETAG_SIZE 24
+uint32_t etagSalt; // Random at boot, so an ETag from before a restart does not match
+
+// The state and the settings served by GET are copies taken by loop() (see updateAPISnapshots), so the AsyncTCP task never reads Settings and
+// RuntimeSettings while they are being changed. Each copy has the version it was taken at, which is its ETag - so a body and its ETag always match
+typedef struct
+{
+  uint32_t Version; // stateVersion
+  bool On;
+  byte Input; // 0 - 5
+  char InputName[sizeof(Settings.Input[0].Name)];
+  byte Volume;
+  byte VolumeSteps;
+  char Volume_dB[WEB_STATE_DB_SIZE];
+  byte Balance;
+  int Temp1;
+  int Temp2;
+  byte Profile;
+} APIStateSnapshot;
+APIStateSnapshot apiState = {0xFFFFFFFF};
+mySettings apiSettings;
+uint32_t apiSettingsVersion = 0xFFFFFFFF; // settingsVersion of apiSettings
+portMUX_TYPE apiSnapshotMux = portMUX_INITIALIZER_UNLOCKED;
+
+// Take new copies of the state and the settings if they have changed - called from broadcastState
+void updateAPISnapshots()
+{
+  uint32_t Version = stateVersion; // Read before the state, so a change while it is copied makes the next call copy it again
+  if (Version != apiState.Version)
+  {
+    APIStateSnapshot State;
+    State.Version = Version;
+    State.On = appMode != APP_STANDBY_MODE;
+    State.Input = RuntimeSettings.CurrentInput;
+    memcpy(State.InputName, Settings.Input[RuntimeSettings.CurrentInput].Name, sizeof(State.InputName));
+    State.Volume = RuntimeSettings.CurrentVolume;
+    State.VolumeSteps = Settings.VolumeSteps;
+    formatVolume_dB(State.Volume_dB, sizeof(State.Volume_dB));
+    State.Balance = RuntimeSettings.InputLastBal[RuntimeSettings.CurrentInput];
+    State.Temp1 = int(getTemperature(NTC1_PIN));
+    State.Temp2 = int(getTemperature(NTC2_PIN));
+    State.Profile = activeProfile;
+    portENTER_CRITICAL(&apiSnapshotMux);
+    apiState = State;
+    portEXIT_CRITICAL(&apiSnapshotMux);
+  }
+
+  Version = settingsVersion;
+  if (Version != apiSettingsVersion)
+  {
+    portENTER_CRITICAL(&apiSnapshotMux);
+    apiSettings = Settings;
+    apiSettingsVersion = Version;
+    portEXIT_CRITICAL(&apiSnapshotMux);
+  }
+}
+
+// Answer 304 Not Modified if the client has the version in ETag already - returns true if the request has been answered
+bool sendAPINotModified(AsyncWebServerRequest *request, const char *ETag)
+{
+  if (!request->hasHeader("If-None-Match") || request->getHeader("If-None-Match")->value() != ETag)
+    return false;
+  AsyncWebServerResponse *response = request->beginResponse(304);
+  response->addHeader("ETag", ETag);
+  request->send(response);
+  return true;
+}
+
+// Stream the JSON to the client (serializeJson writes directly to the buffers of the response)
+void sendAPIJSON(AsyncWebServerRequest *request, const JsonDocument &Doc, const char *ETag)
+{
+  AsyncResponseStream *response = request->beginResponseStream("application/json");
+  response->addHeader("ETag", ETag);
+  response->addHeader("Cache-Control", "no-cache");
+  serializeJson(Doc, *response);
+  request->send(response);
+}
+
+void sendAPIError(AsyncWebServerRequest *request, int Code, const char *Error)
+{
+  char Body[64];
+  snprintf(Body, sizeof(Body), "{\"error\":\"%s\"}", Error);
+  request->send(Code, "application/json", Body);
+}
+
+// Collect the body of a PUT - it is kept terminated in request->_tempObject (freed with the request) until the whole body has been received
+void receiveAPIBody(AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total)
+{
+  if (total > API_MAX_BODY)
+    return;
+  if (index == 0)
+    request->_tempObject = malloc(total + 1);
+  if (request->_tempObject == NULL)
+    return;
+  memcpy((char *)request->_tempObject + index, data, len);
+  if (index + len == total)
+    ((char *)request->_tempObject)[total] = 0;
+}
+
+// Parse the body of a PUT - answers 413 Payload Too Large if it is larger than API_MAX_BODY or 400 Bad Request if it is not valid JSON and returns false
+bool parseAPIBody(AsyncWebServerRequest *request, JsonDocument &Doc)
+{
+  if (request->contentLength() > API_MAX_BODY)
+  {
+    sendAPIError(request, 413, "Body too large");
+    return false;
+  }
+  if (request->_tempObject == NULL || deserializeJson(Doc, (char *)request->_tempObject)) // Strings are not copied from the (writable) body
+  {
+    sendAPIError(request, 400, "Invalid JSON");
+    return false;
+  }
+  return true;
+}
+
+// True if Name only has the characters that can be entered in the menu (see editInputName) - the display can't show others, and the names are put into the web pages as they are
+bool isValidInputName(const char *Name)
+{
+  for (; *Name; Name++)
+    if (*Name != ' ' && !(*Name >= 'A' && *Name <= 'Z') && !(*Name >= 'a' && *Name <= 'z') && !(*Name >= '0' && *Name <= '9'))
+      return false;
+  return true;
+}
+
+// Read the member Key of Object into Value if it is present - returns false if it is present but not a number (or true/false) within Min - Max
+bool readAPIValue(JsonObjectConst Object, const char *Key, byte &Value, byte Min, byte Max)
+{
+  JsonVariantConst Member = Object[Key];
+  int Number;
+  if (Member.isNull())
+    return true;
+  if (Member.is<bool>())
+    Number = Member.as<bool>();
+  else if (Member.is<int>())
+    Number = Member.as<int>();
+  else
+    return false;
+  if (Number < Min || Number > Max)
+    return false;
+  Value = Number;
+  return true;
+}
+
+// GET /api/state
+void sendAPIState(AsyncWebServerRequest *request)
+{
+  APIStateSnapshot State;
+  portENTER_CRITICAL(&apiSnapshotMux);
+  State = apiState;
+  portEXIT_CRITICAL(&apiSnapshotMux);
+
+  char ETag[API_ETAG_SIZE];
+  snprintf(ETag, sizeof(ETag), "\"%08x-s%u\"", (unsigned)etagSalt, (unsigned)State.Version);
+  if (sendAPINotModified(request, ETag))
+    return;
+
+  StaticJsonDocument<API_STATE_SIZE> Doc;
+  Doc["OnState"] = State.On ? "On" : "Standby";
+  Doc["Input"] = State.Input + 1;
+  Doc["InputName"] = (const char *)State.InputName;
+  Doc["Volume"] = State.Volume;
+  Doc["VolumeSteps"] = State.VolumeSteps;
+  Doc["Volume_dB"] = (const char *)State.Volume_dB;
+  Doc["Balance"] = State.Balance;
+  Doc["Temp1"] = State.Temp1;
+  Doc["Temp2"] = State.Temp2;
+  Doc["Profile"] = State.Profile;
+  sendAPIJSON(request, Doc, ETag);
+}
+
+// PUT /api/state - any of OnState ("On"/"Standby"), Profile, Input (1 - 6), Volume and Balance
+void updateAPIState(AsyncWebServerRequest *request)
+{
+  StaticJsonDocument<API_STATE_SIZE> Doc;
+  if (!parseAPIBody(request, Doc))
+    return;
+  JsonObjectConst State = Doc.as<JsonObjectConst>();
+  byte Volume = 0, Input = 1, Balance = 127, Profile = 1;
+  const char *OnState = State["OnState"].as<const char *>();
+  if (!readAPIValue(State, "Volume", Volume, 0, Settings.VolumeSteps))
+    return sendAPIError(request, 400, "Volume");
+  if (!readAPIValue(State, "Input", Input, 1, 6))
+    return sendAPIError(request, 400, "Input");
+  if (!readAPIValue(State, "Balance", Balance, 118, 136))
+    return sendAPIError(request, 400, "Balance");
+  if (!readAPIValue(State, "Profile", Profile, 1, PROFILE_COUNT))
+    return sendAPIError(request, 400, "Profile");
+  if (!State["OnState"].isNull() && (OnState == NULL || (strcmp(OnState, "On") != 0 && strcmp(OnState, "Standby") != 0)))
+    return sendAPIError(request, 400, "OnState");
+
+  // Power on first and standby last, and load the profile before the input and volume are set
+  bool Queued = true;
+  if (OnState != NULL && strcmp(OnState, "On") == 0)
+    Queued &= postControlCommand(CTL_POWER, BIN_POWER_ON);
+  if (!State["Profile"].isNull())
+    Queued &= postControlCommand(CTL_LOAD_PROFILE, Profile);
+  if (!State["Input"].isNull())
+    Queued &= postControlCommand(CTL_SET_INPUT, Input - 1);
+  if (!State["Volume"].isNull())
+    Queued &= postControlCommand(CTL_SET_VOLUME, Volume);
+  if (!State["Balance"].isNull())
+    Queued &= postControlCommand(CTL_SET_BALANCE, Balance);
+  if (OnState != NULL && strcmp(OnState, "Standby") == 0)
+    Queued &= postControlCommand(CTL_POWER, BIN_POWER_STANDBY);
+  if (Queued)
+    request->send(202, "application/json", "{}");
+  else
+    sendAPIError(request, 503, "Busy");
+}
+
+// GET /api/settings - grouped as in the menu. The WiFi password is never sent
+void sendAPISettings(AsyncWebServerRequest *request)
+{
+  mySettings Settings; // The copy taken by loop() is used in place of the settings
+  uint32_t Version;
+  portENTER_CRITICAL(&apiSnapshotMux);
+  Settings = apiSettings;
+  Version = apiSettingsVersion;
+  portEXIT_CRITICAL(&apiSnapshotMux);
+
+  char ETag[API_ETAG_SIZE];
+  snprintf(ETag, sizeof(ETag), "\"%08x-c%u\"", (unsigned)etagSalt, (unsigned)Version);
+  if (sendAPINotModified(request, ETag))
+    return;
+
+  StaticJsonDocument<API_SETTINGS_SIZE> Doc;
+  JsonObject Volume = Doc.createNestedObject("Volume");
+  Volume["VolumeSteps"] = Settings.VolumeSteps;
+  Volume["MinAttenuation"] = Settings.MinAttenuation;
+  Volume["MaxAttenuation"] = Settings.MaxAttenuation;
+  Volume["MaxStartVolume"] = Settings.MaxStartVolume;
+  Volume["MuteLevel"] = Settings.MuteLevel;
+  Volume["RecallSetLevel"] = Settings.RecallSetLevel;
+  Volume["KeyRepeatRate"] = Settings.KeyRepeatRate;
+
+  JsonArray Inputs = Doc.createNestedArray("Inputs");
+  for (byte i = 0; i < 6; i++)
+  {
+    JsonObject Input = Inputs.createNestedObject();
+    Input["Active"] = Settings.Input[i].Active;
+    Input["Name"] = (const char *)Settings.Input[i].Name;
+    Input["MaxVol"] = Settings.Input[i].MaxVol;
+    Input["MinVol"] = Settings.Input[i].MinVol;
+  }
+
+  JsonObject Triggers = Doc.createNestedObject("Triggers");
+  Triggers["ExtPowerRelayTrigger"] = Settings.ExtPowerRelayTrigger;
+  Triggers["Trigger1Active"] = Settings.Trigger1Active;
+  Triggers["Trigger1Type"] = Settings.Trigger1Type;
+  Triggers["Trigger1OnDelay"] = Settings.Trigger1OnDelay;
+  Triggers["Trigger1Temp"] = Settings.Trigger1Temp;
+  Triggers["Trigger2Active"] = Settings.Trigger2Active;
+  Triggers["Trigger2Type"] = Settings.Trigger2Type;
+  Triggers["Trigger2OnDelay"] = Settings.Trigger2OnDelay;
+  Triggers["Trigger2Temp"] = Settings.Trigger2Temp;
+  Triggers["TriggerInactOffTimer"] = Settings.TriggerInactOffTimer;
+
+  JsonObject Display = Doc.createNestedObject("Display");
+  Display["ScreenSaverActive"] = Settings.ScreenSaverActive;
+  Display["DisplayOnLevel"] = Settings.DisplayOnLevel;
+  Display["DisplayDimLevel"] = Settings.DisplayDimLevel;
+  Display["DisplayTimeout"] = Settings.DisplayTimeout;
+  Display["DisplayVolume"] = Settings.DisplayVolume;
+  Display["DisplaySelectedInput"] = Settings.DisplaySelectedInput;
+  Display["DisplayTemperature1"] = Settings.DisplayTemperature1;
+  Display["DisplayTemperature2"] = Settings.DisplayTemperature2;
+
+  JsonObject IR = Doc.createNestedObject("IR");
+  for (byte i = 0; i < sizeof(IRKeys) / sizeof(IRKeys[0]); i++)
+  {
+    // The codes of IRKeys are in the global Settings - take the same field of the copy
+    const IRMP_DATA *Value = (const IRMP_DATA *)((const byte *)&Settings + ((const byte *)IRKeys[i].Code - (const byte *)&::Settings));
+    JsonObject Code = IR.createNestedObject(IRKeys[i].Name);
+    Code["Protocol"] = Value->protocol;
+    Code["Address"] = Value->address;
+    Code["Command"] = Value->command;
+  }
+
+  JsonObject WiFi = Doc.createNestedObject("WiFi");
+  WiFi["SSID"] = (const char *)Settings.ssid;
+  WiFi["IP"] = (const char *)Settings.ip;
+  WiFi["Gateway"] = (const char *)Settings.gateway;
+
+  Doc["ADC_Calibration"] = Settings.ADC_Calibration;
+  sendAPIJSON(request, Doc, ETag);
+}
+
+// Read the settings present in the JSON of PUT /api/settings into New - returns the name of the first invalid setting or NULL
+// The groups IR, WiFi and ADC_Calibration are read-only and ignored, so what GET /api/settings returns can be sent back changed
+const char *readAPISettings(JsonObjectConst Root, mySettings &New)
+{
+  JsonObjectConst Volume = Root["Volume"].as<JsonObjectConst>();
+  if (!readAPIValue(Volume, "VolumeSteps", New.VolumeSteps, 1, 179))
+    return "VolumeSteps";
+  if (!readAPIValue(Volume, "MinAttenuation", New.MinAttenuation, 0, 90))
+    return "MinAttenuation";
+  if (!readAPIValue(Volume, "MaxAttenuation", New.MaxAttenuation, 1, 90))
+    return "MaxAttenuation";
+  if (!readAPIValue(Volume, "MaxStartVolume", New.MaxStartVolume, 0, 179))
+    return "MaxStartVolume";
+  if (!readAPIValue(Volume, "MuteLevel", New.MuteLevel, 0, 179))
+    return "MuteLevel";
+  if (!readAPIValue(Volume, "RecallSetLevel", New.RecallSetLevel, 0, 1))
+    return "RecallSetLevel";
+  if (!readAPIValue(Volume, "KeyRepeatRate", New.KeyRepeatRate, 1, KEY_REPEAT_MAX_RATE))
+    return "KeyRepeatRate";
+
+  JsonArrayConst Inputs = Root["Inputs"].as<JsonArrayConst>();
+  if (Inputs.size() > 6)
+    return "Inputs";
+  for (byte i = 0; i < Inputs.size(); i++)
+  {
+    JsonObjectConst Input = Inputs[i].as<JsonObjectConst>();
+    const char *Name = Input["Name"].as<const char *>();
+    if (!readAPIValue(Input, "Active", New.Input[i].Active, INPUT_HT_PASSTHROUGH, INPUT_INACTIVATED) ||
+        !readAPIValue(Input, "MaxVol", New.Input[i].MaxVol, 0, 179) ||
+        !readAPIValue(Input, "MinVol", New.Input[i].MinVol, 0, 179))
+      return "Inputs";
+    if (!Input["Name"].isNull())
+    {
+      if (Name == NULL || strlen(Name) > sizeof(New.Input[i].Name) - 1 || !isValidInputName(Name))
+        return "Name";
+      snprintf(New.Input[i].Name, sizeof(New.Input[i].Name), "%-10s", Name); // Padded with spaces as the names edited in the menu
+    }
+  }
+
+  JsonObjectConst Triggers = Root["Triggers"].as<JsonObjectConst>();
+  byte ExtPowerRelayTrigger = New.ExtPowerRelayTrigger;
+  if (!readAPIValue(Triggers, "ExtPowerRelayTrigger", ExtPowerRelayTrigger, 0, 1))
+    return "ExtPowerRelayTrigger";
+  New.ExtPowerRelayTrigger = ExtPowerRelayTrigger;
+  if (!readAPIValue(Triggers, "Trigger1Active", New.Trigger1Active, 0, 1))
+    return "Trigger1Active";
+  if (!readAPIValue(Triggers, "Trigger1Type", New.Trigger1Type, 0, 1))
+    return "Trigger1Type";
+  if (!readAPIValue(Triggers, "Trigger1OnDelay", New.Trigger1OnDelay, 0, 90))
+    return "Trigger1OnDelay";
+  if (!readAPIValue(Triggers, "Trigger1Temp", New.Trigger1Temp, 0, 90))
+    return "Trigger1Temp";
+  if (!readAPIValue(Triggers, "Trigger2Active", New.Trigger2Active, 0, 1))
+    return "Trigger2Active";
+  if (!readAPIValue(Triggers, "Trigger2Type", New.Trigger2Type, 0, 1))
+    return "Trigger2Type";
+  if (!readAPIValue(Triggers, "Trigger2OnDelay", New.Trigger2OnDelay, 0, 90))
+    return "Trigger2OnDelay";
+  if (!readAPIValue(Triggers, "Trigger2Temp", New.Trigger2Temp, 0, 90))
+    return "Trigger2Temp";
+  if (!readAPIValue(Triggers, "TriggerInactOffTimer", New.TriggerInactOffTimer, 0, 24))
+    return "TriggerInactOffTimer";
+
+  JsonObjectConst Display = Root["Display"].as<JsonObjectConst>();
+  if (!readAPIValue(Display, "ScreenSaverActive", New.ScreenSaverActive, 0, 1))
+    return "ScreenSaverActive";
+  if (!readAPIValue(Display, "DisplayOnLevel", New.DisplayOnLevel, 0, 3))
+    return "DisplayOnLevel";
+  if (!readAPIValue(Display, "DisplayDimLevel", New.DisplayDimLevel, 0, 32))
+    return "DisplayDimLevel";
+  if (!readAPIValue(Display, "DisplayTimeout", New.DisplayTimeout, 0, 90))
+    return "DisplayTimeout";
+  if (!readAPIValue(Display, "DisplayVolume", New.DisplayVolume, 0, 2))
+    return "DisplayVolume";
+  if (!readAPIValue(Display, "DisplaySelectedInput", New.DisplaySelectedInput, 0, 1))
+    return "DisplaySelectedInput";
+  if (!readAPIValue(Display, "DisplayTemperature1", New.DisplayTemperature1, 0, 3))
+    return "DisplayTemperature1";
+  if (!readAPIValue(Display, "DisplayTemperature2", New.DisplayTemperature2, 0, 3))
+    return "DisplayTemperature2";
+  return NULL;
+}
+
+// Check the settings depending on each other (the menu enforces the same when they are edited) - returns the name of the first invalid setting or NULL
+const char *validateSettings(const mySettings &New)
+{
+  bool InputActive = false;
+  if (New.MinAttenuation >= New.MaxAttenuation)
+    return "MinAttenuation";
+  if (New.MaxStartVolume > New.VolumeSteps)
+    return "MaxStartVolume";
+  if (New.MuteLevel > New.VolumeSteps)
+    return "MuteLevel";
+  for (byte i = 0; i < 6; i++)
+  {
+    if (New.Input[i].MaxVol > New.VolumeSteps)
+      return "MaxVol";
+    if (New.Input[i].MinVol > New.Input[i].MaxVol)
+      return "MinVol";
+    if (New.Input[i].Active != INPUT_INACTIVATED)
+      InputActive = true;
+  }
+  if (!InputActive)
+    return "Active";
+  return NULL;
+}
+
+// PUT /api/settings - only the settings present are changed (on top of a change not applied yet)
+void updateAPISettings(AsyncWebServerRequest *request)
+{
+  StaticJsonDocument<API_SETTINGS_SIZE> Doc;
+  if (!parseAPIBody(request, Doc))
+    return;
+  mySettings New;
+  portENTER_CRITICAL(&apiSnapshotMux);
+  New = apiSettings;
+  portEXIT_CRITICAL(&apiSnapshotMux);
+  portENTER_CRITICAL(&pendingSettingsMux);
+  if (settingsPending)
+    New = pendingSettings;
+  portEXIT_CRITICAL(&pendingSettingsMux);
+  const char *Error = readAPISettings(Doc.as<JsonObjectConst>(), New);
+  if (Error == NULL)
+    Error = validateSettings(New);
+  if (Error != NULL)
+    return sendAPIError(request, 400, Error);
+
+  portENTER_CRITICAL(&pendingSettingsMux);
+  pendingSettings = New;
+  settingsPending = true;
+  portEXIT_CRITICAL(&pendingSettingsMux);
+  request->send(202, "application/json", "{}");
+}
+
+void onEvent(AsyncWebSocket *server, AsyncWebSocketClient *client, AwsEventType type, void *arg, uint8_t *data, size_t len)
+{
+  switch (type)
+  {
+  case WS_EVT_CONNECT:
+    Serial.printf("WebSocket client #%u connected from %s\n", client->id(), client->remoteIP().toString().c_str());
+    break;
+  case WS_EVT_DISCONNECT:
+    Serial.printf("WebSocket client #%u disconnected\n", client->id());
+    removeBinaryClient(client->id());
+    break;
+  case WS_EVT_DATA:
+    if (((AwsFrameInfo *)arg)->opcode == WS_BINARY)
+      handleBinaryMessage(client, arg, data, len);
     else
-      return ("MUTED");
+      handleWebSocketMessage(arg, data, len);
+    break;
+  case WS_EVT_PONG:
+  case WS_EVT_ERROR:
+    break;
   }
-  if (var == "TEMP1")
+}
+
+void initWebSocket()
+{
+  ws.onEvent(onEvent);
+  server.addHandler(&ws);
+  eventsLastId = esp_random();
+  events.onConnect(onEventsConnect);
+  server.addHandler(&events);
+}
+
+// Search for parameter in HTTP POST request - used for wifi configuration page
+const char *PARAM_INPUT_1 = "ssid";
+const char *PARAM_INPUT_2 = "pass";
+const char *PARAM_INPUT_3 = "ip";
+const char *PARAM_INPUT_4 = "gateway";
+
+IPAddress localIP;
+// IPAddress localIP(192, 168, 1, 200); // hardcoded
+
+// Set your Gateway IP address
+IPAddress localGateway;
+// IPAddress localGateway(192, 168, 1, 1); //hardcoded
+IPAddress subnet(255, 255, 0, 0);
+
+// Timer variables
+unsigned long previousMillis = 0;
+const long interval = 10000; // interval to wait for Wi-Fi connection (milliseconds)
+
+// Initialize LittleFS
+void initLittleFS()
+{
+  if (!LittleFS.begin(true))
   {
-    return String(getTemperature(NTC1_PIN));
+    debugln("An error has occurred while mounting LittleFS");
   }
-  if (var == "TEMP2")
+  debugln("LittleFS mounted successfully");
+}
+
+// Read File from the file system
+String readFile(fs::FS &fs, const char *path)
+{
+  Serial.printf("Reading file: %s\r\n", path);
+
+  File file = fs.open(path);
+  if (!file || file.isDirectory())
+  {
+    debugln("- failed to open file for reading");
+    return String();
+  }
+
+  String fileContent;
+  while (file.available())
+  {
+    fileContent = file.readStringUntil('\n');
+    break;
+  }
+  return fileContent;
+}
+
+// Write file to the file system
+void writeFile(fs::FS &fs, const char *path, const char *message)
+{
+  Serial.printf("Writing file: %s\r\n", path);
+
+  File file = fs.open(path, FILE_WRITE);
+  if (!file)
   {
-    return String(getTemperature(NTC2_PIN));
+    debugln("- failed to open file for writing");
+    return;
+  }
+  if (file.print(message))
+  {
+    debugln("- file written");
+  }
+  else
+  {
+    debugln("- write failed");
+  }
+}
+
+// Initialize WiFi
+bool initWiFi()
+{
+  if (Settings.ssid == "" || Settings.ip == "")
+  {
+    debugln("Undefined SSID or IP address.");
+    return false;
   }
+
+  WiFi.mode(WIFI_STA);
+  localIP.fromString(Settings.ip);
+  localGateway.fromString(Settings.gateway);
+
+  if (!WiFi.config(localIP, localGateway, subnet))
+  {
+    debugln("STA Failed to configure");
+    return false;
+  }
+  WiFi.begin(Settings.ssid, Settings.pass);
+  debugln("Connecting to WiFi...");
+
+  unsigned long currentMillis = millis();
+  previousMillis = currentMillis;
+
+  while (WiFi.status() != WL_CONNECTED)
+  {
+    currentMillis = millis();
+    if (currentMillis - previousMillis >= interval)
+    {
+      debugln("Failed to connect.");
+      return false;
+    }
+  }
+
+  debugln(WiFi.localIP());
+  return true;
+}
+
+// Send the temperature history as CSV - the resolution is selected by the parameter "res": s = seconds (default), m = minutes or h = hours
+// The rows are written directly into the buffers of the response as they are sent, so no String holding the whole history is needed
+// The first column is the number of seconds since the controller was powered on at the end of the period of the row
+void sendTemperatureHistory(AsyncWebServerRequest *request)
+{
+  char Resolution = 's';
+  if (request->hasParam("res"))
+    Resolution = request->getParam("res")->value().charAt(0);
+  if (Resolution != 'm' && Resolution != 'h')
+    Resolution = 's';
+
+  // Absolute index in the ring buffer of the next row to send - the header is sent while the index is UINT32_MAX
+  std::shared_ptr<uint32_t> Cursor = std::make_shared<uint32_t>(UINT32_MAX);
+
+  AsyncWebServerResponse *response = request->beginChunkedResponse("text/csv", [Resolution, Cursor](uint8_t *buffer, size_t maxLen, size_t index) -> size_t
+                                                                   {
+    const size_t MaxRowLength = 64;
+    size_t Length = 0;
+
+    if (*Cursor == UINT32_MAX)
+    {
+      if (maxLen < MaxRowLength)
+        return RESPONSE_TRY_AGAIN;
+      if (Resolution == 's')
+        Length = snprintf((char *)buffer, maxLen, "Seconds,Temp1,Temp2\n");
+      else
+        Length = snprintf((char *)buffer, maxLen, "Seconds,Temp1Min,Temp1Max,Temp1Avg,Temp2Min,Temp2Max,Temp2Avg\n");
+      portENTER_CRITICAL(&temperatureHistoryMux);
+      *Cursor = (Resolution == 's') ? temperatureHistory.seconds.first() : (Resolution == 'm') ? temperatureHistory.minutes.first() : temperatureHistory.hours.first();
+      portEXIT_CRITICAL(&temperatureHistoryMux);
+    }
+
+    while (maxLen - Length >= MaxRowLength)
+    {
+      bool Found;
+      char *Row = (char *)buffer + Length;
+      if (Resolution == 's')
+      {
+        TemperatureSample Sample;
+        portENTER_CRITICAL(&temperatureHistoryMux);
+        if (*Cursor < temperatureHistory.seconds.first())
+          *Cursor = temperatureHistory.seconds.first(); // Rows overwritten while sending are skipped
+        Found = temperatureHistory.seconds.get(*Cursor, Sample);
+        portEXIT_CRITICAL(&temperatureHistoryMux);
+        if (!Found)
+          break;
+        Length += snprintf(Row, MaxRowLength, "%lu,%.1f,%.1f\n", (unsigned long)(*Cursor + 1), Sample.Temp[0] / 10.0, Sample.Temp[1] / 10.0);
+      }
+      else
+      {
+        TemperatureAggregate Aggregate;
+        uint32_t Period = (Resolution == 'm') ? 60 : 3600;
+        portENTER_CRITICAL(&temperatureHistoryMux);
+        if (Resolution == 'm')
+        {
+          if (*Cursor < temperatureHistory.minutes.first())
+            *Cursor = temperatureHistory.minutes.first();
+          Found = temperatureHistory.minutes.get(*Cursor, Aggregate);
+        }
+        else
+        {
+          if (*Cursor < temperatureHistory.hours.first())
+            *Cursor = temperatureHistory.hours.first();
+          Found = temperatureHistory.hours.get(*Cursor, Aggregate);
+        }
+        portEXIT_CRITICAL(&temperatureHistoryMux);
+        if (!Found)
+          break;
+        Length += snprintf(Row, MaxRowLength, "%lu,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f\n", (unsigned long)((*Cursor + 1) * Period),
+                           Aggregate.Min[0] / 10.0, Aggregate.Max[0] / 10.0, Aggregate.Avg[0] / 10.0,
+                           Aggregate.Min[1] / 10.0, Aggregate.Max[1] / 10.0, Aggregate.Avg[1] / 10.0);
+      }
+      (*Cursor)++;
+    }
+    return Length; });
+  request->send(response);
+}
+
+// Replaces the placeholders of index.html with the state in pageState
+String processor(const String &var)
+{
+  PageState State;
+  portENTER_CRITICAL(&pageStateMux);
+  State = pageState;
+  portEXIT_CRITICAL(&pageStateMux);
+  if (var == "STATE")
+    return State.OnState;
+  if (var == "SELECTEDINPUT")
+    return State.Input;
+  if (var == "VOLUME")
+    return State.Volume;
+  if (var == "VOLUMESTEPS")
+    return State.VolumeSteps;
+  if (var == "VOLUME_DB")
+    return State.Volume_dB;
+  if (var == "TEMP1")
+    return State.Temp1;
+  if (var == "TEMP2")
+    return State.Temp2;
   // Unknown parameter
-  return ("n/a)");
+  return ("n/a");
 }
 
 void setupWIFIsupport()
 {
-  initSPIFFS();
+  initLittleFS();
+  // The web handlers of both the station and the access point mode queue their commands for loop()
+  controlQueue = xQueueCreate(CONTROL_QUEUE_LENGTH, sizeof(ControlCommand));
 
   if (initWiFi())
   {
     initWebSocket();
 
-    // Web Server Root URL
+    // Web Server Root URL - the page is sent with the current state filled in, so it shows it before the WebSocket is connected
+    updatePageState(STATE_ALL);
+    updateAPISnapshots();
     server.on("/", HTTP_GET, [](AsyncWebServerRequest *request)
-              { request->send(SPIFFS, "/index.html", "text/html"); });
+              { request->send(LittleFS, "/index.html", "text/html", false, processor); });
     
     // Web : InputSelector
     server.on("/INPUT1", HTTP_GET, [](AsyncWebServerRequest *request)
-              { request->send(200, "text/plain", String(setInput(1)));});
+              { handleInputRequest(request, 1); });
 
     server.on("/INPUT2", HTTP_GET, [](AsyncWebServerRequest *request)
-              { request->send(200, "text/plain", String(setInput(2)));});
+              { handleInputRequest(request, 2); });
 
     server.on("/INPUT3", HTTP_GET, [](AsyncWebServerRequest *request)
-              { request->send(200, "text/plain", String(setInput(3)));});
+              { handleInputRequest(request, 3); });
 
     server.on("/INPUT4", HTTP_GET, [](AsyncWebServerRequest *request)
-              { request->send(200, "text/plain", String(setInput(4)));});
+              { handleInputRequest(request, 4); });
 
     server.on("/INPUT5", HTTP_GET, [](AsyncWebServerRequest *request)
-              { request->send(200, "text/plain", String(setInput(5)));});
+              { handleInputRequest(request, 5); });
 
     server.on("/INPUT6", HTTP_GET, [](AsyncWebServerRequest *request)
-              { request->send(200, "text/plain", String(setInput(6)));});
+              { handleInputRequest(request, 6); });
         
 
-    server.serveStatic("/", SPIFFS, "/");
+    // Web : Temperature history as CSV
+    server.on("/history.csv", HTTP_GET, sendTemperatureHistory);
+
+    // Web : REST API
+    etagSalt = esp_random();
+    server.on("/api/state", HTTP_GET, sendAPIState);
+    server.on("/api/state", HTTP_PUT, updateAPIState, NULL, receiveAPIBody);
+    server.on("/api/settings", HTTP_GET, sendAPISettings);
+    server.on("/api/settings", HTTP_PUT, updateAPISettings, NULL, receiveAPIBody);
+
+    server.serveStatic("/static/", LittleFS, "/static/").setCacheControl(STATIC_CACHE_CONTROL);
 
     AsyncElegantOTA.begin(&server);
     server.begin();
@@ -877,61 +2288,51 @@ void setupWIFIsupport()
 
     // Web Server Root URL
     server.on("/", HTTP_GET, [](AsyncWebServerRequest *request)
-              { request->send(SPIFFS, "/wifi.html", "text/html"); });
+              { request->send(LittleFS, "/wifi.html", "text/html"); });
 
-    server.serveStatic("/", SPIFFS, "/");
+    server.serveStatic("/static/", LittleFS, "/static/").setCacheControl(STATIC_CACHE_CONTROL);
 
+    // The settings are saved by loop() (see applyWiFiSettings), which restarts afterwards
     server.on("/", HTTP_POST, [](AsyncWebServerRequest *request)
               {
+      WiFiSettings New;
+      memset(&New, 0, sizeof(New));
       int params = request->params();
       for(int i=0;i<params;i++){
         AsyncWebParameter* p = request->getParam(i);
         if(p->isPost()){
           // HTTP POST ssid value
           if (p->name() == PARAM_INPUT_1) {
-            strcpy(Settings.ssid, p->value().c_str()); /* String copy*/
-            debug("SSID set to: ");
-            debugln(Settings.ssid);
-            // Write file to save value
-            //writeFile(SPIFFS, ssidPath, ssid.c_str());
+            strlcpy(New.ssid, p->value().c_str(), sizeof(New.ssid));
+            New.Fields |= WIFI_SSID;
           }
           // HTTP POST pass value
           if (p->name() == PARAM_INPUT_2) {
-            strcpy(Settings.pass, p->value().c_str()); /* String copy */
-            debug("Password set to: ");
-            debugln(Settings.pass);
-            // Write file to save value
-            // writeFile(SPIFFS, passPath, pass.c_str());
+            strlcpy(New.pass, p->value().c_str(), sizeof(New.pass));
+            New.Fields |= WIFI_PASS;
           }
           // HTTP POST ip value
           if (p->name() == PARAM_INPUT_3) {
-            strcpy(Settings.ip, p->value().c_str()); /* String copy*/
-            debug("IP Address set to: ");
-            debugln(Settings.ip);
-            // Write file to save value
-            //writeFile(SPIFFS, ipPath, ip.c_str());
+            strlcpy(New.ip, p->value().c_str(), sizeof(New.ip));
+            New.Fields |= WIFI_IP;
           }
           // HTTP POST gateway value
           if (p->name() == PARAM_INPUT_4) {
-            strcpy(Settings.gateway, p->value().c_str()); /* String copy */
-            debug("Gateway set to: ");
-            debugln(Settings.gateway);
-            // Write file to save value
-            //writeFile(SPIFFS, gatewayPath, gateway.c_str());
+            strlcpy(New.gateway, p->value().c_str(), sizeof(New.gateway));
+            New.Fields |= WIFI_GATEWAY;
           }
-          //Serial.printf("POST[%s]: %s\n", p->name().c_str(), p->value().c_str());
         }
       }
 
-      writeSettingsToEEPROM();
-      request->send(200, "text/plain", "Done. ESP will restart, connect to your router and go to IP address: " + String(Settings.ip));
-      oled.clear();
-      oled.setCursor(0, 1);
-      oled.print(F("Wifi is configured"));
-      oled.setCursor(0, 3);
-      oled.print(F("Restarting..."));
-      delay(3000);
-      ESP.restart(); });
+      portENTER_CRITICAL(&pendingWiFiMux);
+      pendingWiFi = New;
+      portEXIT_CRITICAL(&pendingWiFiMux);
+      if (!postControlCommand(CTL_SET_WIFI, 0))
+      {
+        request->send(503, "text/plain", "Busy - please try again");
+        return;
+      }
+      request->send(200, "text/plain", "Done. ESP will restart, connect to your router and go to IP address: " + String(New.ip)); });
     AsyncElegantOTA.begin(&server);
     server.begin();
   }
@@ -951,6 +2352,7 @@ void setup()
 
   pinMode(NTC1_PIN, INPUT);
   pinMode(NTC2_PIN, INPUT);
+  initADC();
 
   relayController.begin();
   // Define all pins as OUTPUT and disable all relais
@@ -966,14 +2368,16 @@ void setup()
   oled.backlight((Settings.DisplayOnLevel + 1) * 64 - 1);
 
   // Start IR reader
-  irmp_init();
+  setupIRReceiver();
 
-  // Read setting from EEPROM
-  readSettingsFromEEPROM();
-  readRuntimeSettingsFromEEPROM();
+  // Read setting from EEPROM - the runtime settings and IR bindings must be read first, as migrating settings from the legacy layout overwrites where they were stored
+  setupEEPROM();
+  bool RuntimeSettingsValid = readRuntimeSettingsFromEEPROM();
+  bool IRBindingsValid = readIRBindingsFromEEPROM();
+  bool SettingsValid = readSettingsFromEEPROM();
 
-  // Check if settings stored in EEPROM are INVALID - if so, we write the default settings to the EEPROM and reboots
-  if ((Settings.Version != (float)VERSION) || (RuntimeSettings.Version != (float)VERSION))
+  // Use default values for the parts of the settings stored in EEPROM that are INVALID (never written, corrupted or written by a newer firmware)
+  if (!SettingsValid)
   {
     oled.clear();
     oled.setCursor(0, 1);
@@ -981,8 +2385,28 @@ void setup()
     oled.setCursor(0, 2);
     oled.print(F("settings..."));
     delay(2000);
-    writeDefaultSettingsToEEPROM();
+    setSettingsToDefault();
+    markSettingsDirty();
   }
+  if (!RuntimeSettingsValid)
+  {
+    setRuntimeSettingsToDefault();
+    markRuntimeSettingsDirty();
+  }
+  // Additional IR bindings are not part of the default settings - just start without any if they are not valid
+  if (!IRBindingsValid)
+  {
+    IRBindings.Count = 0;
+    IRBindings.Version = VERSION;
+    memset(&IRBindings.IR_PROFILE, 0, sizeof(IRBindings.IR_PROFILE));
+    markIRBindingsDirty();
+  }
+  setupProfiles();
+
+  setupPowerFailDetection();
+
+  // Start measuring temperatures (Settings.ADC_Calibration must be valid before this)
+  setupTemperatureSampling();
 
   // Connect to Wifi
   oled.clear();
@@ -998,9 +2422,21 @@ void setup()
 
 void startUp()
 {
+  buildIRKeyMap();
   oled.lcdOn();
   oled.clear();
 
+  // Do not start if the temperature protection has tripped and the temperature has not yet fallen enough
+  if (!resetThermalProtection())
+  {
+    oled.setCursor(0, 1);
+    oled.print(F("Too hot to start!"));
+    markStateDirty(STATE_TEMPERATURES);
+    delay(3000);
+    oled.lcdOff();
+    return;
+  }
+
   // Turn on Mezmerize B1 Buffer via power on/off relay
   if (Settings.ExtPowerRelayTrigger)
   {
@@ -1022,6 +2458,14 @@ void startUp()
 
   while (delayTrigger1 || delayTrigger2)
   {
+    if (getThermalState(NTC1_PIN) == ThermalProtection::TRIPPED || getThermalState(NTC2_PIN) == ThermalProtection::TRIPPED)
+    {
+      // The temperature protection has tripped while waiting - turn off again (checkThermalProtection only acts when not in standby)
+      debugln("Temperature protection tripped during start up");
+      toStandbyMode();
+      return;
+    }
+
     if (millis() > delayTrigger1 && delayTrigger1 != 0)
     {
       setTrigger1On();
@@ -1057,8 +2501,9 @@ void startUp()
 
   UIkey = KEY_NONE;
   lastReceivedInput = KEY_NONE;
+  stopKeyRepeat();
 
-  notifyClients(getJSONOnStandbyState());
+  markStateDirty(STATE_ON_STANDBY);
   
   debugln("Ready!");
 }
@@ -1210,7 +2655,67 @@ void setVolume(int16_t newVolumeStep)
     if (appMode == APP_NORMAL_MODE)
       displayVolume();
   }
-  notifyClients(getJSONCurrentVolume());
+  markStateDirty(STATE_VOLUME);
+}
+
+// State of the volume ramp
+int8_t volRampDirection = 0;         // 1 = volume up, -1 = volume down, 0 = no ramp active
+unsigned long mil_VolRampStart = 0;  // Time of the first key of the current ramp
+unsigned long mil_VolRampLast = 0;   // Time of the latest key of the current ramp
+float volRampPending_dB = 0;         // dB accumulated by the ramp but not yet large enough to make a whole volume step
+
+// Change the volume one or more steps in the specified direction (1 = up, -1 = down)
+// A single key press (or a slow turn of the encoder) changes the volume by exactly one step. When keys keep coming within VOLUME_RAMP_TIMEOUT
+// the time since the previous key is converted to dB by a rate that accelerates from VOLUME_RAMP_START_RATE to VOLUME_RAMP_MAX_RATE.
+// As the size of the steps differs (see getAttenuation) the number of steps is found by accumulating the dB of each step - this makes
+// the time it takes to go from e.g. -60 dB to -20 dB the same no matter how many steps are configured.
+void changeVolume(int8_t Direction)
+{
+  unsigned long Now = mil_LastInputEvent; // Use the time of the key (for IR the time the frame was received) so a busy main loop doesn't affect the rate
+
+  if (Direction != volRampDirection || Now - mil_VolRampLast > VOLUME_RAMP_TIMEOUT)
+  {
+    // Start a new ramp
+    volRampDirection = Direction;
+    mil_VolRampStart = Now;
+    mil_VolRampLast = Now;
+    volRampPending_dB = 0;
+    setVolume(RuntimeSettings.CurrentVolume + Direction);
+    return;
+  }
+
+  // Calculate the current rate of the ramp and add the dB for the time passed since the previous key
+  unsigned long RampTime = Now - mil_VolRampStart;
+  float Rate = VOLUME_RAMP_MAX_RATE;
+  if (RampTime < VOLUME_RAMP_ACCEL_TIME)
+    Rate = VOLUME_RAMP_START_RATE + (float)(VOLUME_RAMP_MAX_RATE - VOLUME_RAMP_START_RATE) * RampTime / VOLUME_RAMP_ACCEL_TIME;
+  volRampPending_dB += Rate * (Now - mil_VolRampLast) / 1000;
+  mil_VolRampLast = Now;
+
+  // Convert the accumulated dB to whole steps - always move at least one step per key
+  int16_t NewVolume = RuntimeSettings.CurrentVolume;
+  int16_t Attenuation = getAttenuation(Settings.VolumeSteps, NewVolume, Settings.MinAttenuation, Settings.MaxAttenuation);
+  while ((Direction > 0 && NewVolume < Settings.Input[RuntimeSettings.CurrentInput].MaxVol) || (Direction < 0 && NewVolume > Settings.Input[RuntimeSettings.CurrentInput].MinVol))
+  {
+    int16_t NextAttenuation = getAttenuation(Settings.VolumeSteps, NewVolume + Direction, Settings.MinAttenuation, Settings.MaxAttenuation);
+    float StepSize_dB = abs(NextAttenuation - Attenuation) / 2.0; // Attenuation is in 0.5 dB steps
+    if (NewVolume != RuntimeSettings.CurrentVolume && volRampPending_dB < StepSize_dB)
+      break;
+    volRampPending_dB = (volRampPending_dB > StepSize_dB) ? volRampPending_dB - StepSize_dB : 0;
+    NewVolume += Direction;
+    Attenuation = NextAttenuation;
+  }
+
+  if (NewVolume != RuntimeSettings.CurrentVolume)
+    setVolume(NewVolume);
+  else
+    volRampPending_dB = 0; // The limit of the input is reached
+}
+
+// End the current volume ramp - the next volume key will change the volume by exactly one step
+void endVolumeRamp()
+{
+  volRampDirection = 0;
 }
 
 void mute()
@@ -1273,10 +2778,16 @@ void displayMute()
   }
 }
 
+// True if the input (0 - 5) is active and can be selected now
+bool isInputSelectable(uint8_t Input)
+{
+  return Input <= 5 && Settings.Input[Input].Active != INPUT_INACTIVATED && appMode == APP_NORMAL_MODE;
+}
+
 boolean setInput(uint8_t NewInput)
 {
   boolean result = false;
-  if (Settings.Input[NewInput].Active != INPUT_INACTIVATED && NewInput >= 0 && NewInput <= 5 && appMode == APP_NORMAL_MODE)
+  if (isInputSelectable(NewInput))
   {
     if (!RuntimeSettings.Muted)
       mute();
@@ -1305,7 +2816,7 @@ boolean setInput(uint8_t NewInput)
     result = true;
   }
 
-  notifyClients(getJSONCurrentInput());
+  markStateDirty(STATE_INPUT);
   return result;
 }
 
@@ -1361,7 +2872,7 @@ void displayTemperatures()
         MaxTemp = 60; // TO DO: Is this the best default value?
       else
         MaxTemp = Settings.Trigger1Temp;
-      displayTempDetails(Temp, MaxTemp, Settings.DisplayTemperature1, 1);
+      displayTempDetails(Temp, MaxTemp, Settings.DisplayTemperature1, 1, getThermalState(NTC1_PIN) == ThermalProtection::WARNING);
     }
 
     if (Settings.DisplayTemperature2)
@@ -1373,15 +2884,16 @@ void displayTemperatures()
       else
         MaxTemp = Settings.Trigger2Temp;
       if (Settings.DisplayTemperature1)
-        displayTempDetails(Temp, MaxTemp, Settings.DisplayTemperature1, 2);
+        displayTempDetails(Temp, MaxTemp, Settings.DisplayTemperature1, 2, getThermalState(NTC2_PIN) == ThermalProtection::WARNING);
       else
-        displayTempDetails(Temp, MaxTemp, Settings.DisplayTemperature1, 1);
+        displayTempDetails(Temp, MaxTemp, Settings.DisplayTemperature1, 1, getThermalState(NTC2_PIN) == ThermalProtection::WARNING);
     }
   }
   mil_onRefreshTemperatureDisplay = millis();
 }
 
-void displayTempDetails(float Temp, uint8_t TriggerTemp, uint8_t DispTemp, uint8_t FirstOrSecond)
+// Warning is true if the temperature is close to TriggerTemp - shown with a ! after the temperature
+void displayTempDetails(float Temp, uint8_t TriggerTemp, uint8_t DispTemp, uint8_t FirstOrSecond, bool Warning)
 {
   byte Col;
   if (FirstOrSecond == 1)
@@ -1415,7 +2927,7 @@ void displayTempDetails(float Temp, uint8_t TriggerTemp, uint8_t DispTemp, uint8
       oled.setCursor(Col, 3);
       oled.print(int(Temp));
       oled.write(128); // Degree symbol
-      oled.print(" ");
+      oled.print(Warning ? "!" : " ");
     }
     if (DispTemp == 2 || DispTemp == 3)
     {
@@ -1450,64 +2962,371 @@ void displayTempDetails(float Temp, uint8_t TriggerTemp, uint8_t DispTemp, uint8
   }
 }
 
-// Read analog with improved accuracy - see https://github.com/G6EJD/ESP32-ADC-Accuracy-Improvement/blob/main/ESP32_ADC_Read_Voltage_Accuracy_V2.ino
-float readVoltage(byte ADC_Pin)
+// ADC characteristics of this ESP32 - read from eFuse once at startup by initADC() as they never change
+esp_adc_cal_characteristics_t adc_chars;
+float adcVrefCorrection = 1; // 1100 / the device ADC reference voltage in mV (1100 mV is the reference voltage of the ESP32 by design)
+
+void initADC()
 {
-  float vref = 1100;
-  esp_adc_cal_characteristics_t adc_chars;
   esp_adc_cal_characterize(ADC_UNIT_1, ADC_ATTEN_DB_11, ADC_WIDTH_BIT_12, 1100, &adc_chars);
-  vref = adc_chars.vref;                                                                  // Obtain the device ADC reference voltage
-  return (analogRead(ADC_Pin) / 4095.0) * 3.3 * (1100 / vref) * Settings.ADC_Calibration; // ESP by design reference voltage in mV
+  adcVrefCorrection = 1100.0 / adc_chars.vref;
+}
+
+// Conversion of ADC readings to temperatures ------------------------------------------------------------
+// The temperatures are looked up in ntcTable (see NTCTable.h), which is calculated once at startup from the NTC_xxx values. The ADC codes
+// used for the lookup are corrected for the reference voltage and Settings.ADC_Calibration (see adcScaleQ16) and has NTC_OVERSAMPLE_BITS
+// extra bits of resolution from adding up several readings.
+#define NTC_SAMPLES (1 << NTC_OVERSAMPLE_BITS)
+
+NTCTable ntcTable;
+uint32_t adcScaleQ16; // Correction of ADC codes in 16.16 fixed point: reference voltage * Settings.ADC_Calibration - see updateADCScale()
+
+void buildNTCTable()
+{
+  ntcTable.build(NTC_R25, NTC_BETA, NTC_RREF);
+  updateADCScale();
+}
+
+// Calculate adcScaleQ16 again - called whenever Settings.ADC_Calibration may have changed
+void updateADCScale()
+{
+  adcScaleQ16 = adcVrefCorrection * Settings.ADC_Calibration * 65536;
+}
+
+// Return measured temperature from the NTC connected to pinNmbr
+float measureTemperature(uint8_t pinNmbr)
+{
+  uint32_t Sum = 0;
+  for (uint8_t i = 0; i < NTC_SAMPLES; i++)
+    Sum += analogRead(pinNmbr); // Read Vout on analog input pin (ESP32 can sense from 0-4095, 4095 is Vin)
+
+  return ntcTable.temperature(((uint64_t)Sum * adcScaleQ16) >> 16) / 100.0;
+}
+
+// Continuous ADC ------------------------------------------------------------------------------------------
+// The ADC converts both NTC channels in turn at ADC_CONTINUOUS_FREQ and the DMA stores the results in a buffer owned by the ADC driver,
+// so measuring costs no CPU time until the temperature task adds up everything collected since the last measurement - typically more than
+// a thousand readings per NTC instead of NTC_SAMPLES. If the continuous mode can't be started, or delivers no readings for
+// ADC_CONTINUOUS_MAX_EMPTY measurements in a row, the NTCs are read with analogRead() by measureTemperature() instead.
+#define ADC_CONTINUOUS_FREQ 20000      // Conversions per second for both channels together (20000 is the lowest possible on the ESP32)
+#define ADC_CONTINUOUS_BUFFER_SIZE 4096 // Bytes buffered by the ADC driver between measurements (2 bytes per conversion)
+#define ADC_CONTINUOUS_READ_SIZE 256    // Bytes fetched from the ADC driver at a time
+#define ADC_CONTINUOUS_READ_TIMEOUT 20  // Milliseconds to wait for the first readings of a measurement (the driver delivers ADC_CONTINUOUS_READ_SIZE bytes every ~6 ms)
+#define ADC_CONTINUOUS_MAX_EMPTY 4      // Measurements in a row without readings before going back to analogRead()
+bool adcContinuous = false;             // True while the NTCs are read in continuous mode
+
+bool startContinuousADC()
+{
+#ifdef NTC_ADC_CONTINUOUS
+  adc_digi_init_config_t InitConfig = {};
+  InitConfig.max_store_buf_size = ADC_CONTINUOUS_BUFFER_SIZE;
+  InitConfig.conv_num_each_intr = ADC_CONTINUOUS_READ_SIZE;
+  InitConfig.adc1_chan_mask = BIT(NTC1_ADC_CHANNEL) | BIT(NTC2_ADC_CHANNEL);
+  if (adc_digi_initialize(&InitConfig) != ESP_OK)
+  {
+    debugln("Continuous ADC could not be initialized - using analogRead()");
+    return false;
+  }
+
+  adc_digi_pattern_config_t Pattern[2] = {};
+  Pattern[0].atten = ADC_ATTEN_DB_11;
+  Pattern[0].channel = NTC1_ADC_CHANNEL;
+  Pattern[0].unit = 0; // ADC1
+  Pattern[0].bit_width = SOC_ADC_DIGI_MAX_BITWIDTH;
+  Pattern[1] = Pattern[0];
+  Pattern[1].channel = NTC2_ADC_CHANNEL;
+
+  adc_digi_configuration_t Config = {};
+  Config.conv_limit_en = true; // Required on the ESP32
+  Config.conv_limit_num = 250;
+  Config.pattern_num = 2;
+  Config.adc_pattern = Pattern;
+  Config.sample_freq_hz = ADC_CONTINUOUS_FREQ;
+  Config.conv_mode = ADC_CONV_SINGLE_UNIT_1;
+  Config.format = ADC_DIGI_OUTPUT_FORMAT_TYPE1;
+  if (adc_digi_controller_configure(&Config) != ESP_OK || adc_digi_start() != ESP_OK)
+  {
+    debugln("Continuous ADC could not be started - using analogRead()");
+    adc_digi_deinitialize();
+    return false;
+  }
+  debugln("Reading NTCs with continuous ADC");
+  return true;
+#else
+  return false;
+#endif
+}
+
+// Find the temperatures from all readings collected by the continuous ADC since the last call - returns false if there are no readings (or the
+// continuous mode isn't running). After ADC_CONTINUOUS_MAX_EMPTY calls in a row without readings the continuous mode is stopped
+bool measureTemperaturesContinuous(float &Temp1, float &Temp2)
+{
+#ifdef NTC_ADC_CONTINUOUS
+  static byte EmptyMeasurements = 0;
+  if (!adcContinuous)
+    return false;
+
+  uint8_t Buffer[ADC_CONTINUOUS_READ_SIZE];
+  uint32_t Length;
+  uint32_t Sum1 = 0, Sum2 = 0;
+  uint32_t Count1 = 0, Count2 = 0;
+  uint32_t Timeout = ADC_CONTINUOUS_READ_TIMEOUT; // Wait for the first readings only - right after the start there may be none yet
+  esp_err_t Result;
+  // ESP_ERR_INVALID_STATE means the driver's buffer has been full and readings have been dropped - the data returned is still valid
+  while ((Result = adc_digi_read_bytes(Buffer, sizeof(Buffer), &Length, Timeout)) == ESP_OK || Result == ESP_ERR_INVALID_STATE)
+  {
+    Timeout = 0;
+    for (uint32_t i = 0; i + sizeof(adc_digi_output_data_t) <= Length; i += sizeof(adc_digi_output_data_t))
+    {
+      adc_digi_output_data_t *Data = (adc_digi_output_data_t *)&Buffer[i];
+      if (Data->type1.channel == NTC1_ADC_CHANNEL)
+      {
+        Sum1 += Data->type1.data;
+        Count1++;
+      }
+      else if (Data->type1.channel == NTC2_ADC_CHANNEL)
+      {
+        Sum2 += Data->type1.data;
+        Count2++;
+      }
+    }
+  }
+
+  if (Count1 == 0 || Count2 == 0)
+  {
+    if (++EmptyMeasurements < ADC_CONTINUOUS_MAX_EMPTY)
+      return false; // Skip this measurement
+    debugln("No readings from continuous ADC - using analogRead()");
+    adc_digi_stop();
+    adc_digi_deinitialize();
+    analogReadResolution(12); // Configure the ADC for analogRead() again
+    adcContinuous = false;
+    return false;
+  }
+  EmptyMeasurements = 0;
+
+  // Scale the averages to the same number of bits as the sum of NTC_SAMPLES readings used by measureTemperature()
+  Temp1 = ntcTable.temperature(((((uint64_t)Sum1 << NTC_OVERSAMPLE_BITS) / Count1) * adcScaleQ16) >> 16) / 100.0;
+  Temp2 = ntcTable.temperature(((((uint64_t)Sum2 << NTC_OVERSAMPLE_BITS) / Count2) * adcScaleQ16) >> 16) / 100.0;
+  return true;
+#else
+  return false;
+#endif
+}
+
+// Temperature sampling ------------------------------------------------------------------------------------
+// Both NTCs are measured by a separate task at a fixed interval. The last TEMP_FILTER_SAMPLES measurements of each NTC are kept in a
+// ring buffer - the median of these removes spikes and is then smoothed by an exponential moving average. The result is published as
+// one snapshot so the display, the web clients and the temperature protection all see the same values without measuring again.
+#define TEMP_SAMPLE_INTERVAL 250 // Milliseconds between measurements
+#define TEMP_FILTER_SAMPLES 9    // Number of measurements the median is found from (odd number)
+#define TEMP_FILTER_ALPHA 0.2    // Weight of a new median in the exponential moving average (0-1, lower is smoother)
+
+typedef struct
+{
+  float Temp1;             // Filtered temperature of NTC 1
+  float Temp2;             // Filtered temperature of NTC 2
+  unsigned long Timestamp; // millis() of the last update
+  byte State1;             // State of the temperature protection of NTC 1 (ThermalProtection::NORMAL, WARNING or TRIPPED)
+  byte State2;             // State of the temperature protection of NTC 2
+} TemperatureSnapshot;
+
+TemperatureSnapshot Temperatures;
+portMUX_TYPE temperatureMux = portMUX_INITIALIZER_UNLOCKED;
+
+// Temperature protection ----------------------------------------------------------------------------------
+// Evaluated by the temperature task for every measurement, so it reacts within TEMP_SAMPLE_INTERVAL plus the delay of the filter
+// (a step in temperature is followed by the filtered temperature within ~2 seconds) no matter what the user interface is doing.
+// The protection trips at the trigger temperature set in the menu or if the temperature rises faster than THERMAL_MAX_RISE_RATE
+// close to it. Before that a warning is shown when the temperature gets within THERMAL_WARNING_MARGIN of the trigger temperature.
+#define THERMAL_WARNING_MARGIN 5    // Degrees Celcius below the trigger temperature where the warning starts
+#define THERMAL_HYSTERESIS 3        // Degrees Celcius the temperature must fall before a warning ends or before it is possible to turn on again after a trip
+#define THERMAL_MAX_RISE_RATE 6     // Degrees Celcius per minute - a faster rise trips the protection...
+#define THERMAL_RISE_RATE_MARGIN 15 // ...if the temperature is no more than this number of degrees Celcius below the trigger temperature
+
+ThermalProtection thermalProtection1; // Only used by the temperature task and resetThermalProtection (protected by temperatureMux)
+ThermalProtection thermalProtection2;
+unsigned long thermalTrippedAt;  // Timestamp of the measurement that tripped the protection - used to log the time until standby
+byte lastThermalState = ThermalProtection::NORMAL; // Used by checkThermalProtection to detect changes
+
+typedef struct
+{
+  float Samples[TEMP_FILTER_SAMPLES]; // Ring buffer with the latest measurements
+  byte Next;                          // Position in Samples for the next measurement
+  byte Count;                         // Number of measurements in Samples
+  float Smoothed;                     // Exponential moving average of the medians
+} TemperatureFilter;
+
+// Add a measurement to the filter and return the new filtered temperature
+float filterTemperature(TemperatureFilter &Filter, float Temp)
+{
+  Filter.Samples[Filter.Next] = Temp;
+  Filter.Next = (Filter.Next + 1) % TEMP_FILTER_SAMPLES;
+  if (Filter.Count < TEMP_FILTER_SAMPLES)
+    Filter.Count++;
+
+  // Find the median by sorting a copy of the measurements (insertion sort is fine for this few elements)
+  float Sorted[TEMP_FILTER_SAMPLES];
+  for (byte i = 0; i < Filter.Count; i++)
+  {
+    byte j = i;
+    for (; j > 0 && Sorted[j - 1] > Filter.Samples[i]; j--)
+      Sorted[j] = Sorted[j - 1];
+    Sorted[j] = Filter.Samples[i];
+  }
+  float Median = Sorted[Filter.Count / 2];
+
+  if (Filter.Count == 1)
+    Filter.Smoothed = Median;
+  else
+    Filter.Smoothed += TEMP_FILTER_ALPHA * (Median - Filter.Smoothed);
+  return Filter.Smoothed;
+}
+
+void temperatureTask(void *parameter)
+{
+  TemperatureFilter Filter1 = {};
+  TemperatureFilter Filter2 = {};
+  TickType_t LastWake = xTaskGetTickCount();
+  byte SamplesSinceHistory = 0;
+
+  for (;;)
+  {
+    float Measured1, Measured2;
+    if (adcContinuous)
+    {
+      if (!measureTemperaturesContinuous(Measured1, Measured2))
+      {
+        // No readings this time - analogRead() can't be used while the continuous mode is running (if it has been stopped it is used from the next time)
+        vTaskDelayUntil(&LastWake, pdMS_TO_TICKS(TEMP_SAMPLE_INTERVAL));
+        continue;
+      }
+    }
+    else
+    {
+      Measured1 = measureTemperature(NTC1_PIN);
+      Measured2 = measureTemperature(NTC2_PIN);
+    }
+    float Temp1 = filterTemperature(Filter1, Measured1);
+    float Temp2 = filterTemperature(Filter2, Measured2);
+    unsigned long Now = millis();
+
+    thermalProtection1.configure(Settings.Trigger1Temp, THERMAL_WARNING_MARGIN, THERMAL_HYSTERESIS, THERMAL_MAX_RISE_RATE, THERMAL_RISE_RATE_MARGIN);
+    thermalProtection2.configure(Settings.Trigger2Temp, THERMAL_WARNING_MARGIN, THERMAL_HYSTERESIS, THERMAL_MAX_RISE_RATE, THERMAL_RISE_RATE_MARGIN);
+
+    portENTER_CRITICAL(&temperatureMux);
+    Temperatures.Temp1 = Temp1;
+    Temperatures.Temp2 = Temp2;
+    Temperatures.Timestamp = Now;
+    Temperatures.State1 = thermalProtection1.update(Temp1, Now);
+    Temperatures.State2 = thermalProtection2.update(Temp2, Now);
+    portEXIT_CRITICAL(&temperatureMux);
+
+    if (++SamplesSinceHistory >= 1000 / TEMP_SAMPLE_INTERVAL)
+    {
+      TemperatureSample Sample = {{(int16_t)round(Temp1 * 10), (int16_t)round(Temp2 * 10)}};
+      portENTER_CRITICAL(&temperatureHistoryMux);
+      temperatureHistory.add(Sample);
+      portEXIT_CRITICAL(&temperatureHistoryMux);
+      SamplesSinceHistory = 0;
+    }
+
+    vTaskDelayUntil(&LastWake, pdMS_TO_TICKS(TEMP_SAMPLE_INTERVAL));
+  }
+}
+
+void setupTemperatureSampling()
+{
+  buildNTCTable();
+  adcContinuous = startContinuousADC();
+  xTaskCreatePinnedToCore(temperatureTask, "Temperature", 3072, NULL, 1, NULL, 0);
 }
 
-// Return measured temperature from 4.7K NTC connected to pinNmbr
+// Return the latest filtered temperature of the NTC connected to pinNmbr
 float getTemperature(uint8_t pinNmbr)
 {
-  float Vin = 3.3;   // Input voltage 3.3V for ESP32
-  float Vout = 0;    // Measured voltage
-  float Rref = 2200; // Reference resistor's value in ohms
-  float Rntc = 0;    // Measured resistance of NTC+
   float Temp;
+  portENTER_CRITICAL(&temperatureMux);
+  Temp = (pinNmbr == NTC1_PIN) ? Temperatures.Temp1 : Temperatures.Temp2;
+  portEXIT_CRITICAL(&temperatureMux);
+  return Temp;
+}
 
-  for (uint8_t i = 0; i < 8; i++)
-    Vout = Vout + readVoltage(pinNmbr); // Read Vout on analog input pin (ESP32 can sense from 0-4095, 4095 is Vin)
-  Vout = Vout / 8;
+// Return the state of the temperature protection of the NTC connected to pinNmbr
+byte getThermalState(uint8_t pinNmbr)
+{
+  byte State;
+  portENTER_CRITICAL(&temperatureMux);
+  State = (pinNmbr == NTC1_PIN) ? Temperatures.State1 : Temperatures.State2;
+  portEXIT_CRITICAL(&temperatureMux);
+  return State;
+}
 
-  Rntc = Rref * (1 / ((Vin / Vout) - 1)); // Formula to calculate the resistance of the NTC
+// Clear a trip of the temperature protection - returns false if the temperature is still too high
+bool resetThermalProtection()
+{
+  portENTER_CRITICAL(&temperatureMux);
+  bool Reset1 = thermalProtection1.reset();
+  bool Reset2 = thermalProtection2.reset();
+  Temperatures.State1 = thermalProtection1.state();
+  Temperatures.State2 = thermalProtection2.state();
+  portEXIT_CRITICAL(&temperatureMux);
+  lastThermalState = max(Temperatures.State1, Temperatures.State2);
+  return Reset1 && Reset2;
+}
 
-  if (Rntc < 0)
-    Temp = 0;
-  else
-    Temp = (-25.37 * log(Rntc)) + 239.43, 0.0; // Formula to calculate the temperature based on the resistance of the NTC - the formula is derived from the datasheet of the NTC
+// Act on the state of the temperature protection: go to standby if it has tripped and update display and web clients when a warning starts or ends
+void checkThermalProtection()
+{
+  portENTER_CRITICAL(&temperatureMux);
+  byte State = max(Temperatures.State1, Temperatures.State2);
+  if (Temperatures.State1 == ThermalProtection::TRIPPED)
+    thermalTrippedAt = thermalProtection1.trippedAt();
+  else if (Temperatures.State2 == ThermalProtection::TRIPPED)
+    thermalTrippedAt = thermalProtection2.trippedAt();
+  portEXIT_CRITICAL(&temperatureMux);
+
+  if (State == lastThermalState || appMode == APP_STANDBY_MODE)
+    return;
+  lastThermalState = State;
 
-  if (Temp < 0)
-    Temp = 0;
-  else if (Temp > 99)
-    Temp = 99;
-  debug(" Voltage: ");
-  debug(Vout);
-  debug(" Resistance: ");
-  debug(Rntc);
-  debug("  Temp: ");
-  debugln(Temp);
-  return (Temp);
+  if (State == ThermalProtection::TRIPPED)
+  {
+    debug("Temperature protection tripped at Temp1: ");
+    debug(getTemperature(NTC1_PIN));
+    debug(" Temp2: ");
+    debug(getTemperature(NTC2_PIN));
+    debug(" - ms from measurement to standby: ");
+    debugln(millis() - thermalTrippedAt);
+    toStandbyMode();
+  }
+  else
+  {
+    debugln((State == ThermalProtection::WARNING) ? "Temperature warning" : "Temperature warning ended");
+    if (appMode == APP_NORMAL_MODE)
+      displayTemperatures();
+    markStateDirty(STATE_TEMPERATURES);
+  }
 }
 
 void loop()
 {
   UIkey = getUserInput();
+  processControlCommands();
+  checkRuntimeSettingsChanged();
+  serviceEEPROM();
 
   switch (appMode)
   {
   case APP_NORMAL_MODE:
     if (millis() > mil_onRefreshTemperatureDisplay + TEMP_REFRESH_INTERVAL)
     {
+      debug("Temp1: ");
+      debug(getTemperature(NTC1_PIN));
+      debug(" Temp2: ");
+      debugln(getTemperature(NTC2_PIN));
       displayTemperatures();
-      notifyClients(getJSONTempValues());
-      if (((Settings.Trigger1Temp != 0) && (getTemperature(NTC1_PIN) >= Settings.Trigger1Temp)) || ((Settings.Trigger2Temp != 0) && (getTemperature(NTC2_PIN) >= Settings.Trigger2Temp)))
-      {
-        toStandbyMode();
-      }
+      markStateDirty(STATE_TEMPERATURES);
     }
 
     switch (UIkey)
@@ -1523,13 +3342,13 @@ void loop()
       // Turn volume up if we're not muted and we'll not exceed the maximum volume set for the currently selected input
       // TO DO: The checks for mute and MaxVol are done in setVolume so can be deleted here?
       if (!RuntimeSettings.Muted && (RuntimeSettings.CurrentVolume < Settings.Input[RuntimeSettings.CurrentInput].MaxVol))
-        setVolume(RuntimeSettings.CurrentVolume + 1);
+        changeVolume(1);
       break;
     case KEY_DOWN:
       // Turn volume down if we're not muted and we'll not get below the minimum volume set for the currently selected input
       // TO DO: The checks for mute and MinVol are done in setVolume so can be deleted here?
       if (!RuntimeSettings.Muted && (RuntimeSettings.CurrentVolume > Settings.Input[RuntimeSettings.CurrentInput].MinVol))
-        setVolume(RuntimeSettings.CurrentVolume - 1);
+        changeVolume(-1);
       break;
     case KEY_LEFT:
     {
@@ -1553,6 +3372,9 @@ void loop()
       // Switch to previous selected input (to allow for A-B comparison)
       setInput(RuntimeSettings.PrevSelectedInput);
       break;
+    case KEY_PROFILE:
+      loadNextProfile();
+      break;
     case KEY_MUTE:
       // toggle mute
       if (RuntimeSettings.Muted)
@@ -1612,7 +3434,7 @@ void loop()
     // Send temperature notification via websocket while in standby mode
     if (millis() > mil_onRefreshTemperatureDisplay + (TEMP_REFRESH_INTERVAL_STANDBY))
     {
-      notifyClients(getJSONTempValues());
+      markStateDirty(STATE_TEMPERATURES);
       mil_onRefreshTemperatureDisplay = millis();
     }
     break;
@@ -1631,8 +3453,10 @@ void toAppNormalMode()
 
 void toStandbyMode()
 {
+  stopKeyRepeat();
   appMode = APP_STANDBY_MODE;
-  writeRuntimeSettingsToEEPROM();
+  markRuntimeSettingsDirty();
+  flushEEPROM(false); // Don't wait for the next quiet period - the power may be turned off while in standby
   ScreenSaverOff(); // Disable screen saver
   oled.clear();
   oled.setCursor(0, 1);
@@ -1647,7 +3471,7 @@ void toStandbyMode()
     digitalWrite(POWER_RELAY_PIN, LOW);
   }
   last_KEY_ONOFF = millis();
-  notifyClients(getJSONOnStandbyState());
+  markStateDirty(STATE_ON_STANDBY);
   delay(3000);
   oled.lcdOff();
 }
@@ -1682,7 +3506,7 @@ byte processMenuCommand(byte cmdId)
         Settings.MaxStartVolume = Settings.VolumeSteps;
       Settings.MuteLevel = 0;
       setVolume(0); // Turn the volume down to the minimum (just in case)
-      writeSettingsToEEPROM();
+      markSettingsDirty();
     }
     complete = true;
     break;
@@ -1710,6 +3534,10 @@ byte processMenuCommand(byte cmdId)
     editOptionValue(Settings.RecallSetLevel, 2, "No", "Yes", "", "");
     complete = true;
     break;
+  case mnuCmdKEY_REPEAT:
+    editNumericValue(Settings.KeyRepeatRate, 1, KEY_REPEAT_MAX_RATE, "Per s");
+    complete = true;
+    break;
   case mnuCmdINPUT1_ACTIVE:
     if (RuntimeSettings.CurrentInput != 0) // If this input is selected then only allow to select "HT", "Yes". If not "HT", "Yes", "No" is allowed as options
       editOptionValue(Settings.Input[0].Active, 3, "HT", "Yes", "No", "");
@@ -1888,6 +3716,14 @@ byte processMenuCommand(byte cmdId)
     editIRCode(Settings.IR_6);
     complete = true;
     break;
+  case mnuCmdIR_PROFILE:
+    editIRCode(IRBindings.IR_PROFILE);
+    complete = true;
+    break;
+  case mnuCmdIR_PROTOCOL:
+    detectIRProtocol();
+    complete = true;
+    break;
   case mnuCmdTRIGGER1_ACTIVE:
     editOptionValue(Settings.Trigger1Active, 2, "Inactive", "Active", "", "");
     complete = true;
@@ -1980,23 +3816,43 @@ byte processMenuCommand(byte cmdId)
     delay(5000);
     complete = true;
     break;
-  case mnuCmdSAVE_CUST:
-    writeUserSettingsToEEPROM();
-    oled.clear();
-    oled.setCursor(0, 1);
-    oled.print(F("Saved..."));
-    delay(1000);
+  case mnuCmdSAVE_PROFILE:
+  {
+    byte Number = activeProfile ? activeProfile : 1;
+    if (pickNumericValue(Number, 1, PROFILE_COUNT, " Prof"))
+    {
+      saveProfile(Number);
+      oled.clear();
+      oled.setCursor(0, 1);
+      oled.print(F("Saved..."));
+      delay(1000);
+    }
     complete = true;
     break;
-  case mnuCmdLOAD_CUST:
-    readUserSettingsFromEEPROM();
-    writeSettingsToEEPROM();
-    writeRuntimeSettingsToEEPROM();
-    setTrigger1Off();
-    setTrigger2Off();
-    startUp();
+  }
+  case mnuCmdLOAD_PROFILE:
+  {
+    byte Number = activeProfile ? activeProfile : 1;
+    if (!pickNumericValue(Number, 1, PROFILE_COUNT, " Prof"))
+    {
+      complete = true;
+      break;
+    }
+    if (!profileExists(Number))
+    {
+      oled.clear();
+      oled.setCursor(0, 1);
+      oled.print(F("No profile "));
+      oled.print(Number);
+      delay(2000);
+      complete = true;
+      break;
+    }
+    appMode = APP_NORMAL_MODE; // The profile takes effect as in normal mode - the menu is left afterwards
+    loadProfile(Number);
     complete = ABANDON;
     break;
+  }
   case mnuCmdLOAD_DEFAULT:
     writeDefaultSettingsToEEPROM();
     setTrigger1Off();
@@ -2199,8 +4055,7 @@ bool changeBalance()
       if (NewValue < 136)
       {
         NewValue++;
-        RuntimeSettings.InputLastBal[RuntimeSettings.CurrentInput] = NewValue;
-        setVolume(RuntimeSettings.CurrentVolume);
+        setBalance(NewValue);
         displayBalance(NewValue);
       }
       break;
@@ -2208,15 +4063,14 @@ bool changeBalance()
       if (NewValue > 118)
       {
         NewValue--;
-        RuntimeSettings.InputLastBal[RuntimeSettings.CurrentInput] = NewValue;
-        setVolume(RuntimeSettings.CurrentVolume);
+        setBalance(NewValue);
         displayBalance(NewValue);
       }
       break;
     case KEY_SELECT:
       if (NewValue != OldValue)
       {
-        writeRuntimeSettingsToEEPROM();
+        markRuntimeSettingsDirty();
         result = true;
       }
       complete = true;
@@ -2235,6 +4089,13 @@ bool changeBalance()
   return result;
 }
 
+// Set the balance of the current input - 127 = centered, values below shift the balance to the left channel (limited to 118 - 136)
+void setBalance(byte Balance)
+{
+  RuntimeSettings.InputLastBal[RuntimeSettings.CurrentInput] = constrain(Balance, 118, 136);
+  setVolume(RuntimeSettings.CurrentVolume);
+}
+
 void displayBalance(byte Value)
 {
   oled.setCursor(1, 1);
@@ -2347,7 +4208,7 @@ void editInputName(uint8_t InputNumber)
               Settings.Input[InputNumber].Name[i] = ' ';
             Settings.Input[InputNumber].Name[10] = '\0';
             // Save to EEPROM
-            writeSettingsToEEPROM();
+            markSettingsDirty();
           }
           complete = true;
         }
@@ -2426,7 +4287,8 @@ void drawEditInputNameScreen(bool isUpperCase)
   oled.write(28);  // "Enter" icon
 }
 
-bool editNumericValue(byte &Value, byte MinValue, byte MaxValue, const char Unit[5])
+// Let the user pick a number from MinValue to MaxValue - returns false if left with KEY_BACK. No setting is changed (see editNumericValue)
+bool pickNumericValue(byte &Value, byte MinValue, byte MaxValue, const char Unit[5])
 {
   bool complete = false;
   bool result = false;
@@ -2469,7 +4331,6 @@ bool editNumericValue(byte &Value, byte MinValue, byte MaxValue, const char Unit
       break;
     case KEY_SELECT:
       Value = NewValue;
-      writeSettingsToEEPROM();
       result = true;
       complete = true;
       break;
@@ -2485,6 +4346,14 @@ bool editNumericValue(byte &Value, byte MinValue, byte MaxValue, const char Unit
   return result;
 }
 
+bool editNumericValue(byte &Value, byte MinValue, byte MaxValue, const char Unit[5])
+{
+  if (!pickNumericValue(Value, MinValue, MaxValue, Unit))
+    return false;
+  markSettingsDirty();
+  return true;
+}
+
 bool editOptionValue(byte &Value, byte NumOptions, const char Option1[9], const char Option2[9], const char Option3[9], const char Option4[9])
 {
   bool complete = false;
@@ -2545,7 +4414,7 @@ bool editOptionValue(byte &Value, byte NumOptions, const char Option1[9], const
       break;
     case KEY_SELECT:
       Value = NewValue;
-      writeSettingsToEEPROM();
+      markSettingsDirty();
       result = true;
       complete = true;
       break;
@@ -2558,84 +4427,285 @@ bool editOptionValue(byte &Value, byte NumOptions, const char Option1[9], const
       break;
     }
   }
-  return result;
+  return result;
+}
+
+// Display the number of additional codes bound to a key in the upper right corner of the screen
+void displayIRBindingCount(byte Key)
+{
+  byte Count = 0;
+  for (byte i = 0; i < IRBindings.Count; i++)
+    if (IRBindings.Binding[i].Key == Key)
+      Count++;
+  oled.setCursor(17, 0);
+  if (Count)
+    oled.printf("+%-2d", Count);
+  else
+    oled.print(F("   "));
+}
+
+// Learn the IR code of a key
+// KEY_SELECT replaces the primary code of the key with the received code, KEY_RIGHT adds the received code as an additional code for the key
+// (ie. to use more than one remote), KEY_LEFT removes all additional codes from the key and KEY_BACK exits without changes
+bool editIRCode(IRMP_DATA &Value)
+{
+  bool complete = false;
+  bool result = false;
+  char nameBuf[11];
+  byte Key = KEY_NONE;
+
+  IRMP_DATA NewValue;
+  NewValue.protocol = 0;
+  NewValue.address = 0;
+  NewValue.command = 0;
+
+  // Find the key the code belongs to
+  for (byte i = 0; i < sizeof(IRKeys) / sizeof(IRKeys[0]); i++)
+    if (IRKeys[i].Code == &Value)
+      Key = IRKeys[i].Key;
+  if (&Value == &IRBindings.IR_PROFILE)
+    Key = KEY_PROFILE;
+
+  // Display the screen
+  oled.clear();
+  oled.print(F("IR key "));
+  oled.print(Menu1.getCurrentItemName(nameBuf));
+  displayIRBindingCount(Key);
+
+  oled.setCursor(0, 1);
+  oled.print(F("Current:"));
+  oled.setCursor(0, 2);
+  oled.print(Value.address, HEX);
+  oled.setCursor(0, 3);
+  oled.print(Value.command, HEX);
+  oled.setCursor(10, 1);
+  oled.print(F("New:"));
+  oled.setCursor(10, 2);
+  oled.print(NewValue.address, HEX);
+  oled.setCursor(10, 3);
+  oled.print(NewValue.command, HEX);
+
+  // As we don't want to react to received IR codes while learning a new code, received codes are not mapped to keys by getUserInput while IRLearnMode is set
+  IRLearnedCodeReceived = false;
+  IRLearnMode = true;
+
+  while (!complete)
+  {
+    mil_LastUserInput = millis(); // Prevent the screen saver to kick in while editing
+    switch (getUserInput())
+    {
+    case KEY_SELECT:
+      if (NewValue.address != 0 || NewValue.command != 0)
+      {
+        Value = NewValue;
+        if (&Value == &IRBindings.IR_PROFILE)
+          markIRBindingsDirty();
+        else
+          markSettingsDirty();
+        result = true;
+      }
+      complete = true;
+      break;
+    case KEY_RIGHT:
+      // Add the received code as an additional code for the key
+      if ((NewValue.address != 0 || NewValue.command != 0) && IRBindings.Count < IR_EXTRA_BINDINGS && Key != KEY_NONE)
+      {
+        IRBindings.Binding[IRBindings.Count].Key = Key;
+        IRBindings.Binding[IRBindings.Count].Code = NewValue;
+        IRBindings.Count++;
+        markIRBindingsDirty();
+        result = true;
+        complete = true;
+      }
+      break;
+    case KEY_LEFT:
+      // Remove all additional codes for the key
+      for (byte i = 0; i < IRBindings.Count;)
+      {
+        if (IRBindings.Binding[i].Key == Key)
+        {
+          IRBindings.Count--;
+          IRBindings.Binding[i] = IRBindings.Binding[IRBindings.Count];
+        }
+        else
+          i++;
+      }
+      markIRBindingsDirty();
+      displayIRBindingCount(Key);
+      result = true;
+      break;
+    case KEY_BACK:
+      // Exit without saving new value
+      complete = true;
+      break;
+    default:
+      break;
+    }
+    if (IRLearnedCodeReceived)
+    {
+      // Get the new data from the remote
+      IRLearnedCodeReceived = false;
+      NewValue = IRLearnedCode;
+      NewValue.flags = 0;
+      oled.setCursor(10, 2);
+      oled.print(F("          "));
+      oled.setCursor(10, 2);
+      oled.print(NewValue.address, HEX);
+      oled.setCursor(10, 3);
+      oled.print(F("          "));
+      oled.setCursor(10, 3);
+      oled.print(NewValue.command, HEX);
+    }
+  }
+  IRLearnMode = false;
+  if (result)
+    buildIRKeyMap();
+  return result;
+}
+
+// Add the protocol of Code to Protocols if a code is learned - a code without a known protocol (protocol 0: the default codes, and codes kept from
+// firmware that did not store the protocol) is counted in Unknown instead and reported on the serial port under Name
+void addLearnedIRProtocol(const IRMP_DATA &Code, const char *Name, uint64_t &Protocols, byte &Unknown)
+{
+  if (Code.address == 0 && Code.command == 0)
+    return;
+  if (Code.protocol == 0 || Code.protocol > IRMP_N_PROTOCOLS || Code.protocol >= 64)
+  {
+    Unknown++;
+    Serial.printf("The protocol of IR code %s is not known - learn it again\n", Name);
+  }
+  else
+    Protocols |= 1ULL << Code.protocol;
+}
+
+// Return the protocols of the learned IR codes - bit n is set if a code of IRMP protocol n has been learned. Unknown is the number of codes
+// learned without a known protocol (see addLearnedIRProtocol)
+uint64_t getLearnedIRProtocols(byte &Unknown)
+{
+  uint64_t Protocols = 0;
+  char Name[16];
+  Unknown = 0;
+  for (byte i = 0; i < sizeof(IRKeys) / sizeof(IRKeys[0]); i++)
+    addLearnedIRProtocol(*IRKeys[i].Code, IRKeys[i].Name, Protocols, Unknown);
+  for (byte i = 0; i < IRBindings.Count && i < IR_EXTRA_BINDINGS; i++)
+  {
+    snprintf(Name, sizeof(Name), "extra %u", i + 1);
+    addLearnedIRProtocol(IRBindings.Binding[i].Code, Name, Protocols, Unknown);
+  }
+  addLearnedIRProtocol(IRBindings.IR_PROFILE, "IR_PROFILE", Protocols, Unknown);
+  return Protocols;
+}
+
+// Return the name used in the IRMP_SUPPORT_xxx_PROTOCOL flag that compiles in the decoder of Protocol - some protocols are decoded as variants of another
+const char *getIRSupportName(byte Protocol)
+{
+  switch (Protocol)
+  {
+  case IRMP_APPLE_PROTOCOL:
+  case IRMP_ONKYO_PROTOCOL:
+    return irmp_protocol_names[IRMP_NEC_PROTOCOL];
+  case IRMP_RC6A_PROTOCOL:
+    return irmp_protocol_names[IRMP_RC6_PROTOCOL];
+  default:
+    return irmp_protocol_names[Protocol];
+  }
+}
+
+// Show the protocols of the learned IR codes on Line of the display and write the build flags of the smallest IR protocol profile decoding them
+// to the serial port - IR_PROFILE_NEC if they are all NEC, otherwise IR_PROFILE_CUSTOM with one IRMP_SUPPORT_xxx_PROTOCOL flag per decoder.
+// No profile is suggested while any learned code has no known protocol, as a profile without its protocol would not decode it
+void showLearnedIRProtocols(byte Line)
+{
+  byte Unknown;
+  uint64_t Protocols = getLearnedIRProtocols(Unknown);
+  uint64_t Decoders = 0; // The protocols whose decoder is needed
+  for (byte Protocol = 1; Protocol <= IRMP_N_PROTOCOLS && Protocol < 64; Protocol++)
+    if (Protocols & (1ULL << Protocol))
+    {
+      for (byte Decoder = 1; Decoder <= IRMP_N_PROTOCOLS && Decoder < 64; Decoder++)
+        if (strcmp(getIRSupportName(Protocol), irmp_protocol_names[Decoder]) == 0)
+          Decoders |= 1ULL << Decoder;
+    }
+
+  char Names[21] = "Learned:";
+  for (byte Protocol = 1; Protocol <= IRMP_N_PROTOCOLS && Protocol < 64; Protocol++)
+    if (Protocols & (1ULL << Protocol))
+      snprintf(Names + strlen(Names), sizeof(Names) - strlen(Names), " %s", irmp_protocol_names[Protocol]);
+  oled.setCursor(0, Line);
+  if (Unknown > 0)
+  {
+    oled.printf("%u without protocol", Unknown);
+    oled.setCursor(0, Line + 1);
+    oled.print(F("Learn again (serial)"));
+    return;
+  }
+  oled.print(Protocols ? Names : "No codes learned");
+  if (Protocols == 0)
+    return;
+  oled.setCursor(0, Line + 1);
+  if (Decoders == (1ULL << IRMP_NEC_PROTOCOL))
+  {
+    oled.print(F("Fits profile: NEC"));
+    Serial.println("build_flags for the learned IR codes: -D IR_PROTOCOL_PROFILE=IR_PROFILE_NEC");
+    return;
+  }
+  oled.print(F("Custom: see serial"));
+  Serial.print("build_flags for the learned IR codes: -D IR_PROTOCOL_PROFILE=IR_PROFILE_CUSTOM");
+  for (byte Decoder = 1; Decoder <= IRMP_N_PROTOCOLS && Decoder < 64; Decoder++)
+    if (Decoders & (1ULL << Decoder))
+      Serial.printf(" -D IRMP_SUPPORT_%s_PROTOCOL=1", irmp_protocol_names[Decoder]);
+  Serial.println();
 }
 
-bool editIRCode(IRMP_DATA &Value)
+// Show the protocol, address and command of the frames received from a remote until KEY_BACK or KEY_SELECT
+// Used to find the protocol of a remote so the IR protocol profile (see IRProtocolProfile.h) can be limited to the protocols in use. Until a
+// frame is received the protocols of the codes learned so far are shown, with the profile that decodes just them (see showLearnedIRProtocols)
+void detectIRProtocol()
 {
   bool complete = false;
-  bool result = false;
-  char nameBuf[11];
-
-  IRMP_DATA NewValue, OldValue;
-  NewValue.address = 0;
-  NewValue.command = 0;
 
-  // Display the screen
   oled.clear();
-  oled.print(F("IR key "));
-  oled.print(Menu1.getCurrentItemName(nameBuf));
-
+  oled.print(F("Profile: "));
+  oled.print(F(IR_PROFILE_NAME));
   oled.setCursor(0, 1);
-  oled.print(F("Current:"));
-  oled.setCursor(0, 2);
-  oled.print(Value.address, HEX);
-  oled.setCursor(0, 3);
-  oled.print(Value.command, HEX);
-  oled.setCursor(10, 1);
-  oled.print(F("New:"));
-  oled.setCursor(10, 2);
-  oled.print(NewValue.address, HEX);
-  oled.setCursor(10, 3);
-  oled.print(NewValue.command, HEX);
+  oled.print(F("Press key on remote"));
+  showLearnedIRProtocols(2);
 
-  // As we don't want to react to received IR code while learning new code we temporaryly disable the current code in the Settings (we save a copy in OldValue)
-  OldValue.address = Value.address;
-  OldValue.command = Value.command;
-  Value.address = 0x00;
-  Value.command = 0x00;
+  IRLearnedCodeReceived = false;
+  IRLearnMode = true;
 
   while (!complete)
   {
-    mil_LastUserInput = millis(); // Prevent the screen saver to kick in while editing
+    mil_LastUserInput = millis(); // Prevent the screen saver to kick in
     switch (getUserInput())
     {
     case KEY_SELECT:
-      Value.address = NewValue.address;
-      Value.command = NewValue.command;
-      writeSettingsToEEPROM();
-      result = true;
-      complete = true;
-      break;
     case KEY_BACK:
-      // Exit without saving new value, but restore the original one
-      Value.address = OldValue.address;
-      Value.command = OldValue.command;
-      result = false;
       complete = true;
       break;
     default:
       break;
     }
-    if (irmp_get_data(&irmp_data))
+    if (IRLearnedCodeReceived)
     {
-      // Get the new data from the remote
-      NewValue.address = irmp_data.address;
-      NewValue.command = irmp_data.command;
-      oled.setCursor(10, 2);
-      oled.print(F("          "));
-      oled.setCursor(10, 2);
-      oled.print(NewValue.address, HEX);
-      oled.setCursor(10, 3);
-      oled.print(F("          "));
-      oled.setCursor(10, 3);
-      oled.print(NewValue.command, HEX);
+      IRLearnedCodeReceived = false;
+      oled.setCursor(0, 2);
+      oled.print(padc(' ', 20));
+      oled.setCursor(0, 2);
+      oled.print(IRLearnedCode.protocol);
+      oled.print(F(" "));
+      if (IRLearnedCode.protocol < IRMP_N_PROTOCOLS + 1)
+        oled.print(irmp_protocol_names[IRLearnedCode.protocol]);
+      oled.setCursor(0, 3);
+      oled.print(padc(' ', 20));
+      oled.setCursor(0, 3);
+      oled.printf("Adr %X Cmd %X", IRLearnedCode.address, IRLearnedCode.command);
     }
   }
-  return result;
+  IRLearnMode = false;
 }
 
-// Loads default settings into Settings and RuntimeSettings - this is only done when the EEPROM does not contain valid settings or when reset is chosen by user in the menu
+// Loads default settings into Settings - this is only done when the EEPROM does not contain valid settings or when reset is chosen by user in the menu
 void setSettingsToDefault()
 {
   strcpy(Settings.ssid, "                                ");
@@ -2682,6 +4752,11 @@ void setSettingsToDefault()
   Settings.IR_5.command = 0x4;
   Settings.IR_6.address = 0x2;
   Settings.IR_6.command = 0x5;
+  for (byte i = 0; i < sizeof(IRKeys) / sizeof(IRKeys[0]); i++)
+  {
+    IRKeys[i].Code->protocol = 0; // The default codes matches any protocol
+    IRKeys[i].Code->flags = 0;
+  }
   Settings.Input[0].Active = INPUT_NORMAL;
   strcpy(Settings.Input[0].Name, "Input 1   ");
   Settings.Input[0].MaxVol = Settings.VolumeSteps;
@@ -2724,7 +4799,12 @@ void setSettingsToDefault()
   Settings.DisplayTemperature1 = 3;
   Settings.DisplayTemperature2 = 3;
   Settings.Version = VERSION;
+  Settings.KeyRepeatRate = 10;
+}
 
+// Loads default values into RuntimeSettings
+void setRuntimeSettingsToDefault()
+{
   RuntimeSettings.CurrentInput = 0;
   RuntimeSettings.CurrentVolume = 0;
   RuntimeSettings.Muted = 0;
@@ -2744,61 +4824,727 @@ void setSettingsToDefault()
   RuntimeSettings.Version = VERSION;
 }
 
-// Write Settings to EEPROM
+// Write one page to the EEPROM - used by writeChangedPages. Refused while the power is failing, so a write of several pages is abandoned
+// after the page being written and eepromMutex is soon released for powerFailTask
+bool writeEEPROMPage(uint16_t Address, const uint8_t *Data, uint16_t Length)
+{
+  return !powerFailed && eeprom.write(Address, (byte *)Data, Length) == 0;
+}
+
+// The data of a record is read into this and only copied to the caller when the CRC has been checked - used with eepromMutex taken
+byte recordBuffer[sizeof(mySettings)];
+static_assert(sizeof(mySettings) >= sizeof(myIRBindings) && sizeof(mySettings) >= PROFILE_MAX_DELTA && sizeof(mySettings) >= PROFILE_FIELDS_SIZE, "recordBuffer is too small for the records read");
+
+// Read the record stored at Address into Data (up to Length bytes - if fewer bytes are stored the rest of Data is left unchanged, so fields added
+// at the end keep the values set before reading). Returns false if no record is stored at Address or the CRC is wrong - Data is then left unchanged
+bool readRecordFromEEPROM(uint16_t Address, byte *Data, uint16_t Length, uint16_t &SchemaVersion, uint16_t &StoredLength, uint16_t &Sequence)
+{
+  RecordHeader Header;
+  if (Length > sizeof(recordBuffer) || eeprom.read(Address, (byte *)&Header, sizeof(Header)) != 0 || (Header.Magic != EEPROM_RECORD_MAGIC && Header.Magic != EEPROM_RECORD_MAGIC_1))
+    return false;
+
+  // Read the data and calculate the CRC of all of it - also of any bytes stored beyond Length by a newer firmware
+  uint16_t Crc = 0xFFFF;
+  for (uint16_t Offset = 0; Offset < Header.Length; Offset += EEPROM_PAGE_SIZE)
+  {
+    byte Page[EEPROM_PAGE_SIZE];
+    uint16_t Count = minimum(EEPROM_PAGE_SIZE, Header.Length - Offset);
+    if (eeprom.read(Address + EEPROM_PAGE_SIZE + Offset, Page, Count) != 0)
+      return false;
+    Crc = crc16(Page, Count, Crc);
+    if (Offset < Length)
+      memcpy(&recordBuffer[Offset], Page, minimum(Count, Length - Offset));
+  }
+  if (Header.Magic == EEPROM_RECORD_MAGIC)
+    Crc = crc16((byte *)&Header.Sequence, sizeof(Header.Sequence), Crc);
+  else
+    Header.Sequence = 0; // Not in the header of "MEB1" records
+  if (Crc != Header.Crc)
+  {
+    debug("CRC error in EEPROM record at address ");
+    debugln(Address);
+    return false;
+  }
+  if (Length > 0)
+    memcpy(Data, recordBuffer, minimum(Length, Header.Length));
+  SchemaVersion = Header.SchemaVersion;
+  StoredLength = Header.Length;
+  Sequence = Header.Sequence;
+  return true;
+}
+
+// Write Data as a record at Address - if Saved is not NULL it must be a copy of the data stored in the EEPROM and only the changed pages are written (see writeChangedPages)
+// Returns false if a write failed - the record is then left with a wrong CRC
+bool writeRecordToEEPROM(uint16_t Address, const byte *Data, byte *Saved, uint16_t Length, uint16_t SchemaVersion, uint16_t Sequence)
+{
+  // The header is written last, so the CRC will be wrong (and the record ignored) if writing the data is interrupted
+  if (!writeChangedPages(Address + EEPROM_PAGE_SIZE, Data, Saved, Length, EEPROM_PAGE_SIZE, writeEEPROMPage, eepromPageWrites))
+    return false;
+
+  RecordHeader Header;
+  Header.Magic = EEPROM_RECORD_MAGIC;
+  Header.SchemaVersion = SchemaVersion;
+  Header.Length = Length;
+  Header.Sequence = Sequence;
+  Header.Crc = crc16((byte *)&Header.Sequence, sizeof(Header.Sequence), crc16(Data, Length));
+  if (!writeEEPROMPage(Address, (byte *)&Header, sizeof(Header)))
+    return false;
+  eepromPageWrites++;
+  return true;
+}
+
+// Read the newest valid record of Slots into Data (see readRecordFromEEPROM) - returns false if neither slot holds a valid record
+bool readNewestRecordFromEEPROM(RecordSlots &Slots, byte *Data, uint16_t Length, uint16_t &SchemaVersion, uint16_t &StoredLength)
+{
+  bool Valid[2];
+  uint16_t Sequence[2];
+  for (byte Slot = 0; Slot < 2; Slot++)
+    Valid[Slot] = readRecordFromEEPROM(Slots.Address[Slot], NULL, 0, SchemaVersion, StoredLength, Sequence[Slot]); // Only check the CRC
+
+  // The sequence wraps around, so the newest is the one less than half the range ahead
+  byte Newest = Valid[1] && (!Valid[0] || (int16_t)(Sequence[1] - Sequence[0]) > 0) ? 1 : 0;
+  if (!Valid[Newest] || !readRecordFromEEPROM(Slots.Address[Newest], Data, Length, SchemaVersion, StoredLength, Sequence[Newest]))
+  {
+    Slots.Newest = 1; // The first write goes to the first slot
+    Slots.Sequence = 0;
+    return false;
+  }
+  Slots.Newest = Newest;
+  Slots.Sequence = Sequence[Newest];
+  return true;
+}
+
+// Write Data as the newest record of Slots - Saved is NULL or the copies of the data in the two slots, Length bytes apart (see writeRecordToEEPROM)
+bool writeNewestRecordToEEPROM(RecordSlots &Slots, const byte *Data, byte *Saved, uint16_t Length, uint16_t SchemaVersion)
+{
+  byte Slot = 1 - Slots.Newest;
+  if (!writeRecordToEEPROM(Slots.Address[Slot], Data, Saved != NULL ? &Saved[Slot * Length] : NULL, Length, SchemaVersion, Slots.Sequence + 1))
+    return false;
+  Slots.Newest = Slot;
+  Slots.Sequence++;
+  return true;
+}
+
+// Convert Settings read with an older schema to SETTINGS_SCHEMA_VERSION - returns false if the schema is unknown (ie. written by a newer firmware)
+// When the layout of mySettings is changed add a case for the previous schema here, converting it one step at a time, and fall through to the next
+bool migrateSettings(uint16_t SchemaVersion)
+{
+  switch (SchemaVersion)
+  {
+  case 0: // Firmware 0.99 and earlier (no header) - same layout as schema 1
+  case 1: // KeyRepeatRate was added at the end - it is not stored, so it keeps its default value
+  case 2:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// Write Settings to EEPROM - called by serviceEEPROM with eepromMutex taken
 void writeSettingsToEEPROM()
 {
-  // Write the settings to the EEPROM
-  eeprom.begin(extEEPROM::twiClock400kHz);
-  eeprom.write(0, Settings.data, sizeof(Settings));
+  // Work on a copy, so the settings written and the copy of what is in the EEPROM stay the same even if Settings are changed meanwhile
+  static mySettings Snapshot;
+  Snapshot = Settings;
+  // Write the changed pages of the settings to the slot not holding the newest settings
+  uint32_t PageWrites = eepromPageWrites;
+  if (!writeNewestRecordToEEPROM(settingsSlots, Snapshot.data, savedSettings[0].data, sizeof(Settings), SETTINGS_SCHEMA_VERSION))
+    debugln("Writing settings to EEPROM failed");
+  debug("Settings written to EEPROM - pages written: ");
+  debug(eepromPageWrites - PageWrites);
+  debug(" (total since startup: ");
+  debug(eepromPageWrites);
+  debugln(")");
 }
 
-// Read Settings from EEPROM
-void readSettingsFromEEPROM()
+// Read Settings from EEPROM - settings stored by an older firmware are migrated and written back. Returns false if there are no valid settings in the EEPROM
+bool readSettingsFromEEPROM()
 {
-  // Read settings from EEPROM
-  eeprom.begin(extEEPROM::twiClock400kHz);
-  eeprom.read(0, Settings.data, sizeof(Settings));
+  xSemaphoreTake(eepromMutex, portMAX_DELAY);
+  setSettingsToDefault(); // Fields not stored by an older firmware keep their default values
+  uint16_t SchemaVersion = 0;
+  uint16_t StoredLength = 0;
+  bool Valid = readNewestRecordFromEEPROM(settingsSlots, Settings.data, sizeof(Settings), SchemaVersion, StoredLength);
+  bool Current = Valid && SchemaVersion == SETTINGS_SCHEMA_VERSION && StoredLength == sizeof(Settings);
+  if (!Valid)
+  {
+    // Settings stored without a header by firmware 0.99 and earlier?
+    if (eeprom.read(EEPROM_LEGACY_SETTINGS_ADDRESS, Settings.data, LEGACY_SETTINGS_SIZE) == 0 && Settings.Version == LEGACY_VERSION)
+    {
+      debugln("Migrating settings from the legacy EEPROM layout");
+      Valid = true;
+      SchemaVersion = 0;
+
+      // Move the user settings as well - before the settings are written, as the new place of the settings overlaps the old place of the user settings
+      mySettings UserSettings = Settings; // The fields added since keep their default values
+      if (eeprom.read(EEPROM_LEGACY_USER_SETTINGS_ADDRESS, UserSettings.data, LEGACY_SETTINGS_SIZE) == 0 && UserSettings.Version == LEGACY_VERSION)
+        writeRecordToEEPROM(EEPROM_USER_SETTINGS_ADDRESS, UserSettings.data, NULL, sizeof(UserSettings), SETTINGS_SCHEMA_VERSION, 0);
+    }
+  }
+  if (Valid)
+    Valid = migrateSettings(SchemaVersion);
+
+  // The copies of what is in the slots - a slot not holding the settings as they are now gets all of its pages written
+  for (byte Slot = 0; Slot < 2; Slot++)
+  {
+    uint16_t SlotSchemaVersion, SlotLength, SlotSequence;
+    if (Slot == settingsSlots.Newest && Current)
+      savedSettings[Slot] = Settings;
+    else if (Slot != settingsSlots.Newest && readRecordFromEEPROM(settingsSlots.Address[Slot], savedSettings[Slot].data, sizeof(Settings), SlotSchemaVersion, SlotLength, SlotSequence) &&
+             SlotSchemaVersion == SETTINGS_SCHEMA_VERSION && SlotLength == sizeof(Settings))
+      continue; // Read into savedSettings[Slot]
+    else
+      for (uint16_t i = 0; i < sizeof(Settings); i++)
+        savedSettings[Slot].data[i] = ~Settings.data[i];
+  }
+  if (Valid && !Current)
+    writeSettingsToEEPROM(); // Write the migrated settings right away - to the other slot, so the old ones are kept until it is written
+  xSemaphoreGive(eepromMutex);
+  return Valid;
 }
 
 // Write Default Settings and RuntimeSettings to EEPROM - called if the EEPROM data is not valid or if the user chooses to reset all settings to default value
 void writeDefaultSettingsToEEPROM()
 {
-  // Read default settings into Settings
+  // Read default settings into Settings and RuntimeSettings
   setSettingsToDefault();
-  // Write the settings to the EEPROM
-  writeSettingsToEEPROM();
-  // Write the runtime settings to the EEPROM
-  writeRuntimeSettingsToEEPROM();
+  setRuntimeSettingsToDefault();
+  // Remove all additional IR codes
+  IRBindings.Count = 0;
+  IRBindings.Version = VERSION;
+  memset(&IRBindings.IR_PROFILE, 0, sizeof(IRBindings.IR_PROFILE));
+  // The profiles are kept - they are stored as changes from profileBase
+  setActiveProfile(0);
+  updateADCScale();
+  // Write it all to the EEPROM
+  markSettingsDirty();
+  markRuntimeSettingsDirty();
+  markIRBindingsDirty();
+  flushEEPROM(false);
 }
 
-// Write the current runtime settings to EEPROM - called if a power drop is detected or if the EEPROM data is not valid or if the user chooses to reset all settings to default values
+// Write the current runtime settings to EEPROM - called by serviceEEPROM with eepromMutex taken
 void writeRuntimeSettingsToEEPROM()
 {
-  // Write the settings to the EEPROM
-  eeprom.begin(extEEPROM::twiClock400kHz);
-  eeprom.write(sizeof(Settings) + 1, RuntimeSettings.data, sizeof(RuntimeSettings));
+  // Write the settings to the next page of the journal
+  if (!runtimeJournal.write(RuntimeSettings.data, sizeof(RuntimeSettings)))
+    debugln("Writing runtime settings to EEPROM failed");
 }
 
-// Read the last runtime settings from EEPROM
-void readRuntimeSettingsFromEEPROM()
+// Read the last runtime settings from EEPROM - returns false if there are no valid runtime settings in the EEPROM
+bool readRuntimeSettingsFromEEPROM()
 {
-  // Read the settings from the EEPROM
-  eeprom.begin(extEEPROM::twiClock400kHz);
-  eeprom.read(sizeof(Settings) + 1, RuntimeSettings.data, sizeof(RuntimeSettings));
+  xSemaphoreTake(eepromMutex, portMAX_DELAY);
+  // Read the newest settings from the journal
+  bool Valid = runtimeJournal.read(RuntimeSettings.data, sizeof(RuntimeSettings));
+  if (!Valid)
+  {
+    // No runtime settings in the journal - use the ones saved by firmware 0.99 and earlier and move them to the journal
+    if (eeprom.read(EEPROM_LEGACY_RUNTIME_ADDRESS, RuntimeSettings.data, sizeof(RuntimeSettings)) == 0 && RuntimeSettings.Version == LEGACY_VERSION)
+      Valid = runtimeJournal.write(RuntimeSettings.data, sizeof(RuntimeSettings));
+  }
+  changedRuntimeSettings = RuntimeSettings;
+  xSemaphoreGive(eepromMutex);
+  return Valid;
 }
 
-// Read the user defined settings from EEPROM
-void readUserSettingsFromEEPROM()
+// Mark the runtime settings as dirty if they have been changed (volume, input, balance etc. are changed from many places) - called from loop()
+void checkRuntimeSettingsChanged()
 {
-  // Read the settings from the EEPROM
-  eeprom.begin(extEEPROM::twiClock400kHz);
-  eeprom.read(sizeof(Settings) + sizeof(RuntimeSettings) + 1, Settings.data, sizeof(Settings));
+  if (memcmp(RuntimeSettings.data, changedRuntimeSettings.data, sizeof(RuntimeSettings)) != 0)
+  {
+    changedRuntimeSettings = RuntimeSettings;
+    markRuntimeSettingsDirty();
+  }
+}
+
+// Read the additional IR bindings from EEPROM - returns false if there are no valid IR bindings in the EEPROM
+bool readIRBindingsFromEEPROM()
+{
+  uint16_t SchemaVersion;
+  uint16_t StoredLength;
+  memset(&IRBindings.IR_PROFILE, 0, sizeof(IRBindings.IR_PROFILE)); // Not stored by schema 1 and firmware 0.99
+  xSemaphoreTake(eepromMutex, portMAX_DELAY);
+  bool Valid = readNewestRecordFromEEPROM(irBindingsSlots, (byte *)&IRBindings, sizeof(IRBindings), SchemaVersion, StoredLength);
+  if (Valid)
+    Valid = ((SchemaVersion == IR_BINDINGS_SCHEMA_VERSION && StoredLength == sizeof(IRBindings)) || (SchemaVersion == 1 && StoredLength == offsetof(myIRBindings, IR_PROFILE))) && IRBindings.Count <= IR_EXTRA_BINDINGS;
+  else if (eeprom.read(EEPROM_LEGACY_IR_BINDINGS_ADDRESS, (byte *)&IRBindings, offsetof(myIRBindings, IR_PROFILE)) == 0 && IRBindings.Version == LEGACY_VERSION && IRBindings.Count <= IR_EXTRA_BINDINGS)
+  {
+    // Stored without a header by firmware 0.99 - write it as a record
+    Valid = true;
+    writeIRBindingsToEEPROM();
+  }
+  xSemaphoreGive(eepromMutex);
+  return Valid;
+}
+
+// Write the additional IR bindings to EEPROM - called by serviceEEPROM with eepromMutex taken
+void writeIRBindingsToEEPROM()
+{
+  static myIRBindings Snapshot;
+  Snapshot = IRBindings;
+  if (!writeNewestRecordToEEPROM(irBindingsSlots, (byte *)&Snapshot, NULL, sizeof(IRBindings), IR_BINDINGS_SCHEMA_VERSION))
+    debugln("Writing IR bindings to EEPROM failed");
+}
+
+// Copy the profile fields of From to Packed (PROFILE_FIELDS_SIZE bytes) - or from Packed to From if Unpack is true
+void packProfileFields(mySettings &From, byte *Packed, bool Unpack)
+{
+  uint16_t Position = 0;
+  for (byte f = 0; f < sizeof(ProfileFields) / sizeof(ProfileFields[0]); f++)
+  {
+    if (Unpack)
+      memcpy(&From.data[ProfileFields[f].Offset], &Packed[Position], ProfileFields[f].Length);
+    else
+      memcpy(&Packed[Position], &From.data[ProfileFields[f].Offset], ProfileFields[f].Length);
+    Position += ProfileFields[f].Length;
+  }
+}
+
+// Read profileBase from EEPROM - returns false if it has not been written (or was written with another layout of the profile fields)
+bool readProfileBaseFromEEPROM()
+{
+  byte Packed[PROFILE_FIELDS_SIZE];
+  uint16_t SchemaVersion, Length, Sequence;
+  xSemaphoreTake(eepromMutex, portMAX_DELAY);
+  bool Valid = readRecordFromEEPROM(EEPROM_PROFILE_BASE_ADDRESS, Packed, sizeof(Packed), SchemaVersion, Length, Sequence);
+  xSemaphoreGive(eepromMutex);
+  if (!Valid || SchemaVersion != PROFILE_SCHEMA_VERSION || Length != sizeof(Packed))
+    return false;
+  packProfileFields(profileBase, Packed, true);
+  profileBaseCrc = crc16(Packed, sizeof(Packed));
+  return true;
+}
+
+// Write profileBase to EEPROM
+void writeProfileBaseToEEPROM()
+{
+  byte Packed[PROFILE_FIELDS_SIZE];
+  packProfileFields(profileBase, Packed, false);
+  profileBaseCrc = crc16(Packed, sizeof(Packed));
+  xSemaphoreTake(eepromMutex, portMAX_DELAY);
+  if (!writeRecordToEEPROM(EEPROM_PROFILE_BASE_ADDRESS, Packed, NULL, sizeof(Packed), PROFILE_SCHEMA_VERSION, 0))
+    debugln("Writing profile base to EEPROM failed");
+  xSemaphoreGive(eepromMutex);
 }
 
-// Read the user defined settings from EEPROM
-void writeUserSettingsToEEPROM()
+// Build the changes of the profile fields of From from profileBase into Delta - returns the number of bytes used
+// A run is extended over unchanged bytes as long as that is cheaper than starting a new run
+uint16_t buildProfileDelta(const mySettings &From, byte *Delta)
 {
-  // Write the user settings to the EEPROM
+  uint16_t Length = 0;
+  Delta[Length++] = profileBaseCrc & 0xFF;
+  Delta[Length++] = profileBaseCrc >> 8;
+  for (byte f = 0; f < sizeof(ProfileFields) / sizeof(ProfileFields[0]); f++)
+  {
+    uint16_t End = ProfileFields[f].Offset + ProfileFields[f].Length;
+    uint16_t i = ProfileFields[f].Offset;
+    while (i < End)
+    {
+      if (From.data[i] == profileBase.data[i])
+      {
+        i++;
+        continue;
+      }
+      uint16_t Start = i;
+      uint16_t RunEnd = i + 1; // One past the last changed byte of the run
+      for (i = Start + 1; i < End && i - Start < 255 && i - RunEnd < PROFILE_RUN_HEADER; i++)
+        if (From.data[i] != profileBase.data[i])
+          RunEnd = i + 1;
+      i = RunEnd;
+      Delta[Length++] = Start & 0xFF;
+      Delta[Length++] = Start >> 8;
+      Delta[Length++] = RunEnd - Start;
+      memcpy(&Delta[Length], &From.data[Start], RunEnd - Start);
+      Length += RunEnd - Start;
+    }
+  }
+  return Length;
+}
+
+// Set the profile fields of To to profileBase with the changes in Delta - returns false if Delta is not valid or was built from another profileBase
+bool applyProfileDelta(mySettings &To, const byte *Delta, uint16_t Length)
+{
+  if (Length < PROFILE_BASE_CRC || (Delta[0] | (Delta[1] << 8)) != profileBaseCrc)
+    return false;
+  for (byte f = 0; f < sizeof(ProfileFields) / sizeof(ProfileFields[0]); f++)
+    memcpy(&To.data[ProfileFields[f].Offset], &profileBase.data[ProfileFields[f].Offset], ProfileFields[f].Length);
+
+  for (uint16_t i = PROFILE_BASE_CRC; i < Length;)
+  {
+    if (i + PROFILE_RUN_HEADER > Length)
+      return false;
+    uint16_t Offset = Delta[i] | (Delta[i + 1] << 8);
+    byte RunLength = Delta[i + 2];
+    i += PROFILE_RUN_HEADER;
+    if (i + RunLength > Length)
+      return false;
+    // Only profile fields may be changed
+    bool InField = false;
+    for (byte f = 0; f < sizeof(ProfileFields) / sizeof(ProfileFields[0]); f++)
+      if (Offset >= ProfileFields[f].Offset && Offset + RunLength <= ProfileFields[f].Offset + ProfileFields[f].Length)
+        InField = true;
+    if (!InField)
+      return false;
+    memcpy(&To.data[Offset], &Delta[i], RunLength);
+    i += RunLength;
+  }
+  return true;
+}
+
+// Read the changes of profile Number (1 - PROFILE_COUNT) from EEPROM - returns false if the profile has not been saved
+bool readProfileFromEEPROM(byte Number, byte *Delta, uint16_t &Length)
+{
+  if (Number < 1 || Number > PROFILE_COUNT)
+    return false;
+  uint16_t SchemaVersion;
+  uint16_t Sequence; // Not used - a profile has one slot
+  xSemaphoreTake(eepromMutex, portMAX_DELAY);
+  bool Valid = readRecordFromEEPROM(EEPROM_PROFILES_ADDRESS + (Number - 1) * PROFILE_SLOT_SIZE, Delta, PROFILE_MAX_DELTA, SchemaVersion, Length, Sequence);
+  xSemaphoreGive(eepromMutex);
+  // The offsets of the changes are only valid with the layout of the profile fields they were saved with
+  return Valid && SchemaVersion == PROFILE_SCHEMA_VERSION && Length <= PROFILE_MAX_DELTA;
+}
+
+// Write the profile fields of From to EEPROM as profile Number - done right away as the user has chosen to save them
+void writeProfileToEEPROM(byte Number, const mySettings &From)
+{
+  byte Delta[PROFILE_MAX_DELTA];
+  uint16_t Length = buildProfileDelta(From, Delta);
+  xSemaphoreTake(eepromMutex, portMAX_DELAY);
+  if (!writeRecordToEEPROM(EEPROM_PROFILES_ADDRESS + (Number - 1) * PROFILE_SLOT_SIZE, Delta, NULL, Length, PROFILE_SCHEMA_VERSION, 0))
+    debugln("Writing profile to EEPROM failed");
+  xSemaphoreGive(eepromMutex);
+  debug("Profile ");
+  debug(Number);
+  debug(" saved - bytes of changes: ");
+  debugln(Length);
+}
+
+bool profileExists(byte Number)
+{
+  byte Delta[PROFILE_MAX_DELTA];
+  uint16_t Length;
+  mySettings Profile;
+  return readProfileFromEEPROM(Number, Delta, Length) && applyProfileDelta(Profile, Delta, Length);
+}
+
+// Save the current settings as profile Number (1 - PROFILE_COUNT)
+void saveProfile(byte Number)
+{
+  writeProfileToEEPROM(Number, Settings);
+  setActiveProfile(Number);
+}
+
+// Set the profile loaded or saved last - it is part of the state of the REST API, so stateVersion (its ETag) is changed with it
+void setActiveProfile(byte Number)
+{
+  if (Number == activeProfile)
+    return;
+  activeProfile = Number;
+  markStateDirty(0); // Not in the state sent to the web clients
+}
+
+// Load profile Number (1 - PROFILE_COUNT) - the changed settings take effect right away without a restart, and only the changed pages of Settings are written to the EEPROM
+// Returns false if the profile has not been saved
+bool loadProfile(byte Number)
+{
+  byte Delta[PROFILE_MAX_DELTA];
+  uint16_t Length;
+  if (!readProfileFromEEPROM(Number, Delta, Length))
+    return false;
+  mySettings Profile = Settings; // The settings that are not part of a profile are kept
+  if (!applyProfileDelta(Profile, Delta, Length))
+    return false;
+  setActiveProfile(Number);
+  applySettings(Profile);
+  return true;
+}
+
+// Make changed settings take effect right away without a restart - only what has changed is applied, and only the changed pages of Settings
+// are written to the EEPROM. Used when a profile is loaded and when the settings are changed from the REST API
+void applySettings(const mySettings &New)
+{
+  if (memcmp(New.data, Settings.data, sizeof(Settings)) == 0)
+    return;
+
+  bool Trigger1Changed = New.Trigger1Active != Settings.Trigger1Active || New.Trigger1Type != Settings.Trigger1Type;
+  bool Trigger2Changed = New.Trigger2Active != Settings.Trigger2Active || New.Trigger2Type != Settings.Trigger2Type;
+  if (appMode == APP_NORMAL_MODE)
+  {
+    // Release the triggers as they are set up now before they are changed
+    if (Trigger1Changed)
+      setTrigger1Off();
+    if (Trigger2Changed)
+      setTrigger2Off();
+  }
+  Settings = New;
+  markSettingsDirty();
+  updateADCScale();
+
+  if (appMode == APP_NORMAL_MODE)
+  {
+    if (Trigger1Changed)
+      setTrigger1On();
+    if (Trigger2Changed)
+      setTrigger2On();
+    oled.backlight((Settings.DisplayOnLevel + 1) * 64 - 1);
+    // Set the volume again as the volume steps, attenuation and limits of the input may have changed - or select another input if this one is not active any more
+    if (Settings.Input[RuntimeSettings.CurrentInput].Active == INPUT_INACTIVATED)
+      setNextInput();
+    else
+      setVolume(RuntimeSettings.CurrentVolume);
+    toAppNormalMode();
+  }
+  markStateDirty(STATE_ALL);
+}
+
+// Load the next saved profile after the active one - KEY_PROFILE
+void loadNextProfile()
+{
+  byte Number = activeProfile;
+  for (byte i = 0; i < PROFILE_COUNT; i++)
+  {
+    Number = (Number >= PROFILE_COUNT) ? 1 : Number + 1;
+    if (loadProfile(Number))
+    {
+      oled.clear();
+      oled.setCursor(0, 1);
+      oled.print(F("Profile "));
+      oled.print(Number);
+      delay(1000);
+      toAppNormalMode();
+      return;
+    }
+  }
+  oled.clear();
+  oled.setCursor(0, 1);
+  oled.print(F("No profiles saved"));
+  delay(1000);
+  toAppNormalMode();
+}
+
+// Read the base the profiles are stored as changes from - the first time the default settings are written as the base - and move the user
+// settings saved by an older firmware to profile 1. Called once from setup() after the settings are read
+void setupProfiles()
+{
+  mySettings Current = Settings;
+  if (!readProfileBaseFromEEPROM())
+  {
+    setSettingsToDefault();
+    profileBase = Settings;
+    Settings = Current;
+    writeProfileBaseToEEPROM();
+  }
+
+  for (byte Number = 1; Number <= PROFILE_COUNT; Number++)
+    if (profileExists(Number))
+      return;
+
+  uint16_t SchemaVersion;
+  uint16_t StoredLength;
+  uint16_t Sequence;
+  xSemaphoreTake(eepromMutex, portMAX_DELAY);
+  bool Valid = readRecordFromEEPROM(EEPROM_USER_SETTINGS_ADDRESS, Current.data, sizeof(Current), SchemaVersion, StoredLength, Sequence);
+  xSemaphoreGive(eepromMutex);
+  if (Valid && migrateSettings(SchemaVersion))
+  {
+    debugln("Moving the user settings to profile 1");
+    writeProfileToEEPROM(1, Current);
+  }
+}
+
+// Mark data as changed - it is written by serviceEEPROM when there have been no changes for EEPROM_FLUSH_DELAY
+void markEEPROMDirty(byte Dirty)
+{
+  portENTER_CRITICAL(&eepromDirtyMux);
+  eepromDirty |= Dirty;
+  mil_EEPROMDirty = millis();
+  if (Dirty & EEPROM_DIRTY_SETTINGS)
+    settingsVersion++;
+  portEXIT_CRITICAL(&eepromDirtyMux);
+}
+
+void markSettingsDirty()
+{
+  markEEPROMDirty(EEPROM_DIRTY_SETTINGS);
+}
+
+void markRuntimeSettingsDirty()
+{
+  markEEPROMDirty(EEPROM_DIRTY_RUNTIME_SETTINGS);
+}
+
+void markIRBindingsDirty()
+{
+  markEEPROMDirty(EEPROM_DIRTY_IR_BINDINGS);
+}
+
+// Write the dirty data now - from loop() it is written right away, from other tasks (the web server) it is written by the next call of
+// serviceEEPROM from loop(). If Wait is true, return when it has been written
+void flushEEPROM(bool Wait)
+{
+  eepromFlushRequested = true;
+  if (xTaskGetCurrentTaskHandle() == eepromWriterTask)
+  {
+    serviceEEPROM();
+    return;
+  }
+  while (Wait)
+  {
+    // serviceEEPROM clears the dirty flags while holding eepromMutex, so the data has been written when they are cleared and the mutex is free
+    xSemaphoreTake(eepromMutex, portMAX_DELAY);
+    Wait = (eepromDirty != 0);
+    xSemaphoreGive(eepromMutex);
+    if (Wait)
+      delay(10);
+  }
+}
+
+// Write the dirty data if there have been no changes for EEPROM_FLUSH_DELAY or a flush has been requested - called from loop()
+void serviceEEPROM()
+{
+  if (!eepromFlushRequested && millis() - mil_EEPROMCheck < EEPROM_FLUSH_CHECK_INTERVAL)
+    return;
+  mil_EEPROMCheck = millis();
+  if (powerFailed)
+    return;
+
+  portENTER_CRITICAL(&eepromDirtyMux);
+  bool Due = eepromDirty && (eepromFlushRequested || millis() - mil_EEPROMDirty >= EEPROM_FLUSH_DELAY);
+  eepromFlushRequested = false;
+  portEXIT_CRITICAL(&eepromDirtyMux);
+
+  xSemaphoreTake(eepromMutex, portMAX_DELAY);
+  if (Due)
+  {
+    portENTER_CRITICAL(&eepromDirtyMux);
+    byte Dirty = eepromDirty;
+    eepromDirty = 0;
+    portEXIT_CRITICAL(&eepromDirtyMux);
+    if (Dirty & EEPROM_DIRTY_SETTINGS)
+      writeSettingsToEEPROM();
+    if ((Dirty & EEPROM_DIRTY_RUNTIME_SETTINGS) && !powerFailed)
+      writeRuntimeSettingsToEEPROM();
+    if (Dirty & EEPROM_DIRTY_IR_BINDINGS)
+      writeIRBindingsToEEPROM();
+    if (powerFailed)
+    {
+      // Abandoned to leave the bus to powerFailTask - write it all again if the power comes back
+      portENTER_CRITICAL(&eepromDirtyMux);
+      eepromDirty |= Dirty;
+      portEXIT_CRITICAL(&eepromDirtyMux);
+    }
+  }
+#ifdef POWER_FAIL_PIN
+  // Keep a record of the current runtime settings ready for powerFailTask
+  runtimeJournal.prepare(RuntimeSettings.data, sizeof(RuntimeSettings));
+#endif
+  xSemaphoreGive(eepromMutex);
+}
+
+// Start the EEPROM - called from setup(), which runs in the same task as loop()
+void setupEEPROM()
+{
+  // Only done once - the clock of the I2C bus is set to 400 kHz for the display and relay controller as well
   eeprom.begin(extEEPROM::twiClock400kHz);
-  eeprom.write(sizeof(Settings) + sizeof(RuntimeSettings) + 1, Settings.data, sizeof(Settings));
+  eepromMutex = xSemaphoreCreateMutex();
+  eepromWriterTask = xTaskGetCurrentTaskHandle();
+}
+
+// Power fail detection ------------------------------------------------------------------------------------
+// With a comparator monitoring the unregulated supply (before the 3.3 V regulator) connected to POWER_FAIL_PIN - pulling it LOW when the
+// supply drops - the runtime settings are saved the moment the power fails. serviceEEPROM keeps a journal record of the current runtime
+// settings ready (see EEPROMJournal::prepare) and the interrupt from POWER_FAIL_PIN wakes a task with the highest priority that writes it:
+// a single page write of ~1 ms on the I2C bus plus the 5 ms write cycle of the EEPROM, which must be done within the hold-up time of the
+// power supply. The time it took is saved to the EEPROM afterwards and shown in the debug output at the next startup.
+// A write started by serviceEEPROM is abandoned after the page being written (see writeEEPROMPage), so eepromMutex is free within one write
+// cycle. The display and the relay controller may still be used from loop() - the Wire library locks the bus for each transmission.
+// #define POWER_FAIL_PIN 39           // Uncomment and set to the GPIO the comparator is connected to - or build with env:nodemcu-32s-powerfail
+#define POWER_FAIL_HOLDUP_TIME 20000    // Microseconds the supply is known to keep the controller running after POWER_FAIL_PIN goes LOW (measure it for your power supply)
+#define POWER_FAIL_MUTEX_TIMEOUT 10     // Milliseconds to wait for the page being written by serviceEEPROM - the EEPROM is not used if it is not free by then
+#define POWER_FAIL_LOG_MAGIC 0x4C465750 // "PWFL"
+
+typedef struct
+{
+  uint32_t Magic;        // POWER_FAIL_LOG_MAGIC
+  uint32_t Count;        // Number of power fails logged
+  uint32_t WaitMicros;   // Microseconds from the interrupt until the write of the runtime settings started
+  uint32_t WriteMicros;  // Microseconds the write of the runtime settings took
+  uint8_t Written;       // 1 if the runtime settings were written
+} PowerFailLog;
+static_assert(sizeof(PowerFailLog) <= EEPROM_PAGE_SIZE, "The power fail log must fit in one page");
+
+#ifdef POWER_FAIL_PIN
+PowerFailLog powerFailLog;              // The last log - read at startup
+volatile unsigned long powerFailMicros; // micros() at the interrupt from POWER_FAIL_PIN
+TaskHandle_t powerFailTaskHandle;
+
+void IRAM_ATTR powerFailISR()
+{
+  powerFailMicros = micros();
+  BaseType_t HigherPriorityTaskWoken = pdFALSE;
+  vTaskNotifyGiveFromISR(powerFailTaskHandle, &HigherPriorityTaskWoken);
+  portYIELD_FROM_ISR(HigherPriorityTaskWoken);
+}
+
+void powerFailTask(void *parameter)
+{
+  for (;;)
+  {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    powerFailed = true;
+
+    // Wait for the page being written by serviceEEPROM - the EEPROM is never used without eepromMutex, so if it is not free in time
+    // (something is wrong) the runtime settings are not written and that is logged instead
+    bool Locked = xSemaphoreTake(eepromMutex, pdMS_TO_TICKS(POWER_FAIL_MUTEX_TIMEOUT)) == pdTRUE;
+    unsigned long Start = micros();
+    bool Written = Locked && runtimeJournal.writePrepared();
+    unsigned long End = micros();
+
+    // Log the timing - if the power lasts long enough
+    if (!Locked)
+      xSemaphoreTake(eepromMutex, portMAX_DELAY);
+    powerFailLog.Magic = POWER_FAIL_LOG_MAGIC;
+    powerFailLog.Count++;
+    powerFailLog.WaitMicros = Start - powerFailMicros;
+    powerFailLog.WriteMicros = End - Start;
+    powerFailLog.Written = Written;
+    eeprom.write(EEPROM_POWER_FAIL_LOG_ADDRESS, (byte *)&powerFailLog, sizeof(powerFailLog));
+    xSemaphoreGive(eepromMutex);
+
+    // Still running - it was only a dip in the supply. Carry on when it is back
+    while (digitalRead(POWER_FAIL_PIN) == LOW)
+      delay(100);
+    debug("Power fail - runtime settings written in ");
+    debug(powerFailLog.WaitMicros + powerFailLog.WriteMicros);
+    debugln(" us");
+    powerFailed = false;
+  }
+}
+#endif
+
+// Start the power fail detection (if POWER_FAIL_PIN is defined) - called after the settings have been read
+void setupPowerFailDetection()
+{
+#ifdef POWER_FAIL_PIN
+  xSemaphoreTake(eepromMutex, portMAX_DELAY);
+  if (eeprom.read(EEPROM_POWER_FAIL_LOG_ADDRESS, (byte *)&powerFailLog, sizeof(powerFailLog)) != 0 || powerFailLog.Magic != POWER_FAIL_LOG_MAGIC)
+    memset(&powerFailLog, 0, sizeof(powerFailLog));
+  xSemaphoreGive(eepromMutex);
+  if (powerFailLog.Count > 0)
+  {
+    debug("Last power fail: runtime settings ");
+    debug(powerFailLog.Written ? "written " : "NOT written ");
+    debug(powerFailLog.WaitMicros);
+    debug(" us after detection, write took ");
+    debug(powerFailLog.WriteMicros);
+    debug(" us - ");
+    debugln((powerFailLog.WaitMicros + powerFailLog.WriteMicros < POWER_FAIL_HOLDUP_TIME) ? "within the hold-up time" : "LONGER THAN THE HOLD-UP TIME");
+  }
+
+  pinMode(POWER_FAIL_PIN, INPUT);
+  xTaskCreatePinnedToCore(powerFailTask, "PowerFail", 2048, NULL, configMAX_PRIORITIES - 1, &powerFailTaskHandle, 0);
+  attachInterrupt(digitalPinToInterrupt(POWER_FAIL_PIN), powerFailISR, FALLING);
+#endif
 }
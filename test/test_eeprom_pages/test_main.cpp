@@ -0,0 +1,147 @@
+/*
+**
+** Host tests of EEPROMPages for MezmerizeB1Buffer - run with "pio test -e native"
+**
+** Copyright (c) 2023 Carsten Grønning, Jan Abkjer Tofft
+**
+** Counts the page writes done when Settings are saved after a single edit in the menu. The offsets are the ones of mySettings in main.cpp
+** (see the static_assert of its layout) and the data of the record starts on a page of its own, as in writeRecordToEEPROM.
+**
+*/
+
+#include <unity.h>
+#include <string.h>
+#include <EEPROMPages.h>
+
+#define PAGE_SIZE 32
+#define SETTINGS_SIZE 316
+#define SETTINGS_DATA_ADDRESS PAGE_SIZE // After the page with the record header
+
+// Offsets in mySettings
+#define OFFSET_VOLUME_STEPS 98
+#define OFFSET_IR_UP 114   // IRMP_DATA of 6 bytes
+#define OFFSET_INPUT 204   // 6 x InputSettings of 14 bytes: Active, Name[11], MaxVol, MinVol
+#define OFFSET_DISPLAY_TIMEOUT 301
+
+static uint8_t eeprom[4096];
+static uint32_t writeCalls;
+static uint32_t failAfter; // Number of writes that succeed before the writes fail
+
+static bool fakeWrite(uint16_t Address, const uint8_t *Data, uint16_t Length)
+{
+  // A write may never cross a page boundary
+  TEST_ASSERT_TRUE(Address / PAGE_SIZE == (Address + Length - 1) / PAGE_SIZE);
+  if (writeCalls >= failAfter)
+    return false;
+  writeCalls++;
+  memcpy(&eeprom[Address], Data, Length);
+  return true;
+}
+
+static uint8_t settings[SETTINGS_SIZE];
+static uint8_t saved[SETTINGS_SIZE];
+
+void setUp(void)
+{
+  memset(eeprom, 0xFF, sizeof(eeprom));
+  for (uint16_t i = 0; i < SETTINGS_SIZE; i++)
+    settings[i] = i * 7;
+  writeCalls = 0;
+  failAfter = 0xFFFFFFFF;
+  // The settings are in the EEPROM
+  uint32_t Pages = 0;
+  writeChangedPages(SETTINGS_DATA_ADDRESS, settings, NULL, SETTINGS_SIZE, PAGE_SIZE, fakeWrite, Pages);
+  memcpy(saved, settings, SETTINGS_SIZE);
+  writeCalls = 0;
+}
+
+void tearDown(void)
+{
+}
+
+// Save the settings and return the number of pages written
+static uint32_t save()
+{
+  uint32_t Pages = 0;
+  TEST_ASSERT_TRUE(writeChangedPages(SETTINGS_DATA_ADDRESS, settings, saved, SETTINGS_SIZE, PAGE_SIZE, fakeWrite, Pages));
+  TEST_ASSERT_EQUAL_UINT32(writeCalls, Pages);
+  TEST_ASSERT_EQUAL_MEMORY(settings, &eeprom[SETTINGS_DATA_ADDRESS], SETTINGS_SIZE);
+  TEST_ASSERT_EQUAL_MEMORY(settings, saved, SETTINGS_SIZE);
+  return Pages;
+}
+
+void test_unchanged_settings_write_nothing(void)
+{
+  TEST_ASSERT_EQUAL_UINT32(0, save());
+}
+
+void test_option_edit_is_one_page(void)
+{
+  settings[OFFSET_DISPLAY_TIMEOUT]++;
+  TEST_ASSERT_EQUAL_UINT32(1, save());
+}
+
+void test_numeric_edit_is_one_page(void)
+{
+  settings[OFFSET_VOLUME_STEPS] = 60;
+  TEST_ASSERT_EQUAL_UINT32(1, save());
+}
+
+void test_ir_code_edit_is_one_page(void)
+{
+  memset(&settings[OFFSET_IR_UP], 0x5A, 6);
+  TEST_ASSERT_EQUAL_UINT32(1, save());
+}
+
+void test_input_name_across_a_page_boundary_is_two_pages(void)
+{
+  // The name of input 2 is at 219 - 229, across the page boundary at 224
+  memcpy(&settings[OFFSET_INPUT + 14 + 1], "Streamer  ", 10);
+  TEST_ASSERT_EQUAL_UINT32(2, save());
+}
+
+void test_full_write_when_nothing_is_saved(void)
+{
+  uint32_t Pages = 0;
+  TEST_ASSERT_TRUE(writeChangedPages(SETTINGS_DATA_ADDRESS, settings, NULL, SETTINGS_SIZE, PAGE_SIZE, fakeWrite, Pages));
+  TEST_ASSERT_EQUAL_UINT32((SETTINGS_SIZE + PAGE_SIZE - 1) / PAGE_SIZE, Pages);
+}
+
+void test_unaligned_start_is_split_at_page_boundaries(void)
+{
+  uint8_t Data[40];
+  memset(Data, 0x11, sizeof(Data));
+  uint32_t Pages = 0;
+  // 10 bytes to the end of the first page, then 30 bytes
+  TEST_ASSERT_TRUE(writeChangedPages(PAGE_SIZE * 10 + 22, Data, NULL, sizeof(Data), PAGE_SIZE, fakeWrite, Pages));
+  TEST_ASSERT_EQUAL_UINT32(2, Pages);
+}
+
+void test_failed_write_stops_and_is_retried(void)
+{
+  settings[0]++;
+  settings[OFFSET_DISPLAY_TIMEOUT]++;
+  failAfter = 1; // The second page fails
+  uint32_t Pages = 0;
+  TEST_ASSERT_FALSE(writeChangedPages(SETTINGS_DATA_ADDRESS, settings, saved, SETTINGS_SIZE, PAGE_SIZE, fakeWrite, Pages));
+  TEST_ASSERT_EQUAL_UINT32(1, Pages);
+  TEST_ASSERT_TRUE(saved[OFFSET_DISPLAY_TIMEOUT] != settings[OFFSET_DISPLAY_TIMEOUT]); // Not marked as written
+
+  failAfter = 0xFFFFFFFF;
+  writeCalls = 0;
+  TEST_ASSERT_EQUAL_UINT32(1, save()); // Only the page that failed
+}
+
+int main()
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_unchanged_settings_write_nothing);
+  RUN_TEST(test_option_edit_is_one_page);
+  RUN_TEST(test_numeric_edit_is_one_page);
+  RUN_TEST(test_ir_code_edit_is_one_page);
+  RUN_TEST(test_input_name_across_a_page_boundary_is_two_pages);
+  RUN_TEST(test_full_write_when_nothing_is_saved);
+  RUN_TEST(test_unaligned_start_is_split_at_page_boundaries);
+  RUN_TEST(test_failed_write_stops_and_is_retried);
+  return UNITY_END();
+}
@@ -0,0 +1,95 @@
+/*
+**
+** Host tests of the NTC table for MezmerizeB1Buffer - run with "pio test -e native"
+**
+** Copyright (c) 2023 Carsten Grønning, Jan Abkjer Tofft
+**
+*/
+
+#include <unity.h>
+#include <math.h>
+#include <NTCTable.h>
+
+// The NTC and reference resistor of main.cpp
+#define NTC_R25 4700
+#define NTC_BETA 3977
+#define NTC_RREF 2200
+
+#define CODE_MAX (4095 << NTC_OVERSAMPLE_BITS)
+
+static NTCTable table;
+
+// The temperature in degrees Celcius of a code with NTC_OVERSAMPLE_BITS extra bits, calculated with the Beta equation
+static double betaTemperature(uint32_t Code)
+{
+  double Ratio = (double)Code / CODE_MAX;
+  double Rntc = NTC_RREF * Ratio / (1 - Ratio);
+  return 1 / (1 / 298.15 + log(Rntc / NTC_R25) / NTC_BETA) - 273.15;
+}
+
+// The code at which the Beta equation gives Temp
+static uint32_t betaCode(double Temp)
+{
+  double Rntc = NTC_R25 * exp(NTC_BETA * (1 / (Temp + 273.15) - 1 / 298.15));
+  return round(CODE_MAX * Rntc / (Rntc + NTC_RREF));
+}
+
+void setUp(void)
+{
+  table.build(NTC_R25, NTC_BETA, NTC_RREF);
+}
+
+void tearDown(void)
+{
+}
+
+void test_matches_the_beta_equation(void)
+{
+  // Every code within 1 - 95 degrees, where the interpolation error is small compared to the 1/10 degrees displayed
+  for (uint32_t Code = betaCode(95); Code <= betaCode(1); Code++)
+    TEST_ASSERT_FLOAT_WITHIN(0.05, betaTemperature(Code), table.temperature(Code) / 100.0);
+}
+
+void test_known_temperatures(void)
+{
+  // At 25 degrees the NTC is R25
+  TEST_ASSERT_INT_WITHIN(2, 2500, table.temperature(betaCode(25)));
+  TEST_ASSERT_INT_WITHIN(2, 5000, table.temperature(betaCode(50)));
+  TEST_ASSERT_INT_WITHIN(2, 8500, table.temperature(betaCode(85)));
+}
+
+void test_temperature_falls_with_the_code(void)
+{
+  int16_t Previous = table.temperature(0);
+  for (uint32_t Code = 1; Code <= CODE_MAX; Code++)
+  {
+    int16_t Temp = table.temperature(Code);
+    TEST_ASSERT_TRUE(Temp <= Previous);
+    Previous = Temp;
+  }
+}
+
+void test_limits(void)
+{
+  // A shorted NTC reads as the highest temperature, a missing one as the lowest
+  TEST_ASSERT_EQUAL_INT16(9900, table.temperature(0));
+  TEST_ASSERT_EQUAL_INT16(0, table.temperature(CODE_MAX));
+  // Codes above 12 bits (possible after the calibration is applied) are the last entry of the table
+  TEST_ASSERT_EQUAL_INT16(0, table.temperature(CODE_MAX + 1000));
+  TEST_ASSERT_EQUAL_INT16(0, table.temperature(0xFFFFFFFF));
+  for (uint32_t Code = 0; Code <= CODE_MAX; Code += 7)
+  {
+    TEST_ASSERT_TRUE(table.temperature(Code) >= 0);
+    TEST_ASSERT_TRUE(table.temperature(Code) <= 9900);
+  }
+}
+
+int main()
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_matches_the_beta_equation);
+  RUN_TEST(test_known_temperatures);
+  RUN_TEST(test_temperature_falls_with_the_code);
+  RUN_TEST(test_limits);
+  return UNITY_END();
+}
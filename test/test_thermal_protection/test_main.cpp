@@ -0,0 +1,166 @@
+/*
+**
+** Host tests of the over-temperature protection for MezmerizeB1Buffer - run with "pio test -e native"
+**
+** Copyright (c) 2023 Carsten Grønning, Jan Abkjer Tofft
+**
+*/
+
+#include <unity.h>
+#include <ThermalProtection.h>
+
+#define TRIP_TEMP 80.0f
+#define WARNING_MARGIN 10.0f
+#define HYSTERESIS 3.0f
+#define MAX_RISE_RATE 30.0f // Degrees per minute
+#define RISE_RATE_MARGIN 20.0f
+
+static ThermalProtection protection;
+static uint32_t now;
+
+// Feed Count samples one second apart, going linearly from From to To, and return the last state
+static ThermalProtection::State feed(float From, float To, uint16_t Count)
+{
+  ThermalProtection::State State = protection.state();
+  for (uint16_t i = 0; i < Count; i++)
+  {
+    now += 1000;
+    State = protection.update(Count > 1 ? From + (To - From) * i / (Count - 1) : To, now);
+  }
+  return State;
+}
+
+void setUp(void)
+{
+  protection = ThermalProtection();
+  protection.configure(TRIP_TEMP, WARNING_MARGIN, HYSTERESIS, MAX_RISE_RATE, RISE_RATE_MARGIN);
+  now = 0;
+}
+
+void tearDown(void)
+{
+}
+
+void test_normal_below_the_warning_stage(void)
+{
+  TEST_ASSERT_EQUAL(ThermalProtection::NORMAL, feed(40, 40, 20));
+  // 15 degrees per minute up to just below the warning level
+  TEST_ASSERT_EQUAL(ThermalProtection::NORMAL, feed(40, 69.9f, 121));
+  TEST_ASSERT_EQUAL(ThermalProtection::NORMAL, feed(40, 40, 20));
+  TEST_ASSERT_FLOAT_WITHIN(0.01f, 0, protection.riseRate());
+}
+
+void test_warning_stage(void)
+{
+  TEST_ASSERT_EQUAL(ThermalProtection::NORMAL, feed(60, 60, 20));
+  // 10 degrees per minute
+  TEST_ASSERT_EQUAL(ThermalProtection::NORMAL, feed(60, 69.9f, 60));
+  TEST_ASSERT_EQUAL(ThermalProtection::WARNING, feed(70, 70, 1));
+  TEST_ASSERT_EQUAL(ThermalProtection::WARNING, feed(70, 79.9f, 60));
+}
+
+void test_warning_hysteresis(void)
+{
+  feed(70, 70, 20);
+  TEST_ASSERT_EQUAL(ThermalProtection::WARNING, protection.state());
+  // Below the warning level, but within the hysteresis
+  TEST_ASSERT_EQUAL(ThermalProtection::WARNING, feed(69, 69, 1));
+  TEST_ASSERT_EQUAL(ThermalProtection::WARNING, feed(67.1f, 67.1f, 1));
+  // Below the hysteresis
+  TEST_ASSERT_EQUAL(ThermalProtection::NORMAL, feed(66.9f, 66.9f, 1));
+  // Rising again within the hysteresis stays NORMAL until the warning level
+  TEST_ASSERT_EQUAL(ThermalProtection::NORMAL, feed(69, 69, 1));
+  TEST_ASSERT_EQUAL(ThermalProtection::WARNING, feed(70, 70, 1));
+}
+
+void test_trip_at_the_limit(void)
+{
+  feed(75, 75, 20);
+  TEST_ASSERT_EQUAL(ThermalProtection::TRIPPED, feed(80, 80, 1));
+  TEST_ASSERT_FALSE(protection.trippedByRate());
+  TEST_ASSERT_EQUAL_UINT32(now, protection.trippedAt());
+  // Stays tripped when cooling down - only reset() leaves TRIPPED
+  TEST_ASSERT_EQUAL(ThermalProtection::TRIPPED, feed(80, 30, 20));
+}
+
+void test_rate_of_rise_trip(void)
+{
+  // 40 degrees per minute from 50 - the trip happens when the rate is known and the temperature is above 60
+  feed(50, 50, 20);
+  ThermalProtection::State State = protection.state();
+  float Temp = 50;
+  while (State != ThermalProtection::TRIPPED && Temp < TRIP_TEMP)
+  {
+    Temp += 40.0f / 60;
+    State = feed(Temp, Temp, 1);
+  }
+  TEST_ASSERT_EQUAL(ThermalProtection::TRIPPED, State);
+  TEST_ASSERT_TRUE(protection.trippedByRate());
+  TEST_ASSERT_TRUE(Temp >= TRIP_TEMP - RISE_RATE_MARGIN);
+  TEST_ASSERT_TRUE(Temp < TRIP_TEMP - WARNING_MARGIN);
+  TEST_ASSERT_FLOAT_WITHIN(0.5f, 40, protection.riseRate());
+}
+
+void test_fast_rise_below_the_rate_margin_does_not_trip(void)
+{
+  // 40 degrees per minute, but below TripTemp - RiseRateMargin
+  TEST_ASSERT_EQUAL(ThermalProtection::NORMAL, feed(30, 30 + 40.0f * 29 / 60, 30));
+  TEST_ASSERT_TRUE(protection.riseRate() > MAX_RISE_RATE);
+}
+
+void test_slow_rise_does_not_trip_by_rate(void)
+{
+  // 20 degrees per minute up to the warning level
+  TEST_ASSERT_EQUAL(ThermalProtection::WARNING, feed(60, 70, 31));
+  TEST_ASSERT_FALSE(protection.trippedByRate());
+  TEST_ASSERT_FLOAT_WITHIN(0.5f, 20, protection.riseRate());
+}
+
+void test_rate_needs_all_samples(void)
+{
+  // A jump right after the start is not a rate of rise - there are not enough samples yet
+  feed(60, 60, 1);
+  TEST_ASSERT_EQUAL(ThermalProtection::NORMAL, feed(65, 65, 1));
+  TEST_ASSERT_FLOAT_WITHIN(0.01f, 0, protection.riseRate());
+}
+
+void test_reset(void)
+{
+  TEST_ASSERT_TRUE(protection.reset()); // Nothing to reset
+
+  feed(80, 80, 1);
+  TEST_ASSERT_EQUAL(ThermalProtection::TRIPPED, protection.state());
+  // Refused until the temperature is below TripTemp - Hysteresis
+  TEST_ASSERT_FALSE(protection.reset());
+  feed(77.1f, 77.1f, 1);
+  TEST_ASSERT_FALSE(protection.reset());
+  TEST_ASSERT_EQUAL(ThermalProtection::TRIPPED, protection.state());
+  feed(76.9f, 76.9f, 1);
+  TEST_ASSERT_TRUE(protection.reset());
+  TEST_ASSERT_EQUAL(ThermalProtection::NORMAL, protection.state());
+  // The next update finds the warning stage
+  TEST_ASSERT_EQUAL(ThermalProtection::WARNING, feed(76.9f, 76.9f, 1));
+}
+
+void test_disabled_protection(void)
+{
+  protection.configure(0, WARNING_MARGIN, HYSTERESIS, MAX_RISE_RATE, RISE_RATE_MARGIN);
+  TEST_ASSERT_EQUAL(ThermalProtection::NORMAL, feed(20, 150, 60));
+  TEST_ASSERT_TRUE(protection.reset());
+}
+
+int main()
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_normal_below_the_warning_stage);
+  RUN_TEST(test_warning_stage);
+  RUN_TEST(test_warning_hysteresis);
+  RUN_TEST(test_trip_at_the_limit);
+  RUN_TEST(test_rate_of_rise_trip);
+  RUN_TEST(test_fast_rise_below_the_rate_margin_does_not_trip);
+  RUN_TEST(test_slow_rise_does_not_trip_by_rate);
+  RUN_TEST(test_rate_needs_all_samples);
+  RUN_TEST(test_reset);
+  RUN_TEST(test_disabled_protection);
+  return UNITY_END();
+}
@@ -0,0 +1,171 @@
+/*
+**
+** Host tests of the web command parser for MezmerizeB1Buffer - run with "pio test -e native"
+**
+** Copyright (c) 2023 Carsten Grønning, Jan Abkjer Tofft
+**
+*/
+
+#include <unity.h>
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <WebCommandParser.h>
+
+#define CMD_VOLUME 0
+#define CMD_INPUT 1
+#define CMD_POWER 2
+#define CMD_GET_VALUES 3
+
+// The same kinds of verbs as webCommands in main.cpp
+static const WebCommandVerb verbs[] = {
+    {"Volume", CMD_VOLUME, WEB_ARG_UP | WEB_ARG_DOWN | WEB_ARG_NUMBER, 0, 255},
+    {"Input", CMD_INPUT, WEB_ARG_UP | WEB_ARG_DOWN | WEB_ARG_NUMBER, 1, 6},
+    {"Power", CMD_POWER, WEB_ARG_ON | WEB_ARG_STANDBY | WEB_ARG_TOGGLE, 0, 0},
+    {"getValues", CMD_GET_VALUES, WEB_ARG_NONE, 0, 0}};
+
+static WebCommand command;
+
+// Parse the command in the string (without its terminating zero)
+static WebCommandResult parse(const char *text)
+{
+  return parseWebCommand((const uint8_t *)text, strlen(text), verbs, sizeof(verbs) / sizeof(verbs[0]), command);
+}
+
+void setUp(void)
+{
+  memset(&command, 0xFF, sizeof(command));
+}
+
+void tearDown(void)
+{
+}
+
+void test_valid_commands(void)
+{
+  TEST_ASSERT_EQUAL(WEB_CMD_OK, parse("Volume:Up"));
+  TEST_ASSERT_EQUAL_UINT8(CMD_VOLUME, command.id);
+  TEST_ASSERT_EQUAL_UINT8(WEB_ARG_UP, command.argument);
+
+  TEST_ASSERT_EQUAL(WEB_CMD_OK, parse("Volume:42"));
+  TEST_ASSERT_EQUAL_UINT8(WEB_ARG_NUMBER, command.argument);
+  TEST_ASSERT_EQUAL_INT16(42, command.value);
+
+  TEST_ASSERT_EQUAL(WEB_CMD_OK, parse("Input:Down"));
+  TEST_ASSERT_EQUAL_UINT8(CMD_INPUT, command.id);
+  TEST_ASSERT_EQUAL_UINT8(WEB_ARG_DOWN, command.argument);
+
+  TEST_ASSERT_EQUAL(WEB_CMD_OK, parse("Power:Standby"));
+  TEST_ASSERT_EQUAL_UINT8(CMD_POWER, command.id);
+  TEST_ASSERT_EQUAL_UINT8(WEB_ARG_STANDBY, command.argument);
+
+  TEST_ASSERT_EQUAL(WEB_CMD_OK, parse("getValues"));
+  TEST_ASSERT_EQUAL_UINT8(CMD_GET_VALUES, command.id);
+  TEST_ASSERT_EQUAL_UINT8(WEB_ARG_NONE, command.argument);
+}
+
+void test_range_limits_are_accepted(void)
+{
+  TEST_ASSERT_EQUAL(WEB_CMD_OK, parse("Volume:0"));
+  TEST_ASSERT_EQUAL_INT16(0, command.value);
+  TEST_ASSERT_EQUAL(WEB_CMD_OK, parse("Volume:255"));
+  TEST_ASSERT_EQUAL_INT16(255, command.value);
+  TEST_ASSERT_EQUAL(WEB_CMD_OK, parse("Input:1"));
+  TEST_ASSERT_EQUAL(WEB_CMD_OK, parse("Input:6"));
+  TEST_ASSERT_EQUAL(WEB_CMD_OK, parse("Volume:007"));
+  TEST_ASSERT_EQUAL_INT16(7, command.value);
+}
+
+void test_out_of_range_numbers(void)
+{
+  TEST_ASSERT_EQUAL(WEB_CMD_OUT_OF_RANGE, parse("Volume:256"));
+  TEST_ASSERT_EQUAL(WEB_CMD_OUT_OF_RANGE, parse("Volume:-1"));
+  TEST_ASSERT_EQUAL(WEB_CMD_OUT_OF_RANGE, parse("Input:0"));
+  TEST_ASSERT_EQUAL(WEB_CMD_OUT_OF_RANGE, parse("Input:7"));
+  TEST_ASSERT_EQUAL(WEB_CMD_OUT_OF_RANGE, parse("Volume:99999"));
+}
+
+void test_malformed_commands(void)
+{
+  TEST_ASSERT_EQUAL(WEB_CMD_UNKNOWN_VERB, parse(""));
+  TEST_ASSERT_EQUAL(WEB_CMD_UNKNOWN_VERB, parse(":Up"));
+  TEST_ASSERT_EQUAL(WEB_CMD_UNKNOWN_VERB, parse("Balance:Up"));
+  TEST_ASSERT_EQUAL(WEB_CMD_UNKNOWN_VERB, parse("volume:Up")); // Case sensitive
+  TEST_ASSERT_EQUAL(WEB_CMD_UNKNOWN_VERB, parse("Vol"));
+  TEST_ASSERT_EQUAL(WEB_CMD_UNKNOWN_VERB, parse("VolumeX:Up"));
+  TEST_ASSERT_EQUAL(WEB_CMD_BAD_ARGUMENT, parse("Volume"));
+  TEST_ASSERT_EQUAL(WEB_CMD_BAD_ARGUMENT, parse("Volume:"));
+  TEST_ASSERT_EQUAL(WEB_CMD_BAD_ARGUMENT, parse("Volume:-"));
+  TEST_ASSERT_EQUAL(WEB_CMD_BAD_ARGUMENT, parse("Volume:4x"));
+  TEST_ASSERT_EQUAL(WEB_CMD_BAD_ARGUMENT, parse("Volume: 4"));
+  TEST_ASSERT_EQUAL(WEB_CMD_BAD_ARGUMENT, parse("Volume:Up "));
+  TEST_ASSERT_EQUAL(WEB_CMD_BAD_ARGUMENT, parse("Volume:up"));
+  TEST_ASSERT_EQUAL(WEB_CMD_BAD_ARGUMENT, parse("Volume:Toggle")); // A word of another verb
+  TEST_ASSERT_EQUAL(WEB_CMD_BAD_ARGUMENT, parse("Power:1"));
+  TEST_ASSERT_EQUAL(WEB_CMD_BAD_ARGUMENT, parse("getValues:1"));
+  TEST_ASSERT_EQUAL(WEB_CMD_BAD_ARGUMENT, parse("Volume:Up:Up"));
+}
+
+void test_command_is_not_read_beyond_its_length(void)
+{
+  // Only "Volume:4" of the buffer is the command
+  const char *Text = "Volume:42";
+  TEST_ASSERT_EQUAL(WEB_CMD_OK, parseWebCommand((const uint8_t *)Text, 8, verbs, sizeof(verbs) / sizeof(verbs[0]), command));
+  TEST_ASSERT_EQUAL_INT16(4, command.value);
+  TEST_ASSERT_EQUAL(WEB_CMD_UNKNOWN_VERB, parseWebCommand((const uint8_t *)Text, 5, verbs, sizeof(verbs) / sizeof(verbs[0]), command));
+}
+
+void test_oversized_commands(void)
+{
+  // More than 5 digits is not a number, so it can not overflow
+  TEST_ASSERT_EQUAL(WEB_CMD_BAD_ARGUMENT, parse("Volume:000042"));
+  TEST_ASSERT_EQUAL(WEB_CMD_BAD_ARGUMENT, parse("Volume:4294967338"));
+  TEST_ASSERT_EQUAL(WEB_CMD_BAD_ARGUMENT, parse("Volume:-999999"));
+
+  static char Text[4096];
+  memset(Text, '9', sizeof(Text) - 1);
+  Text[sizeof(Text) - 1] = 0;
+  memcpy(Text, "Volume:", 7);
+  TEST_ASSERT_EQUAL(WEB_CMD_BAD_ARGUMENT, parse(Text));
+  memset(Text, 'A', sizeof(Text) - 1);
+  TEST_ASSERT_EQUAL(WEB_CMD_UNKNOWN_VERB, parse(Text));
+  memcpy(Text, "Power:", 6);
+  TEST_ASSERT_EQUAL(WEB_CMD_BAD_ARGUMENT, parse(Text));
+}
+
+// Throughput of a mix of the commands sent by the web page
+void test_benchmark_throughput(void)
+{
+  static const char *Commands[] = {"Volume:Up", "Volume:Down", "Volume:128", "Input:3", "Power:Toggle", "getValues", "Balance:Up", "Volume:4x"};
+  const uint8_t CommandCount = sizeof(Commands) / sizeof(Commands[0]);
+  size_t Lengths[CommandCount];
+  for (uint8_t i = 0; i < CommandCount; i++)
+    Lengths[i] = strlen(Commands[i]);
+
+  const uint32_t Rounds = 200000;
+  uint32_t Accepted = 0;
+  auto Start = std::chrono::steady_clock::now();
+  for (uint32_t r = 0; r < Rounds; r++)
+    for (uint8_t i = 0; i < CommandCount; i++)
+      if (parseWebCommand((const uint8_t *)Commands[i], Lengths[i], verbs, sizeof(verbs) / sizeof(verbs[0]), command) == WEB_CMD_OK)
+        Accepted++;
+  double Seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count();
+
+  TEST_ASSERT_EQUAL_UINT32(Rounds * 6, Accepted);
+  char Message[100];
+  snprintf(Message, sizeof(Message), "%.1f ns per command, %.0f commands/s", Seconds * 1e9 / (Rounds * CommandCount), (Rounds * CommandCount) / Seconds);
+  TEST_MESSAGE(Message);
+}
+
+int main()
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_valid_commands);
+  RUN_TEST(test_range_limits_are_accepted);
+  RUN_TEST(test_out_of_range_numbers);
+  RUN_TEST(test_malformed_commands);
+  RUN_TEST(test_command_is_not_read_beyond_its_length);
+  RUN_TEST(test_oversized_commands);
+  RUN_TEST(test_benchmark_throughput);
+  return UNITY_END();
+}
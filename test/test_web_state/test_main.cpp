@@ -0,0 +1,167 @@
+/*
+**
+** Host tests of the state sent to the web clients for MezmerizeB1Buffer - run with "pio test -e native"
+**
+** Copyright (c) 2023 Carsten Grønning, Jan Abkjer Tofft
+**
+*/
+
+#include <stdlib.h>
+#include <new>
+#include <unity.h>
+#include <WebState.h>
+
+// Every allocation from the heap is counted, so a test can check that none are made
+static volatile unsigned long allocations = 0;
+
+void *operator new(size_t Size)
+{
+  allocations++;
+  void *Pointer = malloc(Size ? Size : 1);
+  if (Pointer == NULL)
+    throw std::bad_alloc();
+  return Pointer;
+}
+
+void *operator new[](size_t Size)
+{
+  return operator new(Size);
+}
+
+void operator delete(void *Pointer) noexcept
+{
+  free(Pointer);
+}
+
+void operator delete[](void *Pointer) noexcept
+{
+  free(Pointer);
+}
+
+void operator delete(void *Pointer, size_t) noexcept
+{
+  free(Pointer);
+}
+
+void operator delete[](void *Pointer, size_t) noexcept
+{
+  free(Pointer);
+}
+
+#ifdef __GLIBC__
+// malloc() itself is only replaceable with glibc - elsewhere just the allocations by new are counted
+extern "C" void *__libc_malloc(size_t);
+extern "C" void *__libc_calloc(size_t, size_t);
+extern "C" void *__libc_realloc(void *, size_t);
+
+extern "C" void *malloc(size_t Size)
+{
+  allocations++;
+  return __libc_malloc(Size);
+}
+
+extern "C" void *calloc(size_t Count, size_t Size)
+{
+  allocations++;
+  return __libc_calloc(Count, Size);
+}
+
+extern "C" void *realloc(void *Pointer, size_t Size)
+{
+  allocations++;
+  return __libc_realloc(Pointer, Size);
+}
+#endif
+
+static char buffer[192]; // As JSON_BUFFER_SIZE in main.cpp
+static char volume_dB[WEB_STATE_DB_SIZE];
+static WebStateValues values;
+
+void setUp(void)
+{
+  formatAttenuation_dB(volume_dB, sizeof(volume_dB), 31, 127);
+  values = WebStateValues();
+  values.OnState = "On";
+  values.Input = "Streamer  ";
+  values.HasVolume = true;
+  values.VolumeSteps = 60;
+  values.Volume = 45;
+  values.Volume_dB = volume_dB;
+  values.HasTemperatures = true;
+  values.Temp1 = 42;
+  values.Temp2 = 38;
+}
+
+void tearDown(void)
+{
+}
+
+void test_attenuation_has_half_dB_steps(void)
+{
+  formatAttenuation_dB(volume_dB, sizeof(volume_dB), 31, 127);
+  TEST_ASSERT_EQUAL_STRING("15.50", volume_dB);
+  formatAttenuation_dB(volume_dB, sizeof(volume_dB), 0, 127);
+  TEST_ASSERT_EQUAL_STRING("0.00", volume_dB);
+  formatAttenuation_dB(volume_dB, sizeof(volume_dB), 255, 127);
+  TEST_ASSERT_EQUAL_STRING("127.50", volume_dB);
+}
+
+void test_attenuation_with_balance(void)
+{
+  // Shifted to the left by lowering the right channel
+  formatAttenuation_dB(volume_dB, sizeof(volume_dB), 31, 124);
+  TEST_ASSERT_EQUAL_STRING("15.50/17.00", volume_dB);
+  // Shifted to the right by lowering the left channel
+  formatAttenuation_dB(volume_dB, sizeof(volume_dB), 31, 128);
+  TEST_ASSERT_EQUAL_STRING("16.00/15.50", volume_dB);
+  // Outside the balance range - not shown
+  formatAttenuation_dB(volume_dB, sizeof(volume_dB), 31, 117);
+  TEST_ASSERT_EQUAL_STRING("15.50", volume_dB);
+  // The longest text fits
+  formatAttenuation_dB(volume_dB, sizeof(volume_dB), 255, 136);
+  TEST_ASSERT_EQUAL_STRING("132.00/127.50", volume_dB);
+}
+
+void test_all_fields(void)
+{
+  TEST_ASSERT_EQUAL_STRING("{\"OnState\":\"On\",\"Input\":\"Streamer  \",\"VolumeSteps\":60,\"Volume\":45,\"Volume_dB\":\"15.50\",\"Temp1\":42,\"Temp2\":38}",
+                           serializeWebState(values, buffer, sizeof(buffer)));
+}
+
+void test_only_the_given_fields(void)
+{
+  WebStateValues Volume = WebStateValues();
+  Volume.HasVolume = true;
+  Volume.VolumeSteps = 60;
+  Volume.Volume = 45;
+  Volume.Volume_dB = volume_dB;
+  TEST_ASSERT_EQUAL_STRING("{\"VolumeSteps\":60,\"Volume\":45,\"Volume_dB\":\"15.50\"}", serializeWebState(Volume, buffer, sizeof(buffer)));
+
+  WebStateValues OnState = WebStateValues();
+  OnState.OnState = "Standby";
+  TEST_ASSERT_EQUAL_STRING("{\"OnState\":\"Standby\"}", serializeWebState(OnState, buffer, sizeof(buffer)));
+}
+
+void test_no_heap_allocations(void)
+{
+  // A burst of state messages as sent while the volume is turned
+  unsigned long Before = allocations;
+  for (uint16_t i = 0; i < 10000; i++)
+  {
+    values.Volume = i % 61;
+    formatAttenuation_dB(volume_dB, sizeof(volume_dB), i % 256, 118 + i % 19);
+    serializeWebState(values, buffer, sizeof(buffer));
+  }
+  TEST_ASSERT_EQUAL_UINT32(0, allocations - Before);
+}
+
+int main()
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_attenuation_has_half_dB_steps);
+  RUN_TEST(test_attenuation_with_balance);
+  RUN_TEST(test_all_fields);
+  RUN_TEST(test_only_the_given_fields);
+  RUN_TEST(test_no_heap_allocations);
+  return UNITY_END();
+}
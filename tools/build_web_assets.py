@@ -0,0 +1,68 @@
+#
+# Prepare the files in data/ for the file system image of the web server (PlatformIO extra script) for MezmerizeB1Buffer
+#
+# Copyright (c) 2023 Carsten Grønning, Jan Abkjer Tofft
+#
+# The prepared files are written to <build dir>/data, which is used for the file system image instead of data/:
+# - Other files than the pages (.html) are renamed with a hash of their content (style.css -> static/style.1a2b3c4d.css) and the
+#   references to them in the pages are changed to the new names. They are served from /static/ with a long cache lifetime, as a
+#   changed file gets a new name
+# - All files are gzipped - the web server sends name.gz with Content-Encoding: gzip when name is asked for. Except the pages in TEMPLATES:
+#   their placeholders (%STATE% ...) are replaced while they are sent (see processor() in main.cpp), which can not be done to gzipped files
+#
+
+Import("env")
+
+import gzip
+import hashlib
+import os
+import shutil
+
+STATIC_DIR = "static"
+TEMPLATES = ["index.html"]
+
+
+def write_gzipped(path, data):
+    # mtime=0 so the same files give the same image
+    with open(path + ".gz", "wb") as f:
+        with gzip.GzipFile(filename="", mode="wb", fileobj=f, compresslevel=9, mtime=0) as gz:
+            gz.write(data)
+
+
+def build_web_assets(source, target):
+    if os.path.isdir(target):
+        shutil.rmtree(target)
+    os.makedirs(os.path.join(target, STATIC_DIR))
+
+    renamed = {}
+    pages = []
+    for name in sorted(os.listdir(source)):
+        path = os.path.join(source, name)
+        if not os.path.isfile(path):
+            continue
+        with open(path, "rb") as f:
+            data = f.read()
+        if name.endswith(".html"):
+            pages.append((name, data))
+            continue
+        base, ext = os.path.splitext(name)
+        hashed = "%s.%s%s" % (base, hashlib.sha256(data).hexdigest()[:8], ext)
+        renamed[name] = "/%s/%s" % (STATIC_DIR, hashed)
+        write_gzipped(os.path.join(target, STATIC_DIR, hashed), data)
+
+    for name, data in pages:
+        page = data.decode("utf-8")
+        for old, new in renamed.items():
+            page = page.replace('"%s"' % old, '"%s"' % new)
+        if name in TEMPLATES:
+            with open(os.path.join(target, name), "wb") as f:
+                f.write(page.encode("utf-8"))
+        else:
+            write_gzipped(os.path.join(target, name), page.encode("utf-8"))
+
+    print("Web assets prepared in %s: %s" % (target, ", ".join(sorted(renamed.values()))))
+
+
+target = os.path.join(env.subst("$BUILD_DIR"), "data")
+build_web_assets(env.subst("$PROJECT_DATA_DIR"), target)
+env.Replace(PROJECT_DATA_DIR=target)